@@ -0,0 +1,518 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <stdexcept>
+
+#include "engine.hpp"
+#include "dataset.hpp"
+#include "layer.hpp"
+
+using namespace std;
+
+// Microbenchmarks of the core kernels over a grid of layer sizes, batch sizes and
+// thread counts. Results are printed, written as JSON, and compared to a baseline
+// written by an earlier run, a p50 slower than the baseline by more than the
+// threshold being reported as a regression.
+//
+// neuralnetwork_bench [--quick] [--filter text] [--output file] [--baseline file]
+//                     [--threshold ratio] [--min-time seconds]
+
+struct Options
+{
+    bool quick = false;
+    string filter;
+    string output;
+    string baseline;
+    double threshold = 0.1;
+    double minTime = 0.2;
+};
+
+struct Result
+{
+    string id;
+    string name;
+    string shape;
+    size_t batch = 0;
+    size_t threads = 1;
+    
+    // Work of one call, for the rates
+    double samples = 0;
+    double flops = 0;
+    double bytes = 0;
+    
+    // Seconds per call, one value per repetition
+    vector<double> seconds;
+    
+    double percentile(const double& p) const
+    {
+        vector<double> sorted(this->seconds);
+        sort(sorted.begin(), sorted.end());
+        const size_t rank((size_t)ceil(p * sorted.size()));
+        return sorted[min(sorted.size() - 1, rank ? rank - 1 : 0)];
+    }
+    
+    double mean() const
+    {
+        double sum(0);
+        for(const double& s:this->seconds)
+        {
+            sum += s;
+        }
+        return sum / this->seconds.size();
+    }
+};
+
+class Bench
+{
+public:
+    explicit Bench(const Options& options):m_options(options){}
+    
+    // Times f, each repetition calling it enough times to last about 50 us.
+    // Repetitions go on until minTime has elapsed, with at least minRepetitions.
+    void run(Result result, const function<void()>& f, const size_t& minRepetitions = 5)
+    {
+        result.id = result.name + "/" + result.shape;
+        if(result.batch)
+        {
+            result.id += "/batch=" + to_string(result.batch);
+        }
+        result.id += "/threads=" + to_string(result.threads);
+        if(!this->m_options.filter.empty() and result.id.find(this->m_options.filter) == string::npos)
+        {
+            return;
+        }
+        
+        // Warm-up call, also used to size the repetitions
+        auto start(chrono::steady_clock::now());
+        f();
+        const double first(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        const size_t calls(max<size_t>(1, (size_t)(50e-6 / max(first, 1e-9))));
+        
+        const auto end(chrono::steady_clock::now() + chrono::duration<double>(this->m_options.minTime));
+        while(result.seconds.size() < minRepetitions or (chrono::steady_clock::now() < end and result.seconds.size() < 10000))
+        {
+            start = chrono::steady_clock::now();
+            for(size_t i(0); i<calls; i++)
+            {
+                f();
+            }
+            result.seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count() / calls);
+        }
+        
+        this->_print(result);
+        this->m_results.push_back(result);
+    }
+    
+    void loadBaseline(const string& fileName)
+    {
+        // Reads back the format of writeJson, one benchmark per line
+        ifstream file(fileName);
+        if(!file.is_open())
+        {
+            throw logic_error("Could not open filename : "+fileName);
+        }
+        string line;
+        while(getline(file, line))
+        {
+            const size_t id(line.find("\"id\": \"")), p50(line.find("\"p50_us\": "));
+            if(id == string::npos or p50 == string::npos)
+            {
+                continue;
+            }
+            const size_t begin(id + 7);
+            this->m_baseline[line.substr(begin, line.find('"', begin) - begin)] = stod(line.substr(p50 + 10)) * 1e-6;
+        }
+    }
+    
+    void writeJson(const string& fileName) const
+    {
+        ofstream file(fileName);
+        if(!file.is_open())
+        {
+            throw logic_error("Could not open filename : "+fileName);
+        }
+        file << "{\n  \"benchmarks\": [\n";
+        for(size_t i(0); i<this->m_results.size(); i++)
+        {
+            const Result& r(this->m_results[i]);
+            const double p50(r.percentile(.5));
+            file << "    {\"id\": \"" << r.id << "\", \"name\": \"" << r.name << "\", \"shape\": \"" << r.shape
+                 << "\", \"batch\": " << r.batch << ", \"threads\": " << r.threads << ", \"repetitions\": " << r.seconds.size()
+                 << ", \"p50_us\": " << p50 * 1e6 << ", \"p90_us\": " << r.percentile(.9) * 1e6 << ", \"p99_us\": " << r.percentile(.99) * 1e6
+                 << ", \"mean_us\": " << r.mean() * 1e6
+                 << ", \"samples_per_s\": " << r.samples / p50 << ", \"gflops\": " << r.flops / p50 * 1e-9 << ", \"mb_per_s\": " << r.bytes / p50 * 1e-6 << "}"
+                 << (i+1 < this->m_results.size() ? "," : "") << "\n";
+        }
+        file << "  ]\n}\n";
+    }
+    
+    // Count of benchmarks slower than the baseline by more than the threshold
+    size_t regressions() const
+    {
+        size_t count(0);
+        for(const Result& r:this->m_results)
+        {
+            auto base(this->m_baseline.find(r.id));
+            count += base != this->m_baseline.end() and r.percentile(.5) > base->second * (1 + this->m_options.threshold);
+        }
+        return count;
+    }
+
+private:
+    const Options& m_options;
+    vector<Result> m_results;
+    map<string, double> m_baseline;
+    
+    void _print(const Result& r) const
+    {
+        const double p50(r.percentile(.5));
+        cout << left << setw(52) << r.id << right << fixed << setprecision(1)
+             << setw(12) << p50 * 1e6 << " us p50" << setw(12) << r.percentile(.99) * 1e6 << " us p99";
+        if(r.samples)
+        {
+            cout << setw(14) << setprecision(0) << r.samples / p50 << " samples/s";
+        }
+        if(r.flops)
+        {
+            cout << setw(9) << setprecision(2) << r.flops / p50 * 1e-9 << " GFLOP/s";
+        }
+        if(r.bytes)
+        {
+            cout << setw(9) << setprecision(0) << r.bytes / p50 * 1e-6 << " MB/s";
+        }
+        auto base(this->m_baseline.find(r.id));
+        if(base != this->m_baseline.end())
+        {
+            const double ratio(p50 / base->second);
+            cout << setprecision(2) << "  x" << ratio << (ratio > 1 + this->m_options.threshold ? " REGRESSION" : "");
+        }
+        cout << defaultfloat << setprecision(6) << endl;
+    }
+};
+
+static string shapeName(const vector<int>& sizes)
+{
+    string name;
+    for(const int& s:sizes)
+    {
+        name += (name.empty() ? "" : "-") + to_string(s);
+    }
+    return name;
+}
+
+// Multiply-adds of the weights of a topology, counted as 2 flops
+static double forwardFlops(const vector<int>& sizes)
+{
+    double flops(0);
+    for(size_t l(0); l+1<sizes.size(); l++)
+    {
+        flops += 2. * sizes[l] * sizes[l+1];
+    }
+    return flops;
+}
+
+// Random compact samples with uniform labels, MNIST-like when inputSize is 784
+static void makeDataset(Dataset& dataset, const size_t& inputSize, const size_t& classes, const size_t& trainingSize, const size_t& validationSize)
+{
+    mt19937 generator(1);
+    uniform_int_distribution<int> pixel(0, 255), label(0, classes - 1);
+    auto training(dataset.reserveTrainingData(trainingSize, inputSize, classes, 1.f/255));
+    for(size_t i(0); i<trainingSize * inputSize; i++)
+    {
+        training.first[i] = pixel(generator);
+    }
+    for(size_t i(0); i<trainingSize; i++)
+    {
+        training.second[i] = label(generator);
+    }
+    auto validation(dataset.reserveValidationData(validationSize));
+    for(size_t i(0); i<validationSize * inputSize; i++)
+    {
+        validation.first[i] = pixel(generator);
+    }
+    for(size_t i(0); i<validationSize; i++)
+    {
+        validation.second[i] = label(generator);
+    }
+}
+
+static void benchLayers(Bench& bench, const Options& options)
+{
+    const vector<pair<int, int>> shapes(options.quick ? vector<pair<int, int>>{{784, 100}} : vector<pair<int, int>>{{784, 30}, {784, 100}, {100, 10}, {512, 512}});
+    const vector<size_t> batches(options.quick ? vector<size_t>{1, 256} : vector<size_t>{1, 16, 256});
+    for(const auto& [in, out]:shapes)
+    {
+        HiddenLayer layer(in, out, ActivationType::Sigmoid);
+        const string shape(to_string(in) + "x" + to_string(out));
+        for(const size_t& batch:batches)
+        {
+            const MatrixXf input(MatrixXf::Random(in, batch).cwiseAbs());
+            const MatrixXf product(MatrixXf::Random(out, batch));
+            MatrixXf output, next;
+            LayerBuffers buffers;
+            layer.feedForwardAndSave(input, buffers);
+            
+            Result r;
+            r.shape = shape;
+            r.batch = batch;
+            r.samples = batch;
+            r.flops = 2. * in * out * batch;
+            
+            r.name = "feedForward";
+            bench.run(r, [&]{ layer.feedForward(input, output); });
+            r.name = "feedForwardAndSave";
+            bench.run(r, [&]{ layer.feedForwardAndSave(input, buffers); });
+            
+            // getDelta consumes its input, the copy is part of the timing
+            r.name = "getDelta";
+            bench.run(r, [&]{ next = product; layer.getDelta(next, buffers); });
+            r.name = "updateCost";
+            bench.run(r, [&]{ layer.updateCost(input, buffers); });
+        }
+    }
+}
+
+static vector<vector<int>> topologies(const Options& options)
+{
+    if(options.quick)
+    {
+        return {{784, 100, 10}};
+    }
+    return {{784, 30, 10}, {784, 100, 10}, {784, 256, 128, 10}};
+}
+
+static void benchBackprop(Bench& bench, const Options& options)
+{
+    const vector<size_t> batches(options.quick ? vector<size_t>{16} : vector<size_t>{16, 256});
+    for(const vector<int>& sizes:topologies(options))
+    {
+        // Same sequence of layer calls as the batched Network::_backprop
+        vector<BaseLayer*> layers;
+        for(size_t l(0); l+2<sizes.size(); l++)
+        {
+            layers.push_back(new HiddenLayer(sizes[l], sizes[l+1], ActivationType::Sigmoid));
+        }
+        layers.push_back(new OutputLayer(sizes[sizes.size()-2], sizes.back(), ActivationType::Softmax, CostType::CrossEntropy));
+        
+        for(const size_t& batch:batches)
+        {
+            const MatrixXf input(MatrixXf::Random(sizes.front(), batch).cwiseAbs());
+            const MatrixXf expected(MatrixXf::Identity(sizes.back(), batch));
+            MatrixXf output;
+            vector<LayerBuffers> buffers(layers.size());
+            
+            Result r;
+            r.name = "backprop";
+            r.shape = shapeName(sizes);
+            r.batch = batch;
+            r.samples = batch;
+            r.flops = 3 * forwardFlops(sizes) * batch;
+            bench.run(r, [&]
+            {
+                output = expected;
+                layers.front()->feedForwardAndSave(input, buffers.front());
+                for(size_t l(1); l<layers.size(); l++)
+                {
+                    layers[l]->feedForwardAndSave(buffers[l-1].activation, buffers[l]);
+                }
+                for(size_t l(layers.size()); l-->0;)
+                {
+                    if(l+1 == layers.size())
+                    {
+                        static_cast<OutputLayer*>(layers[l])->getDelta(output, buffers[l]);
+                    }
+                    else
+                    {
+                        static_cast<HiddenLayer*>(layers[l])->getDelta(output, buffers[l]);
+                    }
+                    layers[l]->updateCost(l ? buffers[l-1].activation : input, buffers[l]);
+                }
+            });
+        }
+        
+        for(BaseLayer* l:layers)
+        {
+            delete l;
+        }
+    }
+}
+
+static void benchTraining(Bench& bench, const Options& options)
+{
+    const size_t trainingSize(options.quick ? 2000 : 10000), validationSize(options.quick ? 2000 : 10000);
+    const vector<size_t> threads(options.quick ? vector<size_t>{1, 2} : vector<size_t>{1, 2, 4});
+    const vector<size_t> batches(options.quick ? vector<size_t>{10} : vector<size_t>{10, 64});
+    
+    Dataset dataset;
+    makeDataset(dataset, 784, 10, trainingSize, validationSize);
+    
+    // SGD announces itself on every call
+    streambuf* console(cout.rdbuf());
+    ostringstream silent;
+    
+    for(const vector<int>& sizes:topologies(options))
+    {
+        Network network(sizes.data(), (int)sizes.size(), ActivationType::Softmax, CostType::CrossEntropy);
+        for(const size_t& t:threads)
+        {
+            for(const size_t& batch:batches)
+            {
+                TrainingParameters parameters;
+                parameters.miniBatchSize = batch;
+                parameters.epoch = 1;
+                parameters.eta = .1f;
+                parameters.threads = t;
+                
+                Result r;
+                r.name = "sgdEpoch";
+                r.shape = shapeName(sizes);
+                r.batch = batch;
+                r.threads = t;
+                r.samples = trainingSize / batch * batch;
+                r.flops = 3 * forwardFlops(sizes) * r.samples;
+                bench.run(r, [&]
+                {
+                    cout.rdbuf(silent.rdbuf());
+                    network.SGD(dataset, parameters);
+                    cout.rdbuf(console);
+                    silent.str("");
+                }, 3);
+            }
+            
+            Result r;
+            r.name = "evaluateAccuracy";
+            r.shape = shapeName(sizes);
+            r.threads = t;
+            r.samples = validationSize;
+            r.flops = forwardFlops(sizes) * validationSize;
+            bench.run(r, [&]{ network.evaluate(dataset, 1, t); }, 3);
+        }
+    }
+}
+
+static void benchSerialization(Bench& bench, const Options& options)
+{
+    const filesystem::path directory(filesystem::temp_directory_path());
+    const string modelFile((directory / "bench_model.bin").string()), mappedModelFile((directory / "bench_model.nnmd").string());
+    const string datasetFile((directory / "bench_dataset.bin").string()), mappedDatasetFile((directory / "bench_dataset.nnds").string());
+    
+    const vector<int> sizes(options.quick ? vector<int>{784, 100, 10} : vector<int>{784, 256, 128, 10});
+    Network network(sizes.data(), (int)sizes.size(), ActivationType::Softmax, CostType::CrossEntropy);
+    network.toBinary(modelFile);
+    network.toMapped(mappedModelFile);
+    
+    Dataset dataset;
+    makeDataset(dataset, 784, 10, options.quick ? 5000 : 20000, 1000);
+    dataset.toBinary(datasetFile);
+    dataset.toMapped(mappedDatasetFile);
+    
+    Result r;
+    r.shape = shapeName(sizes);
+    
+    r.bytes = filesystem::file_size(modelFile);
+    r.name = "model.toBinary";
+    bench.run(r, [&]{ network.toBinary(modelFile); });
+    r.name = "model.loadFile";
+    bench.run(r, [&]{ delete Network::loadFile(modelFile); });
+    
+    r.bytes = filesystem::file_size(mappedModelFile);
+    r.name = "model.toMapped";
+    bench.run(r, [&]{ network.toMapped(mappedModelFile); });
+    r.name = "model.loadMapped";
+    bench.run(r, [&]{ delete Network::loadMapped(mappedModelFile, false); });
+    r.name = "model.loadMappedInPlace";
+    bench.run(r, [&]{ delete Network::loadMapped(mappedModelFile, true); });
+    
+    r.shape = "784x" + to_string(dataset.trainingSize() + dataset.validationSize());
+    r.samples = dataset.trainingSize() + dataset.validationSize();
+    
+    r.bytes = filesystem::file_size(datasetFile);
+    r.name = "dataset.toBinary";
+    bench.run(r, [&]{ dataset.toBinary(datasetFile); });
+    r.name = "dataset.loadBinary";
+    bench.run(r, [&]{ Dataset loaded(datasetFile); });
+    
+    r.bytes = filesystem::file_size(mappedDatasetFile);
+    r.name = "dataset.toMapped";
+    bench.run(r, [&]{ dataset.toMapped(mappedDatasetFile); });
+    r.name = "dataset.loadMapped";
+    bench.run(r, [&]{ Dataset loaded(mappedDatasetFile); });
+    
+    for(const string& f:{modelFile, mappedModelFile, datasetFile, mappedDatasetFile})
+    {
+        filesystem::remove(f);
+    }
+}
+
+int main(int argc, const char * argv[])
+{
+    Options options;
+    for(int i(1); i<argc; i++)
+    {
+        const string arg(argv[i]);
+        const bool hasValue(i+1 < argc);
+        if(arg == "--quick")
+        {
+            options.quick = true;
+        }
+        else if(arg == "--filter" and hasValue)
+        {
+            options.filter = argv[++i];
+        }
+        else if(arg == "--output" and hasValue)
+        {
+            options.output = argv[++i];
+        }
+        else if(arg == "--baseline" and hasValue)
+        {
+            options.baseline = argv[++i];
+        }
+        else if(arg == "--threshold" and hasValue)
+        {
+            options.threshold = stod(argv[++i]);
+        }
+        else if(arg == "--min-time" and hasValue)
+        {
+            options.minTime = stod(argv[++i]);
+        }
+        else
+        {
+            cerr << "Usage : " << argv[0] << " [--quick] [--filter text] [--output file] [--baseline file] [--threshold ratio] [--min-time seconds]\n";
+            return 2;
+        }
+    }
+    
+    Bench bench(options);
+    if(!options.baseline.empty())
+    {
+        bench.loadBaseline(options.baseline);
+    }
+    
+    benchLayers(bench, options);
+    benchBackprop(bench, options);
+    benchTraining(bench, options);
+    benchSerialization(bench, options);
+    
+    if(!options.output.empty())
+    {
+        bench.writeJson(options.output);
+        cout << "Results written to " << options.output << "\n";
+    }
+    
+    const size_t regressions(bench.regressions());
+    if(regressions)
+    {
+        cout << regressions << " benchmarks slower than the baseline by more than " << options.threshold * 100 << "%\n";
+        return 1;
+    }
+    return 0;
+}
@@ -2,7 +2,9 @@
 #define algebra_hpp
 
 #include <stdio.h>
+#include <variant>
 #include <Eigen/Dense>
+#include "simd.hpp"
 
 using Eigen::MatrixXf;
 using Eigen::VectorXf;
@@ -19,50 +21,70 @@ enum class ActivationType : unsigned char
     Softmax
 };
 
+// Activations and costs are plain classes held by value in a std::variant, resolved once
+// from the runtime types when a layer is built. std::visit on these variants compiles to a
+// switch over direct calls, so the per-sample path makes no virtual call.
 class Activation
 {
 public:
-    virtual ~Activation() = default;
-    virtual Activation* clone() const = 0;
-    virtual void main(VectorXf& input) const = 0;
-    virtual void prim(const VectorXf& activation, VectorXf& output) const = 0;
+    // Accuracy of exp in main, see simd.hpp
+    void setExpMode(const ExpMode& mode) { this->m_expMode = mode; }
+    
+protected:
+    ExpMode m_expMode = ExpMode::Exact;
 };
 
 class Sigmoid : public Activation
 {
-    Activation* clone() const override;
-    void main(VectorXf& input) const override;
-    void prim(const VectorXf& activation, VectorXf& output) const override;
+public:
+    void main(VectorXf& input) const;
+    void prim(const VectorXf& activation, VectorXf& output) const;
+    
+    // Batched versions, one sample per column
+    void main(MatrixXf& input) const;
+    void prim(const MatrixXf& activation, MatrixXf& output) const;
+    
+    // Fused layer output : bias added to every column, activation, and derivative when
+    // not null, in one pass over memory. Same results as main then prim.
+    void main(VectorXf& input, const float* bias, VectorXf* derivative) const;
+    void main(MatrixXf& input, const float* bias, MatrixXf* derivative) const;
 };
 
 class Softmax : public Activation
-{
-    Activation* clone() const override;
-    void main(VectorXf& input) const override;
-    void prim(const VectorXf& activation, VectorXf& output) const override;
-};
-
-class Cost
 {
 public:
-    virtual ~Cost() = default;
-    virtual void getGradient(const VectorXf& computedOutput, const VectorXf& expectedOutput, VectorXf& result) const = 0;
+    void main(VectorXf& input) const;
+    void prim(const VectorXf& activation, VectorXf& output) const;
+    void main(MatrixXf& input) const;
+    void prim(const MatrixXf& activation, MatrixXf& output) const;
+    void main(VectorXf& input, const float* bias, VectorXf* derivative) const;
+    void main(MatrixXf& input, const float* bias, MatrixXf* derivative) const;
 };
 
-class Quadratic : public Cost
+using ActivationEngine = std::variant<Sigmoid, Softmax>;
+ActivationEngine makeActivation(const ActivationType& type);
+
+// Output error (BP1). derivative is the derivative of the output activation.
+// getLoss sums the cost over every column, for monitoring only.
+class Quadratic
 {
 public:
-    Quadratic(VectorXf* derivative);
-    void getGradient(const VectorXf& computedOutput, const VectorXf& expectedOutput, VectorXf& result) const override;
-    
-private:
-    VectorXf* m_derivative;
+    void getGradient(const VectorXf& computedOutput, const VectorXf& expectedOutput, const VectorXf& derivative, VectorXf& result) const;
+    void getGradient(const MatrixXf& computedOutput, const MatrixXf& expectedOutput, const MatrixXf& derivative, MatrixXf& result) const;
+    float getLoss(const VectorXf& computedOutput, const VectorXf& expectedOutput) const;
+    float getLoss(const MatrixXf& computedOutput, const MatrixXf& expectedOutput) const;
 };
 
-class CrossEntropy : public Cost
+// Loss is -sum(y ln a + (1-y) ln(1-a)), with a clamped away from 0 and 1
+class CrossEntropy
 {
 public:
-    CrossEntropy();
-    void getGradient(const VectorXf& computedOutput, const VectorXf& expectedOutput, VectorXf& result) const override;
+    void getGradient(const VectorXf& computedOutput, const VectorXf& expectedOutput, const VectorXf& derivative, VectorXf& result) const;
+    void getGradient(const MatrixXf& computedOutput, const MatrixXf& expectedOutput, const MatrixXf& derivative, MatrixXf& result) const;
+    float getLoss(const VectorXf& computedOutput, const VectorXf& expectedOutput) const;
+    float getLoss(const MatrixXf& computedOutput, const MatrixXf& expectedOutput) const;
 };
+
+using CostEngine = std::variant<Quadratic, CrossEntropy>;
+CostEngine makeCost(const CostType& type);
 #endif /* algebra_hpp */
@@ -0,0 +1,94 @@
+#ifndef checkpoint_hpp
+#define checkpoint_hpp
+
+#include <stdio.h>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <condition_variable>
+#include <Eigen/Dense>
+
+#include "algebra.hpp"
+
+using Eigen::VectorXf;
+
+// Everything Network::SGD needs to continue a run exactly : a snapshot taken between two
+// mini-batches. The position is epoch and batch, mini-batches already trained in that epoch.
+struct TrainingState
+{
+    static constexpr uint32_t Magic = 0x4b434e4e; // "NNCK"
+    static constexpr uint32_t Version = 2;
+    
+    // Topology, checked against the network on resume
+    ActivationType activationType;
+    CostType costType;
+    std::vector<int> sizes;
+    
+    size_t epoch = 0;
+    size_t batch = 0;
+    size_t batchCount = 0; // Mini-batches since the start of training
+    
+    // Tensors numbered as in Optimizer, weights of layer l at 2*l and its biases at 2*l+1
+    std::vector<VectorXf> weights;
+    std::vector<VectorXf> optimizerState;
+    size_t optimizerSteps = 0;
+    
+    // Text state of the global Generator of dataset.cpp and of BaseLayer::Generator
+    std::string datasetGenerator;
+    std::string layerGenerator;
+    
+    // Order of the epoch, batch is the position in it, see BatchSource::saveState
+    std::vector<char> sourceState;
+    
+    // Early stopping
+    float bestAccuracy = -1;
+    size_t bestBatch = 0;
+    size_t staleCount = 0;
+    std::vector<VectorXf> bestWeights;
+    
+    // Writes to fileName.tmp then renames it over fileName, so that a reader or a
+    // preempted run always finds either the previous checkpoint or the new one
+    void save(const std::string& fileName) const;
+    void load(const std::string& fileName);
+};
+
+// Writes training states from a background thread, training only pays for the snapshot.
+// A state submitted while the previous one is being written waits in a single slot and
+// replaces any state already waiting there : only the latest one matters.
+class CheckpointWriter
+{
+public:
+    explicit CheckpointWriter(const std::string& fileName);
+    CheckpointWriter(const CheckpointWriter& other) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter& other) = delete;
+    
+    // Writes the waiting state before returning
+    ~CheckpointWriter();
+    
+    // Rethrows the error of a previous write
+    void submit(std::unique_ptr<TrainingState> state);
+    
+    // Blocks until every submitted state is written, then rethrows any write error
+    void flush();
+    
+    size_t written() const;
+    
+private:
+    std::string m_fileName;
+    
+    std::thread m_thread;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::unique_ptr<TrainingState> m_pending;
+    bool m_writing;
+    bool m_stop;
+    size_t m_written;
+    std::exception_ptr m_error;
+    
+    void _run();
+};
+
+#endif /* checkpoint_hpp */
@@ -0,0 +1,55 @@
+#ifndef collective_hpp
+#define collective_hpp
+
+#include <stdio.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// One process of a data-parallel job. Ranks form a ring : each one listens on its own
+// endpoint, connects to the next rank and accepts the previous one. Endpoints are UNIX
+// socket paths (anything containing a '/') or host:port for TCP. Every rank must make
+// the same calls in the same order.
+class Communicator
+{
+public:
+    // Blocks until both neighbours are connected
+    Communicator(const size_t& rank, const std::vector<std::string>& endpoints);
+    Communicator(const Communicator& other) = delete;
+    Communicator& operator=(const Communicator& other) = delete;
+    ~Communicator();
+    
+    // Rank of a job started by neuralnetwork_launch, read from NN_RANK and NN_ENDPOINTS
+    // (comma separated), checked against NN_WORLD_SIZE when set. Null when they are not set.
+    static std::shared_ptr<Communicator> fromEnvironment();
+    
+    size_t rank() const { return this->m_rank; }
+    size_t size() const { return this->m_size; }
+    
+    // Sum over every rank, in place. Ring reduce-scatter then allgather : each rank sends
+    // 2(size-1)/size of the data whatever the count of ranks, and all end with the same bits.
+    void allreduce(float* data, const size_t& n);
+    
+    // Copy of the data of root on every rank
+    void broadcast(float* data, const size_t& n, const size_t& root = 0);
+    
+    void barrier();
+    
+private:
+    size_t m_rank;
+    size_t m_size;
+    int m_listener;
+    int m_next;
+    int m_previous;
+    std::string m_path;
+    std::vector<float> m_received;
+    
+    void _connect(const std::vector<std::string>& endpoints);
+    void _close();
+    
+    // Sends to the next rank while receiving from the previous one, so that the ring never
+    // blocks on full socket buffers
+    void _exchange(const void* send, const size_t& sendBytes, void* receive, const size_t& receiveBytes);
+};
+
+#endif /* collective_hpp */
@@ -4,10 +4,19 @@
 #include <stdio.h>
 #include <Eigen/Dense>
 #include <vector>
+#include <random>
+#include <memory>
+#include <cstdint>
 #include <iostream>
+#include <functional>
+#include "mapping.hpp"
 
+using Eigen::MatrixXf;
 using Eigen::VectorXf;
 
+// Shuffles the training samples, saved by checkpoints
+extern std::mt19937 Generator;
+
 struct DataPair
 {
     DataPair(const VectorXf& input, const VectorXf& output);
@@ -19,39 +28,146 @@ struct DataPair
     friend std::ostream& operator<<(std::ostream& os, const DataPair& datapair);
 };
 
+// Non-owning view of one sample stored in a Dataset
+struct DataView
+{
+    Eigen::Ref<const VectorXf> input;
+    Eigen::Ref<const VectorXf> output;
+};
+
+enum class SampleType : uint32_t
+{
+    Float32,
+    UInt8,   // Scaled to float by the dataset input scale
+    Float16, // IEEE half precision
+    Label    // One class index (uint16) standing for a one-hot output
+};
+
+// Bytes used by one sample of dim coefficients
+size_t sampleBytes(const SampleType& type, const size_t& dim);
+
+// Decode sample idx of a column-major block into dim floats
+void decodeSample(const SampleType& type, const char* block, const size_t& dim, const size_t& idx, const float& scale, float* dst);
+
+// Whether the count labels of a Label block are all below classes
+bool labelsInRange(const char* block, const size_t& count, const size_t& classes);
+
+// Header of the mapped dataset format. It is followed by 64-byte aligned blocks
+// holding samples one per column : training input, training output, validation
+// input and validation output, at the given offsets from the start of the file.
+struct DatasetFileHeader
+{
+    static constexpr uint32_t Magic = 0x53444e4e; // "NNDS"
+    static constexpr uint32_t Version = 1;
+    
+    uint32_t magic;
+    uint32_t version;
+    SampleType inputType;
+    SampleType outputType;
+    float inputScale; // Applied to integer inputs when converted to float
+    uint32_t reserved;
+    uint64_t inputSize;
+    uint64_t outputSize;
+    uint64_t trainingSize;
+    uint64_t validationSize;
+    uint64_t offsets[4];
+};
+
 class Dataset
 {
 public:
     Dataset();
+    // Loads either the mapped format, used in place, or the format written by toBinary
     Dataset(const std::string& filename);
-    ~Dataset();
+    void loadFile(const std::string& filename);
+    Dataset(const Dataset& other) = delete;
+    Dataset& operator=(const Dataset& other) = delete;
     
     void addTrainingData(DataPair* data[], const size_t& size);
     void addValidationData(DataPair* data[], const size_t& size);
     
+    // Compact samples : integer inputs converted with inputScale when batches are
+    // assembled, and class indices standing for one-hot outputs of classes coefficients
+    void addTrainingData(const uint8_t* inputs, const uint16_t* labels, const size_t& size, const size_t& inputSize, const size_t& classes, const float& inputScale);
+    void addValidationData(const uint8_t* inputs, const uint16_t* labels, const size_t& size);
+    
+    // Compact storage for size samples, returned as (inputs, labels) to be filled in place by the caller
+    std::pair<uint8_t*, uint16_t*> reserveTrainingData(const size_t& size, const size_t& inputSize, const size_t& classes, const float& inputScale);
+    std::pair<uint8_t*, uint16_t*> reserveValidationData(const size_t& size);
+    
+    // Re-encode the stored samples. With labels, one-hot outputs are stored as class indices.
+    void convertStorage(const SampleType& inputType, const float& inputScale = 1, const bool& labels = true);
+    
     size_t trainingSize() const;
     size_t validationSize() const;
+    size_t inputSize() const { return this->m_inputSize; }
+    size_t outputSize() const { return this->m_outputSize; }
+    
+    // Views on stored samples, only available for Float32 storage
+    DataView operator[](const size_t& i) const;
+    DataView getTestData(const size_t& i) const;
+    
+    // Pack training samples [offset, offset+size) of the current shuffle, one per column
+    void getBatch(const size_t& offset, const size_t& size, MatrixXf& input, MatrixXf& output) const;
+    void getValidationBatch(const size_t& offset, const size_t& size, MatrixXf& input, MatrixXf& output) const;
     
-    const DataPair& operator[](const size_t& i) const;
-    DataPair getTestData(const size_t& i) const;
+    // Validation inputs [offset, offset+size), one per column. Float32 storage is viewed in place,
+    // other types are decoded into buffer, which only grows when it has fewer than size columns.
+    Eigen::Map<const MatrixXf> getValidationInputs(const size_t& offset, const size_t& size, MatrixXf& buffer) const;
+    // Expected class of validation samples : the stored label, or the first largest output coefficient
+    void getValidationLabels(const size_t& offset, const size_t& size, size_t* labels) const;
+    
+    // Percentage of validation samples whose largest output is their expected class, 0 without
+    // validation samples. forward maps a block of inputs, one sample per column, to the outputs.
+    float validationAccuracy(const std::function<MatrixXf(const Eigen::Ref<const MatrixXf>& inputs)>& forward) const;
     
     void shuffle() const;
     
+    // Current order of the training samples, saved and restored by checkpoints
+    const std::vector<size_t>& order() const { return this->m_indices; }
+    void setOrder(const std::vector<size_t>& order) const;
+    
     void toBinary(const std::string& dest) const;
+    void toMapped(const std::string& dest) const;
     
 private:
+    // Samples of one split, one per column and contiguous in memory.
+    // Data either lives in the storage buffers or in m_mapping.
+    struct Samples
+    {
+        size_t size = 0;
+        const char* input = nullptr;
+        const char* output = nullptr;
+        
+        std::vector<char> inputStorage;
+        std::vector<char> outputStorage;
+    };
+    
     size_t m_inputSize;
     size_t m_outputSize;
     
-    size_t m_sizeTraining;
-    DataPair** m_training;
+    SampleType m_inputType;
+    SampleType m_outputType;
+    float m_inputScale;
+    
+    Samples m_training;
+    Samples m_validation;
+    
+    std::unique_ptr<MappedFile> m_mapping;
+    
+    // Training samples order, shuffled during SGD
+    mutable std::vector<size_t> m_indices;
     
-    size_t m_sizeValidation;
-    DataPair** m_validation;
+    void _gather(const Samples& samples, const size_t* indices, const size_t& offset, const size_t& size, MatrixXf& input, MatrixXf& output) const;
+    void _decode(const Samples& samples, MatrixXf& input, MatrixXf& output) const;
+    void _encode(Samples& samples, const MatrixXf& input, const MatrixXf& output);
+    DataView _view(const Samples& samples, const size_t& i) const;
     
-    std::vector<DataPair*>* m_data;
+    std::pair<uint8_t*, uint16_t*> _reserve(Samples& samples, const size_t& size);
+    void _resetIndices();
     
-    void _populate(DataPair** container, DataPair** data, const size_t& N);
+    void _loadBinary(std::ifstream& file);
+    void _loadMapped(const std::string& filename);
 };
 
 #endif /* dataset_hpp */
@@ -10,34 +10,203 @@
 #include "algebra.hpp"
 #include "dataset.hpp"
 #include "layer.hpp"
+#include "threadpool.hpp"
+#include "source.hpp"
+#include "optimizer.hpp"
+#include "telemetry.hpp"
+#include "prefetch.hpp"
+#include "collective.hpp"
 
+using Eigen::MatrixXf;
 using Eigen::VectorXf;
 
+struct TrainingParameters
+{
+    size_t miniBatchSize = 10;
+    size_t epoch = 1;
+    float eta = 3;
+    
+    // Update rule, plain SGD at eta when null. The optimizer keeps its state between
+    // calls to SGD as long as it is used with the same network.
+    std::shared_ptr<Optimizer> optimizer;
+    bool displayProgress = false;
+    
+    // Run each mini-batch as GEMMs over a matrix of samples instead of one GEMV per sample
+    bool batched = true;
+    
+    // Data-parallel training : each mini-batch is split in contiguous shares, one per thread.
+    // Gradients are reduced in thread order, so results only depend on the thread count.
+    // Shares always use the batched kernels.
+    size_t threads = 1;
+    
+    // Hogwild! mode : threads claim mini-batches on their own and update the shared
+    // weights without any lock or barrier. Not reproducible, only the epoch is synchronized.
+    bool asynchronous = false;
+    
+    // Data-parallel training across processes, one Communicator rank each. Every rank trains
+    // miniBatchSize samples of its shard per step and gradients are summed over the ring
+    // before the update, so the effective mini-batch is miniBatchSize times the rank count.
+    // Weights start from those of rank 0, which alone writes checkpoints and model files.
+    std::shared_ptr<Communicator> communicator;
+    
+    // Mini-batches prepared ahead by a background thread, in that many rotating buffers.
+    // The augmentation runs on that thread too, setting it alone prefetches with 2 buffers.
+    size_t prefetch = 0;
+    Augmentation augmentation;
+    
+    // Measure validation accuracy at the end of every epoch in the report
+    bool evaluateEachEpoch = false;
+    
+    // Early stopping, enabled by a non-zero patience. Validation accuracy is measured every
+    // validationInterval mini-batches, or at the end of every epoch when 0, and training stops
+    // after patience measurements without beating the best one by more than minDelta.
+    // Asynchronous training only measures at the end of epochs.
+    size_t patience = 0;
+    size_t validationInterval = 0;
+    float minDelta = 0;
+    
+    // Weights of the best measurement are kept in memory and restored at the end.
+    // They are also written with toBinary at each improvement when bestModelFile is set.
+    bool restoreBest = true;
+    std::string bestModelFile;
+    
+    // Per-phase and per-layer timers, throughput and training loss of every epoch.
+    // Disabled when null. The same object accumulates epochs over several calls.
+    std::shared_ptr<Telemetry> telemetry;
+    
+    // Checkpoints of weights, optimizer state, random generators and position, written to
+    // checkpointFile by a background thread every checkpointInterval mini-batches and every
+    // checkpointSeconds (0 disables either), and always at the end of training. With resume,
+    // an existing checkpointFile is loaded first and training goes on exactly from there.
+    std::string checkpointFile;
+    size_t checkpointInterval = 0;
+    float checkpointSeconds = 0;
+    bool resume = false;
+};
+
+struct EpochReport
+{
+    size_t epoch;
+    float seconds;
+    float samplesPerSecond;
+    float accuracy; // Negative when not evaluated
+    
+    void print() const;
+};
+
+struct TrainingReport
+{
+    std::vector<EpochReport> epochs;
+    
+    // Early stopping, best accuracy is negative when not used
+    float bestAccuracy = -1;
+    size_t bestBatch = 0; // Mini-batches trained at the best measurement
+    bool stoppedEarly = false;
+    
+    void print() const;
+};
+
+struct EvaluationReport
+{
+    size_t samples = 0;
+    size_t correct = 0;
+    
+    // Samples whose expected class is among the k largest outputs
+    size_t k = 1;
+    size_t topKCorrect = 0;
+    
+    // Sample counts, rows are expected classes and columns predicted ones
+    Eigen::Matrix<size_t, Eigen::Dynamic, Eigen::Dynamic> confusion;
+    
+    // Percentages
+    float accuracy() const;
+    float topKAccuracy() const;
+    
+    void print() const;
+};
+
+// Storage of the weights in a mapped model file. Biases always stay float.
+enum class WeightType : uint16_t
+{
+    Float32,
+    Float16,
+    BFloat16
+};
+
+// Header of the mapped model format. It is followed by the N layer sizes as uint32_t,
+// then for every layer its biases as floats and its weights, each block 64-byte aligned
+// from the start of the file. Float32 weights are column-major as in Network, reduced
+// precision weights are row-major for the InferenceModel kernels.
+struct ModelFileHeader
+{
+    static constexpr uint32_t Magic = 0x444d4e4e; // "NNMD"
+    static constexpr uint32_t Version = 1;
+    
+    uint32_t magic;
+    uint32_t version;
+    ActivationType activationType;
+    CostType costType;
+    WeightType weightType;
+    uint32_t sizeCount;
+};
+
+// Offsets of the bias and weight blocks of every layer, followed by the file size
+std::vector<size_t> modelBlockOffsets(const std::vector<int>& sizes, const size_t& weightBytes = sizeof(float));
+
+// Checks the header of a mapped model file and reads its layer sizes
+std::vector<int> readModelHeader(const MappedFile& mapping, ModelFileHeader& header, const std::string& fileName);
+
 class Network
 {
 public:
-    Network(const int sizes[], const int& N, const ActivationType& actiType, const CostType& costType);
+    // Weights are left uninitialized when initialize is false, for loaders to fill
+    Network(const int sizes[], const int& N, const ActivationType& actiType, const CostType& costType, const bool& initialize = true);
     Network(const Network& other);
     
     Network& operator=(const Network& other) = delete;
     Network& operator=(const Network&& other) = delete;
     ~Network();
     
+    // Loads either the mapped format, read in bulk, or the format written by toBinary
     static Network* loadFile(const std::string& fileName);
     static Network* loadBinary(boost::archive::binary_iarchive & ar);
     
+    // Loads the mapped format. With inPlace, weights are used directly from a private
+    // copy-on-write mapping of the file, otherwise each tensor is read with a single call.
+    static Network* loadMapped(const std::string& fileName, const bool& inPlace = true);
+    
     void SGD(const Dataset& dataset, const size_t& miniBatchSize, const size_t& epoch, const float& eta, const bool displayProgress = false);
+    TrainingReport SGD(const Dataset& dataset, const TrainingParameters& parameters);
+    
+    // Train from any source of mini-batches, such as a StreamingDataset. Accuracy is
+    // measured on the validation samples of the optional validation dataset.
+    TrainingReport SGD(BatchSource& source, const TrainingParameters& parameters, const Dataset* validation = nullptr);
     void feedForward(VectorXf& input) const;
     
+    // Batched inference, one sample per column. The raw buffer holds N inputs stored contiguously.
+    MatrixXf feedForwardBatch(const MatrixXf& inputs) const;
+    MatrixXf feedForwardBatch(const float* inputs, const size_t& N) const;
+    
+    // Read access for converters such as InferenceModel
+    const std::vector<int>& sizes() const { return this->m_sizes; }
+    const BaseLayer& layer(const size_t& l) const { return *this->m_layers[l]; }
+    
+    // Exact by default. Fast exp speeds up activations at a relative error below 1e-4.
+    void setExpMode(const ExpMode& mode);
+    
     void print() const;
     void to_csv(const std::string& dest) const;
     void toBinary(const std::string& dest) const;
     void toBinary(boost::archive::binary_oarchive & ar) const;
+    void toMapped(const std::string& dest) const;
     
     void getStats() const;
         
     float evaluateAccuracy(const Dataset& dataset) const;
     
+    // Single pass over the validation samples, by blocks shared between threads
+    EvaluationReport evaluate(const Dataset& dataset, const size_t& k = 1, const size_t& threads = 1) const;
+    
     const ActivationType activationType;
     const CostType costType;
     
@@ -47,7 +216,22 @@ private:
     std::vector<int> m_sizes;
     std::vector<BaseLayer*> m_layers;
     
+    // Set during SGD when telemetry is enabled
+    Telemetry* m_telemetry = nullptr;
+    
+    MatrixXf _feedForwardBatch(const Eigen::Ref<const MatrixXf>& inputs) const;
+    const MatrixXf& _feedForwardBatch(const Eigen::Ref<const MatrixXf>& inputs, MatrixXf& current, MatrixXf& next) const;
+    EvaluationReport _evaluate(const Dataset& dataset, const size_t& k, ThreadPool& pool) const;
+    
+    // Snapshot of every tensor, weights of layer l at 2*l and its biases at 2*l+1
+    void _copyWeights(std::vector<VectorXf>& weights) const;
+    void _restoreWeights(const std::vector<VectorXf>& weights);
+    
     //SGD functions
-    void _backprop(const DataPair& datapair) const;
+    void _runAsynchronousEpoch(BatchSource& source, const TrainingParameters& parameters, Optimizer& optimizer, ThreadPool& pool, std::vector<std::vector<LayerBuffers>>& buffers);
+    template<class... Buffers>
+    void _getDelta(const size_t& l, Buffers&... buffers) const;
+    void _backprop(const DataView& datapair) const;
+    void _backprop(const Eigen::Ref<const MatrixXf>& input, MatrixXf& output, std::vector<LayerBuffers>& buffers) const;
 };
 #endif /* engine_hpp */
@@ -0,0 +1,74 @@
+#ifndef inference_hpp
+#define inference_hpp
+
+#include <stdio.h>
+#include <memory>
+#include <vector>
+#include <string>
+#include <Eigen/Dense>
+
+#include "algebra.hpp"
+#include "dataset.hpp"
+#include "engine.hpp"
+#include "mapping.hpp"
+
+using Eigen::MatrixXf;
+using Eigen::VectorXf;
+
+// Inference-only copy of a trained Network with weights stored in half precision or
+// bfloat16, which halves the memory read by every forward pass. Weights are widened to
+// float on the fly and products are accumulated in float. Biases stay in float.
+// Files use the mapped model format with reduced precision weights, used in place.
+class InferenceModel
+{
+public:
+    InferenceModel(const Network& network, const WeightType& weightType);
+    InferenceModel(const InferenceModel& other) = delete;
+    InferenceModel& operator=(const InferenceModel& other) = delete;
+    
+    static InferenceModel* loadMapped(const std::string& fileName);
+    void toMapped(const std::string& dest) const;
+    
+    // Same interface as Network. Single samples run a GEMV straight from the reduced
+    // weights, batches convert blocks of rows to float and run GEMMs on them.
+    void feedForward(VectorXf& input) const;
+    MatrixXf feedForwardBatch(const MatrixXf& inputs) const;
+    MatrixXf feedForwardBatch(const float* inputs, const size_t& N) const;
+    
+    void setExpMode(const ExpMode& mode);
+    
+    float evaluateAccuracy(const Dataset& dataset) const;
+    
+    WeightType weightType() const { return this->m_weightType; }
+    const std::vector<int>& sizes() const { return this->m_sizes; }
+    
+    const ActivationType activationType;
+    const CostType costType;
+    
+private:
+    struct Layer
+    {
+        size_t inSize;
+        size_t outSize;
+        const float* biases;
+        const uint16_t* weights; // Row-major, one output per row
+        ActivationEngine activationEngine;
+    };
+    
+    InferenceModel(const std::vector<int>& sizes, const ActivationType& actiType, const CostType& costType, const WeightType& weightType);
+    
+    void _gemv(const Layer& layer, const float* x, float* y) const;
+    void _gemm(const Layer& layer, const Eigen::Ref<const MatrixXf>& inputs, MatrixXf& outputs) const;
+    MatrixXf _feedForwardBatch(const Eigen::Ref<const MatrixXf>& inputs) const;
+    
+    std::vector<int> m_sizes;
+    WeightType m_weightType;
+    std::vector<Layer> m_layers;
+    
+    // Either the converted tensors or the mapped file
+    std::vector<VectorXf> m_biasStorage;
+    std::vector<std::vector<uint16_t>> m_weightStorage;
+    std::shared_ptr<MappedFile> m_mapping;
+};
+
+#endif /* inference_hpp */
@@ -4,8 +4,11 @@
 #include <stdio.h>
 #include <random>
 #include <string>
+#include <memory>
 #include <Eigen/Dense>
 #include "algebra.hpp"
+#include "mapping.hpp"
+#include "optimizer.hpp"
 
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
@@ -13,28 +16,56 @@
 using Eigen::MatrixXf;
 using Eigen::VectorXf;
 
+// Scratch and gradient buffers used by the batched path, one sample per column.
+// Kept outside the layer so that several batches can run against the same weights.
+struct LayerBuffers
+{
+    MatrixXf activation;
+    MatrixXf derivative;
+    MatrixXf delta;
+    
+    MatrixXf deltaW;
+    VectorXf deltaB;
+    
+    // Sum gradients computed on another share of the batch
+    void accumulate(const LayerBuffers& other);
+};
+
 class BaseLayer
 {
 public:
     BaseLayer() = delete;
     
-    BaseLayer(const int& in, const int& out, const ActivationType& actiType);
+    // Weights and biases are left uninitialized, without drawing from the generator,
+    // when initialize is false. Loaders fill them afterwards.
+    BaseLayer(const int& in, const int& out, const ActivationType& actiType, const bool& initialize = true);
     BaseLayer(const BaseLayer& other);
     BaseLayer(BaseLayer&& other);
     
     virtual BaseLayer* clone() const = 0;
-    virtual ~BaseLayer();
+    virtual ~BaseLayer() = default;
     
     // Main methods
     void feedForward(VectorXf& a) const;
-    void feedForwardAndSave(VectorXf& a);
-    void updateCost(const VectorXf& activation);
+    // Saves the activation and its derivative, read back with getActivation
+    void feedForwardAndSave(const Eigen::Ref<const VectorXf>& input);
+    void updateCost(const Eigen::Ref<const VectorXf>& activation);
     const VectorXf& getActivation() const { return this->m_activation; }
     
-    void updateWeightAndBias(const float& K);
+    // Optimizer step on tensors 2*index and 2*index+1, clearing the gradient sums
+    void updateWeightAndBias(Optimizer& optimizer, const size_t& index);
+    
+    // Batched methods
+    void feedForward(const Eigen::Ref<const MatrixXf>& input, MatrixXf& output) const;
+    void feedForwardAndSave(const Eigen::Ref<const MatrixXf>& input, LayerBuffers& buffers) const;
+    void updateCost(const Eigen::Ref<const MatrixXf>& activation, LayerBuffers& buffers) const;
+    void updateWeightAndBias(Optimizer& optimizer, const size_t& index, LayerBuffers& buffers);
     
     // Virtual methods
     virtual void getDelta(VectorXf& a) = 0;
+    virtual void getDelta(MatrixXf& A, LayerBuffers& buffers) const = 0;
+    
+    void setExpMode(const ExpMode& mode);
     
     // Stats
     void getStat(float means[], float stds[]) const;
@@ -45,23 +76,44 @@ public:
     
     void toBinary(boost::archive::binary_oarchive & ar) const;
     void fromBinary(boost::archive::binary_iarchive & ar);
+    
+    // Raw column-major tensors, read and written in bulk by model files
+    const float* biasData() const { return this->m_biases.data(); }
+    const float* weightData() const { return this->m_weights.data(); }
+    float* biasData() { return this->m_biases.data(); }
+    float* weightData() { return this->m_weights.data(); }
+    
+    // Gradient sums of the per-sample path, same layouts
+    float* biasGradientData() { return this->m_deltaB.data(); }
+    float* weightGradientData() { return this->m_deltaW.data(); }
+    
+    // Use tensors stored in a mapped model file in place. The mapping is kept alive by the layer.
+    void bind(const std::shared_ptr<MappedFile>& mapping, float* biases, float* weights);
 
     bool equals(const BaseLayer& other) const;
     
+    // Draws initial weights, saved and restored by checkpoints
+    static std::mt19937& generator() { return Generator; }
+    
     const int inSize;
     const int outSize;
 protected:
     static std::mt19937 Generator;
     
-    // Current weights and biases
-    VectorXf m_biases;
-    MatrixXf m_weights;
+    // Owned weights and biases, released when the layer uses a mapped model file
+    VectorXf m_biasStorage;
+    MatrixXf m_weightStorage;
+    std::shared_ptr<MappedFile> m_mapping;
+    
+    // Current weights and biases, viewing either the storage or the mapping
+    Eigen::Map<VectorXf> m_biases;
+    Eigen::Map<MatrixXf> m_weights;
     
     // Temporary weights and biases
     VectorXf m_deltaB;
     MatrixXf m_deltaW;
     
-    Activation* m_activationEngine;
+    ActivationEngine m_activationEngine;
     
     VectorXf m_activation;
     VectorXf m_derivative;
@@ -71,33 +123,40 @@ protected:
     
 private:
     void _initializeBuffers();
+    void _bindStorage();
 };
 
-class HiddenLayer : public BaseLayer
+// Leaf classes are final : calls through HiddenLayer* or OutputLayer* are not virtual
+class HiddenLayer final : public BaseLayer
 {
 public :
-    HiddenLayer(const int& in, const int& out, const ActivationType& actiType);
+    HiddenLayer(const int& in, const int& out, const ActivationType& actiType, const bool& initialize = true);
     HiddenLayer(const HiddenLayer& other):BaseLayer(other){}
     HiddenLayer(const BaseLayer& other):BaseLayer(other){}
     
     BaseLayer* clone() const override;
     void getDelta(VectorXf& product_next) override;
+    void getDelta(MatrixXf& product_next, LayerBuffers& buffers) const override;
 };
 
-class OutputLayer : public BaseLayer
+class OutputLayer final : public BaseLayer
 {
 public:
-    OutputLayer(const int& in, const int& out, const ActivationType& actiType, const CostType& costType);
-    OutputLayer(const OutputLayer& other);
+    OutputLayer(const int& in, const int& out, const ActivationType& actiType, const CostType& costType, const bool& initialize = true);
+    OutputLayer(const OutputLayer& other) = default;
     OutputLayer(OutputLayer&& other) = delete;
     OutputLayer& operator=(const OutputLayer& other) = delete;
     OutputLayer& operator=(OutputLayer&& other) = delete;
-    ~OutputLayer();
     
     BaseLayer* clone() const override;
     void getDelta(VectorXf& expectedOutput) override;
+    void getDelta(MatrixXf& expectedOutput, LayerBuffers& buffers) const override;
+    
+    // Cost of the saved activations, summed over samples. Call before getDelta, which overwrites expectedOutput.
+    float getLoss(const VectorXf& expectedOutput) const;
+    float getLoss(const MatrixXf& expectedOutput, const LayerBuffers& buffers) const;
     
 private:
-    Cost* m_costEngine;
+    CostEngine m_costEngine;
 };
 #endif /* layer_hpp */
@@ -0,0 +1,33 @@
+#ifndef mapping_hpp
+#define mapping_hpp
+
+#include <stdio.h>
+#include <string>
+
+// Read-only memory mapping of a whole file, unmapped on destruction.
+// A copy-on-write mapping can be modified in memory, the file itself is never written.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& filename, const bool& copyOnWrite = false);
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+    ~MappedFile();
+    
+    const char* data() const { return this->m_data; }
+    char* data() { return this->m_data; } // Only writable for copy-on-write mappings
+    size_t size() const { return this->m_size; }
+    
+private:
+    char* m_data;
+    size_t m_size;
+};
+
+// Round offset up to the alignment used for data blocks in mapped files
+inline size_t alignBlock(const size_t& offset)
+{
+    const size_t alignment(64);
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+#endif /* mapping_hpp */
@@ -3,12 +3,46 @@
 
 #include <stdio.h>
 #include <vector>
+#include <string>
+#include <cstdint>
+#include <thread>
 #include <Eigen/Dense>
 #include "dataset.hpp"
+#include "mapping.hpp"
+
+// File in the IDX format, mapped in memory. Only unsigned byte data is supported.
+class IDXFile
+{
+public:
+    explicit IDXFile(const std::string& filename);
+    
+    // First dimension is the count of items, the others make one item
+    const std::vector<uint32_t>& dimensions() const { return this->m_dimensions; }
+    size_t count() const { return this->m_dimensions[0]; }
+    size_t itemSize() const;
+    
+    const uint8_t* data() const { return this->m_data; }
+    
+private:
+    MappedFile m_mapping;
+    std::vector<uint32_t> m_dimensions;
+    const uint8_t* m_data;
+};
+
+class IDX
+{
+public:
+    // Load an images file and its labels file as compact training or validation samples.
+    // Items are decoded in parallel straight into the dataset storage.
+    static void load(const std::string& images, const std::string& labels, Dataset& dataset, const bool& validation, const size_t& classes,
+                     const size_t& threads = std::thread::hardware_concurrency());
+};
 
 class MNIST
 {
 public:
-    static void load(Dataset& dataset);
+    // Load the four MNIST files from root. With a cache filename, the decoded dataset is
+    // written there and reloaded directly by later runs while it is newer than the files.
+    static void load(Dataset& dataset, const std::string& root = "./data/", const std::string& cache = "");
 };
 #endif /* mnist_hpp */
@@ -0,0 +1,92 @@
+#ifndef optimizer_hpp
+#define optimizer_hpp
+
+#include <stdio.h>
+#include <memory>
+#include <vector>
+#include <Eigen/Dense>
+
+#include "simd.hpp"
+
+using Eigen::VectorXf;
+
+// Update rule applied to every tensor after each mini-batch. Network::SGD numbers the
+// tensors, 2*l for the weights of layer l and 2*l+1 for its biases. Each update is a single
+// fused pass, see applyUpdate, which also clears the gradient for the next mini-batch.
+class Optimizer
+{
+public:
+    virtual ~Optimizer() = default;
+    
+    // Allocates zeroed state for tensors of the given sizes. State is kept when the sizes
+    // did not change, so that training can go on over several calls to SGD.
+    void initialize(const std::vector<size_t>& tensorSizes);
+    
+    // Called once per mini-batch, before the updates. Gradients are sums over the
+    // mini-batch, multiplied by gradientScale before use.
+    virtual void beginStep(const float& eta, const float& gradientScale);
+    
+    void update(const size_t& tensor, float* parameters, float* gradient, const bool& bias);
+    
+    // Whether updates read and write per-tensor state, which Hogwild! training does not allow
+    bool hasState() const { return this->m_stateCount > 0; }
+    
+    size_t stepCount() const { return this->m_stepCount; }
+    
+    // Checkpoint support, state must have the layout allocated by initialize
+    const std::vector<VectorXf>& state() const { return this->m_state; }
+    void restoreState(const std::vector<VectorXf>& state, const size_t& stepCount);
+    
+protected:
+    // stateCount buffers per tensor : 0 for SGD, 1 for momentum, 2 for Adam
+    Optimizer(const UpdateRule& rule, const size_t& stateCount);
+    
+    UpdateRule m_rule;
+    UpdateStep m_step;
+    size_t m_stepCount = 0;
+    
+    // Weight decay is not applied to biases
+    float m_weightDecay = 0;
+    
+private:
+    size_t m_stateCount;
+    std::vector<size_t> m_sizes;
+    std::vector<VectorXf> m_state;
+};
+
+class SGDOptimizer : public Optimizer
+{
+public:
+    SGDOptimizer();
+};
+
+// Heavy ball momentum, or Nesterov's accelerated gradient
+class MomentumOptimizer : public Optimizer
+{
+public:
+    explicit MomentumOptimizer(const float& momentum = 0.9f, const bool& nesterov = false);
+};
+
+// Adam with bias correction. A weight decay makes it AdamW : the decay is decoupled from
+// the gradient and scaled by the learning rate only.
+class AdamOptimizer : public Optimizer
+{
+public:
+    explicit AdamOptimizer(const float& beta1 = 0.9f, const float& beta2 = 0.999f, const float& epsilon = 1e-8f, const float& weightDecay = 0);
+    
+    void beginStep(const float& eta, const float& gradientScale) override;
+};
+
+enum class OptimizerType : unsigned char
+{
+    SGD,
+    Momentum,
+    Nesterov,
+    Adam,
+    AdamW
+};
+
+// Default hyper-parameters, AdamW with a weight decay of 0.01
+std::shared_ptr<Optimizer> makeOptimizer(const OptimizerType& type);
+
+#endif /* optimizer_hpp */
@@ -0,0 +1,73 @@
+#ifndef prefetch_hpp
+#define prefetch_hpp
+
+#include <stdio.h>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+#include <Eigen/Dense>
+
+#include "source.hpp"
+
+using Eigen::MatrixXf;
+
+// Transforms a mini-batch in place, one sample per column, before training sees it
+using Augmentation = std::function<void(MatrixXf& input, MatrixXf& output)>;
+
+// Wraps a source so that a background thread gathers, converts and augments the next
+// mini-batches while the current one trains. Batches are assembled in a ring of buffers
+// allocated once : nextBatch swaps the caller's matrices with a ready buffer, which then
+// goes back to the producer, so nothing is copied or reallocated on the training side.
+class PrefetchSource : public BatchSource
+{
+public:
+    // Every mini-batch is batchSize samples, up to buffers of them are prepared ahead
+    PrefetchSource(BatchSource& source, const size_t& batchSize, const size_t& buffers = 2, const Augmentation& augmentation = nullptr);
+    PrefetchSource(const PrefetchSource& other) = delete;
+    PrefetchSource& operator=(const PrefetchSource& other) = delete;
+    ~PrefetchSource();
+    
+    size_t size() const override;
+    void beginEpoch() override;
+    bool nextBatch(const size_t& size, MatrixXf& input, MatrixXf& output) override;
+    
+    // The wrapped source runs ahead : its state is the one saved at the start of the epoch,
+    // and skip restarts it from there past the mini-batches consumed so far
+    void saveState(std::vector<char>& state) const override;
+    bool restoreState(const std::vector<char>& state) override;
+    void skip(const size_t& batches, const size_t& size) override;
+    
+private:
+    struct Buffer
+    {
+        MatrixXf input;
+        MatrixXf output;
+    };
+    
+    BatchSource& m_source;
+    size_t m_batchSize;
+    Augmentation m_augmentation;
+    std::vector<char> m_epochState;
+    std::atomic<size_t> m_consumed;
+    
+    // Producer side
+    std::thread m_producer;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::deque<Buffer> m_free;
+    std::deque<Buffer> m_ready;
+    bool m_stop;
+    bool m_finished;
+    std::exception_ptr m_error;
+    
+    void _produce(size_t skip);
+    void _start(const size_t& skip);
+    void _stopProducer();
+};
+
+#endif /* prefetch_hpp */
@@ -0,0 +1,88 @@
+#ifndef quantization_hpp
+#define quantization_hpp
+
+#include <stdio.h>
+#include <vector>
+#include <Eigen/Dense>
+
+#include "algebra.hpp"
+#include "dataset.hpp"
+#include "engine.hpp"
+
+using Eigen::MatrixXf;
+using Eigen::VectorXf;
+
+// Granularity of the symmetric int8 weight scales
+enum class QuantizationScale : unsigned char
+{
+    PerLayer,
+    PerRow
+};
+
+// Accuracy of a quantized model against the float network it comes from
+struct QuantizationReport
+{
+    size_t samples = 0;
+    
+    // Percentages
+    float referenceAccuracy = 0;
+    float quantizedAccuracy = 0;
+    float agreement = 0; // Samples where both predict the same class
+    
+    float accuracyDelta() const { return this->quantizedAccuracy - this->referenceAccuracy; }
+    
+    void print() const;
+};
+
+// Int8 post-training quantization of a trained Network, for inference only.
+// Weights are symmetric int8 with one scale per layer or per output row. Layer inputs
+// are affine uint8, with a range calibrated on the validation samples of a dataset.
+// Products are accumulated in int32, then dequantized for the bias and the activation.
+class QuantizedModel
+{
+public:
+    // Calibrates on the first calibrationSamples validation samples, all of them when 0
+    QuantizedModel(const Network& network, const Dataset& calibration, const QuantizationScale& scale = QuantizationScale::PerRow, const size_t& calibrationSamples = 0);
+    
+    void feedForward(VectorXf& input) const;
+    MatrixXf feedForwardBatch(const MatrixXf& inputs) const;
+    MatrixXf feedForwardBatch(const float* inputs, const size_t& N) const;
+    
+    void setExpMode(const ExpMode& mode);
+    
+    float evaluateAccuracy(const Dataset& dataset) const;
+    
+    // Single pass over the validation samples with both models
+    QuantizationReport compare(const Network& reference, const Dataset& dataset) const;
+    
+    const ActivationType activationType;
+    const CostType costType;
+    
+private:
+    struct Layer
+    {
+        size_t inSize;
+        size_t outSize;
+        size_t stride; // inSize padded to the kernel block
+        
+        std::vector<int8_t> weights; // Row-major, rows padded with zeros to stride
+        VectorXf biases;
+        
+        // Input quantization
+        float inverseScale;
+        float zeroPoint;
+        
+        // Dequantization : (accumulator - offset) * scale, the offset removing the zero point
+        Eigen::VectorXi offsets;
+        VectorXf scales;
+        
+        ActivationEngine activationEngine;
+    };
+    
+    std::vector<int> m_sizes;
+    std::vector<Layer> m_layers;
+    
+    MatrixXf _feedForwardBatch(const Eigen::Ref<const MatrixXf>& inputs) const;
+};
+
+#endif /* quantization_hpp */
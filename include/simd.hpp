@@ -0,0 +1,92 @@
+#ifndef simd_hpp
+#define simd_hpp
+
+#include <stdio.h>
+#include <cstdint>
+
+// Conversion kernels. Each picks an AVX2/F16C version at runtime when the CPU
+// supports it and falls back to scalar code otherwise.
+
+// dst[i] = src[i] * scale
+void convertUInt8(const uint8_t* src, float* dst, const size_t& n, const float& scale);
+
+// IEEE half precision to single precision and back, rounding to nearest even
+void convertHalf(const uint16_t* src, float* dst, const size_t& n);
+void toHalf(const float* src, uint16_t* dst, const size_t& n);
+
+float halfToFloat(const uint16_t& h);
+uint16_t floatToHalf(const float& f);
+
+// bfloat16 is the upper half of a float. Conversion from float rounds to nearest even and
+// flushes denormals to zero, with AVX-512 BF16 when available.
+void convertBFloat16(const uint16_t* src, float* dst, const size_t& n);
+void toBFloat16(const float* src, uint16_t* dst, const size_t& n);
+
+float bfloat16ToFloat(const uint16_t& b);
+uint16_t floatToBFloat16(const float& f);
+
+// y = W x for row-major rows x cols weights in half precision or bfloat16.
+// Weights are widened to float and products accumulated in float, with AVX-512
+// or AVX2/FMA (and F16C for halves) when available.
+void gemvHalf(const uint16_t* weights, const float* x, float* y, const size_t& rows, const size_t& cols);
+void gemvBFloat16(const uint16_t* weights, const float* x, float* y, const size_t& rows, const size_t& cols);
+
+// Affine quantization : dst[i] = round(src[i] * inverseScale + zeroPoint) clamped to [0, 255],
+// rounding to nearest even
+void quantizeUInt8(const float* src, uint8_t* dst, const size_t& n, const float& inverseScale, const float& zeroPoint);
+
+// y = W x in int32 for row-major rows x cols int8 weights and n uint8 samples of cols values,
+// y holding n columns of rows results. cols must be a multiple of 64, padded with zeros.
+// Uses AVX-512 VNNI or AVX2 when available.
+void gemmInt8(const int8_t* weights, const uint8_t* x, int32_t* y, const size_t& rows, const size_t& cols, const size_t& n);
+
+// Activation kernels, AVX-512 or AVX2/FMA when available. Inputs of exp are clamped
+// to [-87, 88], which only changes results below 1.7e-38 or above 1.6e38.
+//  - Exact : Cephes polynomial, within 2 ulp of std::exp (std::exp in scalar code)
+//  - Fast : 2^x split into 2^n and a cubic on the fraction, relative error below 1e-4
+enum class ExpMode : unsigned char
+{
+    Exact,
+    Fast
+};
+
+// Layer output kernels on cols contiguous columns of rows values. Each column becomes
+// f(x + bias), and derivative receives f' = f * (1 - f) in the same pass.
+// bias and derivative may be null.
+//  - sigmoid : f(x) = 1 / (1 + exp(-x))
+//  - softmax : column-wise exp(x) / sum(exp(x))
+void sigmoid(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols, const ExpMode& mode);
+void softmax(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols, const ExpMode& mode);
+
+// Optimizer steps. In a single pass over n parameters, the gradient sum is scaled by
+// gradientScale into g, used by the rule and cleared.
+//  - SGD : p -= eta * g
+//  - Momentum : m = momentum * m + g, p -= eta * m
+//  - Nesterov : m = momentum * m + g, p -= eta * (g + momentum * m)
+//  - Adam : m and v moving averages of g and g^2, with bias corrections c = 1 / (1 - beta^t),
+//    p -= eta * (c1 * m / (sqrt(c2 * v) + epsilon) + decay * p), decay being AdamW's
+enum class UpdateRule : unsigned char
+{
+    SGD,
+    Momentum,
+    Nesterov,
+    Adam
+};
+
+struct UpdateStep
+{
+    float eta = 0;
+    float gradientScale = 1;
+    float momentum = 0;
+    float beta1 = 0;
+    float beta2 = 0;
+    float epsilon = 0;
+    float firstCorrection = 1;
+    float secondCorrection = 1;
+    float decay = 0;
+};
+
+// first holds m and second v, unused ones may be null
+void applyUpdate(const UpdateRule& rule, const UpdateStep& step, float* parameters, float* gradient, float* first, float* second, const size_t& n);
+
+#endif /* simd_hpp */
@@ -0,0 +1,63 @@
+#ifndef source_hpp
+#define source_hpp
+
+#include <stdio.h>
+#include <atomic>
+#include <vector>
+#include <Eigen/Dense>
+#include "dataset.hpp"
+
+using Eigen::MatrixXf;
+
+// Stream of training mini-batches consumed by Network::SGD
+class BatchSource
+{
+public:
+    virtual ~BatchSource() = default;
+    
+    // Count of training samples in one epoch
+    virtual size_t size() const = 0;
+    
+    // Shuffle and rewind
+    virtual void beginEpoch() = 0;
+    
+    // Pack the next size samples, one per column. Returns false once fewer than size
+    // samples are left in the epoch. Must be safe to call from several threads.
+    virtual bool nextBatch(const size_t& size, MatrixXf& input, MatrixXf& output) = 0;
+    
+    // Checkpoint support. saveState captures the current epoch as it was when it began, without
+    // the position in it, so that the same state is saved whether or not the source is wrapped.
+    // restoreState rewinds to that start and returns true, SGD then calls skip with the count of
+    // mini-batches already trained. Sources that keep no such state return false : SGD then
+    // starts a new epoch and skips the mini-batches already trained.
+    virtual void saveState(std::vector<char>& state) const { state.clear(); }
+    virtual bool restoreState(const std::vector<char>&) { return false; }
+    
+    // Move past the next batches mini-batches of size samples, by default reading them
+    virtual void skip(const size_t& batches, const size_t& size);
+};
+
+// In-memory Dataset seen as a source. With several shards, each epoch's shuffled order is
+// cut into shards equal parts and this source only visits part shard, so that processes
+// sharing the same random generator state train on disjoint samples.
+class DatasetSource : public BatchSource
+{
+public:
+    explicit DatasetSource(const Dataset& dataset, const size_t& shard = 0, const size_t& shards = 1);
+    
+    size_t size() const override;
+    void beginEpoch() override;
+    bool nextBatch(const size_t& size, MatrixXf& input, MatrixXf& output) override;
+    
+    void saveState(std::vector<char>& state) const override;
+    bool restoreState(const std::vector<char>& state) override;
+    void skip(const size_t& batches, const size_t& size) override;
+    
+private:
+    const Dataset& m_dataset;
+    size_t m_first;
+    size_t m_size;
+    std::atomic<size_t> m_offset;
+};
+
+#endif /* source_hpp */
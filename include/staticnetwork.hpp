@@ -0,0 +1,324 @@
+#ifndef staticnetwork_hpp
+#define staticnetwork_hpp
+
+#include <stdio.h>
+#include <cmath>
+#include <tuple>
+#include <array>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <fstream>
+#include <utility>
+#include <stdexcept>
+#include <Eigen/Dense>
+
+#include "algebra.hpp"
+#include "dataset.hpp"
+#include "simd.hpp"
+
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+
+// Layer of a StaticNetwork, every buffer sized at compile time
+template<int In, int Out>
+struct StaticLayer
+{
+    using Vector = Eigen::Matrix<float, Out, 1>;
+    using Weights = Eigen::Matrix<float, Out, In>;
+
+    Weights weights;
+    Vector biases;
+
+    // Backpropagation of the current sample and sums over the mini-batch
+    Vector activation;
+    Vector derivative;
+    Vector delta;
+    Weights deltaW;
+    Vector deltaB;
+};
+
+// Fixed topology version of Network : hidden layers use the sigmoid, the output layer and
+// the cost are template parameters. Forward and backward passes only use fixed-size Eigen
+// objects, without heap allocation or virtual calls. Each weight matrix has to stay below
+// EIGEN_STACK_ALLOCATION_LIMIT (128 KB by default), and the network itself is best kept on the heap.
+// Files are the ones written by Network::toBinary, in both directions.
+template<ActivationType OutputActivation, CostType CostFunction, int... Sizes>
+class StaticNetwork
+{
+    static_assert(sizeof...(Sizes) >= 2, "A network needs at least an input and an output size");
+
+public:
+    static constexpr int Depth = sizeof...(Sizes) - 1;
+    static constexpr std::array<int, sizeof...(Sizes)> Size{Sizes...};
+
+    using Input = Eigen::Matrix<float, Size.front(), 1>;
+    using Output = Eigen::Matrix<float, Size.back(), 1>;
+
+    // Same initialization as Network : normal weights scaled by 1/sqrt(in), normal biases
+    explicit StaticNetwork(const unsigned& seed = 0)
+    {
+        std::mt19937 generator(seed);
+        std::normal_distribution<float> distribution{0, 1};
+        this->_forEachLayer([&](auto& layer)
+        {
+            layer.weights = layer.weights.unaryExpr([&](float){return distribution(generator);});
+            layer.biases = layer.biases.unaryExpr([&](float){return distribution(generator);});
+            layer.weights /= std::sqrt(float(layer.weights.cols()));
+            layer.deltaW.setZero();
+            layer.deltaB.setZero();
+        });
+    }
+
+    static StaticNetwork* loadFile(const std::string& fileName)
+    {
+        std::ifstream file(fileName, std::ios::binary);
+        if(!file.is_open())
+        {
+            throw std::logic_error("Could not open filename : "+fileName);
+        }
+        boost::archive::binary_iarchive input(file);
+
+        StaticNetwork* network(new StaticNetwork());
+        try
+        {
+            network->fromBinary(input);
+        }
+        catch(...)
+        {
+            delete network;
+            throw;
+        }
+        return network;
+    }
+
+    void fromBinary(boost::archive::binary_iarchive& ar)
+    {
+        ActivationType activationType; ar >> activationType;
+        CostType costType; ar >> costType;
+        size_t N; ar >> N;
+        bool match(activationType == OutputActivation and costType == CostFunction and N == Size.size());
+        for(size_t i(0); i<N and match; i++)
+        {
+            int s; ar >> s;
+            match = s == Size[i];
+        }
+        if(!match)
+        {
+            throw std::logic_error("Model file does not match the static network");
+        }
+
+        this->_forEachLayer([&](auto& layer)
+        {
+            size_t n, cols, rows;
+            ar >> n;
+            if(n != (size_t)layer.biases.size())
+            {
+                throw std::logic_error("Layer size does not match the model file");
+            }
+            ar.load_binary(layer.biases.data(), n * sizeof(float));
+            ar >> cols >> rows;
+            if(cols != (size_t)layer.weights.cols() or rows != (size_t)layer.weights.rows())
+            {
+                throw std::logic_error("Layer size does not match the model file");
+            }
+            ar.load_binary(layer.weights.data(), cols * rows * sizeof(float));
+        });
+    }
+
+    void toBinary(const std::string& dest) const
+    {
+        std::ofstream file(dest, std::ios::binary);
+        boost::archive::binary_oarchive output(file);
+        this->toBinary(output);
+    }
+
+    void toBinary(boost::archive::binary_oarchive& ar) const
+    {
+        ar << OutputActivation;
+        ar << CostFunction;
+        ar << Size.size();
+        for(const int& s:Size)
+        {
+            ar << s;
+        }
+        this->_forEachLayer([&](const auto& layer)
+        {
+            const Eigen::Index n(layer.biases.size());
+            const size_t cols(layer.weights.cols()), rows(layer.weights.rows());
+            ar << n;
+            ar.save_binary(layer.biases.data(), n * sizeof(float));
+            ar << cols << rows;
+            ar.save_binary(layer.weights.data(), cols * rows * sizeof(float));
+        });
+    }
+
+    void setExpMode(const ExpMode& mode) { this->m_expMode = mode; }
+
+    void feedForward(const Eigen::Ref<const Input>& input, Output& output) const
+    {
+        this->_feedForward<0>(input, output);
+    }
+
+    // Per-sample SGD, as the unbatched path of Network::SGD
+    void SGD(const Dataset& dataset, const size_t& miniBatchSize, const size_t& epoch, const float& eta)
+    {
+        this->_checkDataset(dataset);
+
+        // Mini-batches are assembled once per batch, samples are then used in place
+        MatrixXf X, Y;
+        const float coefficient(eta/miniBatchSize);
+        for(size_t e(0); e<epoch; e++)
+        {
+            dataset.shuffle();
+            for(size_t offset(0); offset+miniBatchSize<=dataset.trainingSize(); offset+=miniBatchSize)
+            {
+                dataset.getBatch(offset, miniBatchSize, X, Y);
+                for(size_t i(0); i<miniBatchSize; i++)
+                {
+                    this->_backprop(Eigen::Map<const Input>(X.col(i).data()), Eigen::Map<const Output>(Y.col(i).data()));
+                }
+                this->_forEachLayer([&](auto& layer)
+                {
+                    layer.weights -= coefficient * layer.deltaW;
+                    layer.biases -= coefficient * layer.deltaB;
+                    layer.deltaW.setZero();
+                    layer.deltaB.setZero();
+                });
+            }
+        }
+    }
+
+    float evaluateAccuracy(const Dataset& dataset) const
+    {
+        this->_checkDataset(dataset);
+        return dataset.validationAccuracy([this](const Eigen::Ref<const MatrixXf>& inputs)
+        {
+            MatrixXf outputs(Size.back(), inputs.cols());
+            Output output;
+            for(Eigen::Index i(0); i<inputs.cols(); i++)
+            {
+                this->feedForward(Eigen::Map<const Input>(inputs.col(i).data()), output);
+                outputs.col(i) = output;
+            }
+            return outputs;
+        });
+    }
+
+private:
+    template<size_t... I>
+    static auto _layerTypes(std::index_sequence<I...>) -> std::tuple<StaticLayer<Size[I], Size[I+1]>...>;
+    using Layers = decltype(_layerTypes(std::make_index_sequence<Depth>()));
+
+    Layers m_layers;
+    ExpMode m_expMode = ExpMode::Exact;
+
+    template<class Function>
+    void _forEachLayer(Function&& f)
+    {
+        std::apply([&](auto&... layers){ (f(layers), ...); }, this->m_layers);
+    }
+
+    template<class Function>
+    void _forEachLayer(Function&& f) const
+    {
+        std::apply([&](const auto&... layers){ (f(layers), ...); }, this->m_layers);
+    }
+
+    void _checkDataset(const Dataset& dataset) const
+    {
+        if(dataset.inputSize() != (size_t)Size.front() or dataset.outputSize() != (size_t)Size.back())
+        {
+            throw std::logic_error("Dataset does not match the static network");
+        }
+    }
+
+    // Hidden layers are sigmoids, the output layer uses OutputActivation
+    template<size_t I, class Vector>
+    void _activate(Vector& z, const float* bias, float* derivative) const
+    {
+        if constexpr(I+1 == Depth and OutputActivation == ActivationType::Softmax)
+        {
+            softmax(z.data(), bias, derivative, z.size(), 1, this->m_expMode);
+        }
+        else
+        {
+            sigmoid(z.data(), bias, derivative, z.size(), 1, this->m_expMode);
+        }
+    }
+
+    template<size_t I, class Vector>
+    void _feedForward(const Eigen::MatrixBase<Vector>& input, Output& output) const
+    {
+        const auto& layer(std::get<I>(this->m_layers));
+        typename std::tuple_element_t<I, Layers>::Vector z;
+        z.noalias() = layer.weights * input;
+        this->_activate<I>(z, layer.biases.data(), nullptr);
+        if constexpr(I+1 == Depth)
+        {
+            output = z;
+        }
+        else
+        {
+            this->_feedForward<I+1>(z, output);
+        }
+    }
+
+    template<size_t I>
+    void _feedForwardAndSave(const Eigen::Ref<const Input>& input)
+    {
+        auto& layer(std::get<I>(this->m_layers));
+        if constexpr(I == 0)
+        {
+            layer.activation.noalias() = layer.weights * input;
+        }
+        else
+        {
+            layer.activation.noalias() = layer.weights * std::get<I-1>(this->m_layers).activation;
+        }
+        this->_activate<I>(layer.activation, layer.biases.data(), layer.derivative.data());
+        if constexpr(I+1 < Depth)
+        {
+            this->_feedForwardAndSave<I+1>(input);
+        }
+    }
+
+    // Layer I already holds its delta : accumulate BP3/BP4, then BP2 into the previous layer
+    template<size_t I>
+    void _backward(const Eigen::Ref<const Input>& input)
+    {
+        auto& layer(std::get<I>(this->m_layers));
+        layer.deltaB += layer.delta;
+        if constexpr(I == 0)
+        {
+            layer.deltaW.noalias() += layer.delta * input.transpose();
+        }
+        else
+        {
+            auto& previous(std::get<I-1>(this->m_layers));
+            layer.deltaW.noalias() += layer.delta * previous.activation.transpose();
+            previous.delta.noalias() = layer.weights.transpose() * layer.delta;
+            previous.delta.array() *= previous.derivative.array();
+            this->_backward<I-1>(input);
+        }
+    }
+
+    void _backprop(const Eigen::Ref<const Input>& input, const Eigen::Ref<const Output>& expected)
+    {
+        this->_feedForwardAndSave<0>(input);
+
+        // Equation BP1
+        auto& output(std::get<Depth-1>(this->m_layers));
+        if constexpr(CostFunction == CostType::Quadratic)
+        {
+            output.delta = (output.activation - expected).cwiseProduct(output.derivative);
+        }
+        else
+        {
+            output.delta = output.activation - expected;
+        }
+        this->_backward<Depth-1>(input);
+    }
+};
+
+#endif /* staticnetwork_hpp */
@@ -0,0 +1,98 @@
+#ifndef streaming_hpp
+#define streaming_hpp
+
+#include <stdio.h>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <condition_variable>
+#include <Eigen/Dense>
+
+#include "dataset.hpp"
+#include "source.hpp"
+
+using Eigen::MatrixXf;
+
+// Training samples streamed from shards on disk, for datasets that do not fit in memory.
+// Shards are files in the mapped dataset format (see Dataset::toMapped), only their
+// training samples are used. Each epoch visits the chunks of every shard in random order
+// and shuffles the samples inside each chunk. A background thread reads up to prefetch
+// chunks ahead, so that training does not wait on I/O. Checkpoints keep the generator and the
+// chunk order of the epoch, so that a resumed run reads the same samples.
+class StreamingDataset : public BatchSource
+{
+public:
+    StreamingDataset(const std::vector<std::string>& shards, const size_t& chunkSize, const size_t& prefetch = 2, const unsigned& seed = 0);
+    StreamingDataset(const StreamingDataset& other) = delete;
+    StreamingDataset& operator=(const StreamingDataset& other) = delete;
+    ~StreamingDataset();
+    
+    size_t size() const override;
+    void beginEpoch() override;
+    bool nextBatch(const size_t& size, MatrixXf& input, MatrixXf& output) override;
+    
+    void saveState(std::vector<char>& state) const override;
+    bool restoreState(const std::vector<char>& state) override;
+    void skip(const size_t& batches, const size_t& size) override;
+    
+    size_t inputSize() const { return this->m_inputSize; }
+    size_t outputSize() const { return this->m_outputSize; }
+    
+private:
+    struct Shard
+    {
+        std::string filename;
+        DatasetFileHeader header;
+    };
+    
+    struct ChunkLocation
+    {
+        size_t shard;
+        size_t first;
+        size_t count;
+    };
+    
+    struct Chunk
+    {
+        MatrixXf input;
+        MatrixXf output;
+        std::vector<size_t> order;
+        size_t position = 0;
+    };
+    
+    std::vector<Shard> m_shards;
+    std::vector<ChunkLocation> m_chunks;
+    size_t m_size;
+    size_t m_inputSize;
+    size_t m_outputSize;
+    size_t m_prefetch;
+    std::mt19937 m_generator;
+    unsigned m_epochSeed;
+    
+    // Producer side
+    std::thread m_producer;
+    std::mutex m_queueMutex;
+    std::condition_variable m_queueChanged;
+    std::deque<Chunk> m_queue;
+    bool m_stop;
+    bool m_finished;
+    std::exception_ptr m_error;
+    
+    // Consumer side
+    std::mutex m_consumerMutex;
+    Chunk m_current;
+    std::atomic<size_t> m_consumed;
+    
+    // Chunks before skip are not read, only their shuffles are replayed
+    void _produce(std::vector<ChunkLocation> chunks, unsigned seed, size_t skip);
+    void _start(const size_t& consumed);
+    void _stopProducer();
+    bool _pop();
+};
+
+#endif /* streaming_hpp */
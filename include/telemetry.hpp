@@ -0,0 +1,100 @@
+#ifndef telemetry_hpp
+#define telemetry_hpp
+
+#include <stdio.h>
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <string>
+#include <fstream>
+
+// Training phases. The first four are timed per layer.
+enum class Phase : unsigned char
+{
+    Forward,    // feedForwardAndSave
+    Delta,      // getDelta, equations BP1 and BP2
+    Gradient,   // updateCost and the reduction between threads, BP3 and BP4
+    Update,     // Optimizer step
+    Batch,      // Mini-batch assembly by the source
+    Shuffle,    // Start of epoch of the source
+    Evaluation, // Validation accuracy
+    Allreduce   // Gradient sums exchanged between processes
+};
+
+static constexpr size_t PhaseCount = 8;
+static constexpr size_t LayerPhaseCount = 4;
+
+const char* phaseName(const Phase& phase);
+
+// Counters of one epoch. Phase times are summed over threads, so with several
+// threads they measure CPU time rather than wall time.
+struct EpochTelemetry
+{
+    size_t epoch = 0;
+    double seconds = 0;
+    size_t samples = 0;
+    size_t batches = 0;
+    
+    // Mean cost per sample, computed from the output activations of the backward pass
+    double loss = 0;
+    
+    std::array<double, PhaseCount> phaseSeconds{};
+    std::vector<std::array<double, LayerPhaseCount>> layerSeconds;
+    
+    double samplesPerSecond() const { return this->seconds > 0 ? this->samples / this->seconds : 0; }
+    double batchesPerSecond() const { return this->seconds > 0 ? this->batches / this->seconds : 0; }
+    
+    std::string toJson() const;
+    void print() const;
+};
+
+// Instrumentation of Network::SGD, enabled by setting TrainingParameters::telemetry.
+// Counters are atomics, updated by every training thread, and are turned into one
+// EpochTelemetry per epoch, also written as a JSON line when an output is set.
+class Telemetry
+{
+public:
+    Telemetry() = default;
+    Telemetry(const Telemetry& other) = delete;
+    Telemetry& operator=(const Telemetry& other) = delete;
+    
+    // Appends one JSON object per epoch to the file
+    void setJsonOutput(const std::string& fileName);
+    
+    const std::vector<EpochTelemetry>& epochs() const { return this->m_epochs; }
+    
+    // Times the enclosing block when telemetry is not null
+    class Scope
+    {
+    public:
+        Scope(Telemetry* telemetry, const Phase& phase, const size_t& layer = NoLayer);
+        ~Scope();
+        
+    private:
+        Telemetry* m_telemetry;
+        Phase m_phase;
+        size_t m_layer;
+        std::chrono::steady_clock::time_point m_start;
+    };
+    
+    static constexpr size_t NoLayer = ~size_t(0);
+    
+    // Called by Network::SGD
+    void begin(const size_t& layers);
+    void add(const Phase& phase, const size_t& layer, const uint64_t& nanoseconds);
+    void addLoss(const double& loss);
+    void endEpoch(const size_t& epoch, const double& seconds, const size_t& samples, const size_t& batches);
+    
+private:
+    std::array<std::atomic<uint64_t>, PhaseCount> m_phases{};
+    std::unique_ptr<std::atomic<uint64_t>[]> m_layers;
+    size_t m_layerCount = 0;
+    std::atomic<double> m_loss{0};
+    
+    std::vector<EpochTelemetry> m_epochs;
+    std::ofstream m_json;
+};
+
+#endif /* telemetry_hpp */
@@ -0,0 +1,49 @@
+#ifndef threadpool_hpp
+#define threadpool_hpp
+
+#include <stdio.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+
+// Fixed set of workers kept alive across calls, so that short tasks such as
+// one mini-batch do not pay for thread creation.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(const size_t& size);
+    ThreadPool(const ThreadPool& other) = delete;
+    ThreadPool& operator=(const ThreadPool& other) = delete;
+    ~ThreadPool();
+    
+    size_t size() const;
+    
+    // Run task(i) for i in [0, N) and wait for completion. The calling thread takes part.
+    // When a task throws, the remaining indices are skipped and run rethrows the first error
+    // once every worker is done.
+    void run(const size_t& N, const std::function<void(size_t)>& task);
+    
+private:
+    std::vector<std::thread> m_workers;
+    
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+    
+    const std::function<void(size_t)>* m_task;
+    size_t m_taskCount;
+    size_t m_generation;
+    size_t m_running;
+    bool m_stop;
+    std::atomic<size_t> m_next;
+    std::exception_ptr m_error;
+    
+    void _work();
+    void _consume();
+};
+
+#endif /* threadpool_hpp */
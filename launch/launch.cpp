@@ -0,0 +1,138 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+
+#include <csignal>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// Starts the ranks of a data-parallel job on this machine. Each rank runs the program with
+// NN_RANK, NN_WORLD_SIZE and NN_ENDPOINTS set, which Communicator::fromEnvironment reads.
+// Ranks talk over UNIX sockets in a temporary directory, or over TCP on 127.0.0.1 from the
+// given port. When a rank fails the others are terminated, and the launcher exits with
+// the status of the first failure.
+//
+// neuralnetwork_launch [-n ranks] [--tcp port] program [arguments...]
+
+int main(int argc, char * argv[])
+{
+    size_t ranks(2);
+    int port(0);
+    int i(1);
+    for(; i<argc and argv[i][0] == '-'; i++)
+    {
+        const string arg(argv[i]);
+        const bool hasValue(i+1 < argc);
+        if(arg == "-n" and hasValue)
+        {
+            ranks = stoul(argv[++i]);
+        }
+        else if(arg == "--tcp" and hasValue)
+        {
+            port = stoi(argv[++i]);
+        }
+        else
+        {
+            break;
+        }
+    }
+    if(i >= argc or argv[i][0] == '-' or !ranks)
+    {
+        cerr << "Usage : " << argv[0] << " [-n ranks] [--tcp port] program [arguments...]\n";
+        return 2;
+    }
+    
+    string directory;
+    string endpoints;
+    if(!port)
+    {
+        char pattern[] = "/tmp/neuralnetwork-XXXXXX";
+        if(!mkdtemp(pattern))
+        {
+            cerr << "Could not create a directory for the sockets\n";
+            return 1;
+        }
+        directory = pattern;
+    }
+    for(size_t r(0); r<ranks; r++)
+    {
+        endpoints += (r ? "," : "") + (port ? "127.0.0.1:" + to_string(port + r) : directory + "/rank" + to_string(r) + ".sock");
+    }
+    
+    int result(0);
+    vector<pid_t> children;
+    for(size_t r(0); r<ranks; r++)
+    {
+        const pid_t pid(fork());
+        if(pid < 0)
+        {
+            // The ranks already started cannot complete the ring
+            cerr << "Could not start rank " << r << " : " << strerror(errno) << "\n";
+            result = 1;
+            for(const pid_t& child:children)
+            {
+                kill(child, SIGTERM);
+            }
+            break;
+        }
+        if(pid == 0)
+        {
+            setenv("NN_RANK", to_string(r).c_str(), 1);
+            setenv("NN_WORLD_SIZE", to_string(ranks).c_str(), 1);
+            setenv("NN_ENDPOINTS", endpoints.c_str(), 1);
+            execvp(argv[i], argv + i);
+            cerr << "Could not run " << argv[i] << " : " << strerror(errno) << "\n";
+            _exit(127);
+        }
+        children.push_back(pid);
+    }
+    
+    size_t left(children.size());
+    while(left > 0)
+    {
+        int status;
+        pid_t pid(wait(&status));
+        while(pid < 0 and errno == EINTR)
+        {
+            pid = wait(&status);
+        }
+        if(pid < 0)
+        {
+            // ECHILD : nothing is left to reap
+            break;
+        }
+        const size_t rank(find(children.begin(), children.end(), pid) - children.begin());
+        if(rank == children.size())
+        {
+            continue;
+        }
+        children[rank] = 0;
+        left--;
+        const int code(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        if(code and !result)
+        {
+            cerr << "Rank " << rank << " failed with status " << code << ", stopping the others\n";
+            result = code;
+            for(const pid_t& child:children)
+            {
+                if(child)
+                {
+                    kill(child, SIGTERM);
+                }
+            }
+        }
+    }
+    
+    if(!directory.empty())
+    {
+        filesystem::remove_all(directory);
+    }
+    return result;
+}
@@ -0,0 +1,518 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "engine.hpp"
+
+using namespace std;
+
+// Inference daemon : loads a model written by Network::toBinary or toMapped and answers
+// requests on a UNIX domain socket, or on stdin/stdout without --socket. Requests arriving
+// together are gathered into micro-batches of at most --max-batch samples, the oldest one
+// waiting at most --max-delay microseconds, and run by --workers threads with
+// Network::feedForwardBatch. Latency percentiles and QPS go to stderr every --report
+// seconds and at exit.
+//
+// Framing, native byte order : on connection the server sends a Hello. Each request is a
+// RequestHeader followed by count floats, count being the input size. Each response is a
+// ResponseHeader followed by count output floats. Responses may come back in another order
+// than the requests, clients match them by id.
+//
+// neuralnetwork_server model [--socket path] [--max-batch n] [--max-delay us]
+//                            [--workers n] [--report seconds]
+
+struct Hello
+{
+    static constexpr uint32_t Magic = 0x56534e4e; // "NNSV"
+    static constexpr uint32_t Version = 1;
+    
+    uint32_t magic;
+    uint32_t version;
+    uint32_t inputSize;
+    uint32_t outputSize;
+};
+
+struct RequestHeader
+{
+    uint32_t id;
+    uint32_t count;
+};
+
+enum class Status : uint32_t
+{
+    Ok,
+    WrongSize // count did not match the input size, no output follows
+};
+
+struct ResponseHeader
+{
+    uint32_t id;
+    Status status;
+    uint32_t count;
+};
+
+struct Options
+{
+    string model;
+    string socket;
+    size_t maxBatch = 64;
+    size_t maxDelay = 500;
+    size_t workers = 1;
+    double report = 10;
+};
+
+static volatile sig_atomic_t Stop = 0;
+
+static void onSignal(int)
+{
+    Stop = 1;
+}
+
+static bool readFull(const int& fd, void* data, size_t size)
+{
+    char* p(static_cast<char*>(data));
+    while(size)
+    {
+        const ssize_t n(read(fd, p, size));
+        if(n < 0 and errno == EINTR and !Stop)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool writeFull(const int& fd, const void* data, size_t size)
+{
+    const char* p(static_cast<const char*>(data));
+    while(size)
+    {
+        const ssize_t n(write(fd, p, size));
+        if(n < 0 and errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// One client. Responses are written by the workers, one frame at a time.
+class Connection
+{
+public:
+    Connection(const int& in, const int& out, const bool& owned):m_in(in), m_out(out), m_owned(owned){}
+    Connection(const Connection& other) = delete;
+    Connection& operator=(const Connection& other) = delete;
+    ~Connection()
+    {
+        if(this->m_owned)
+        {
+            close(this->m_in);
+        }
+    }
+    
+    int input() const { return this->m_in; }
+    
+    // Header then count floats, as one frame
+    template<class Header>
+    void send(const Header& header, const float* data = nullptr, const size_t& count = 0)
+    {
+        lock_guard<mutex> lock(this->m_mutex);
+        if(writeFull(this->m_out, &header, sizeof(header)) and count)
+        {
+            writeFull(this->m_out, data, count * sizeof(float));
+        }
+    }
+    
+    // Makes the reader see the end of the stream
+    void shutdown() const
+    {
+        ::shutdown(this->m_in, SHUT_RD);
+    }
+
+private:
+    int m_in;
+    int m_out;
+    bool m_owned;
+    mutex m_mutex;
+};
+
+struct Request
+{
+    shared_ptr<Connection> connection;
+    uint32_t id;
+    vector<float> input;
+    chrono::steady_clock::time_point arrival;
+};
+
+// Latencies and throughput since the previous report
+class Stats
+{
+public:
+    Stats():m_start(chrono::steady_clock::now()), m_requests(0), m_batches(0){}
+    
+    void add(const vector<double>& latencies)
+    {
+        lock_guard<mutex> lock(this->m_mutex);
+        this->m_latencies.insert(this->m_latencies.end(), latencies.begin(), latencies.end());
+        this->m_requests += latencies.size();
+        this->m_batches++;
+    }
+    
+    void report()
+    {
+        lock_guard<mutex> lock(this->m_mutex);
+        const auto now(chrono::steady_clock::now());
+        const double seconds(chrono::duration<double>(now - this->m_start).count());
+        vector<double>& l(this->m_latencies);
+        sort(l.begin(), l.end());
+        auto percentile = [&](const double& p)
+        {
+            const size_t rank((size_t)ceil(p * l.size()));
+            return l.empty() ? 0. : l[min(l.size() - 1, rank ? rank - 1 : 0)];
+        };
+        cerr << fixed << setprecision(1) << this->m_requests << " requests in " << seconds << " s : "
+             << this->m_requests / seconds << " QPS, p50 " << percentile(.5) * 1e6 << " us, p99 " << percentile(.99) * 1e6
+             << " us, mean batch " << (this->m_batches ? double(this->m_requests) / this->m_batches : 0.) << "\n";
+        this->m_start = now;
+        this->m_requests = 0;
+        this->m_batches = 0;
+        l.clear();
+    }
+
+private:
+    mutex m_mutex;
+    chrono::steady_clock::time_point m_start;
+    size_t m_requests;
+    size_t m_batches;
+    vector<double> m_latencies;
+};
+
+// Queue shared by the readers and the workers. A worker takes a micro-batch as soon as
+// maxBatch requests are waiting, or once the oldest one has waited maxDelay.
+class Batcher
+{
+public:
+    Batcher(const Network& network, const Options& options, Stats& stats):
+    m_network(network),
+    m_options(options),
+    m_stats(stats),
+    m_stop(false)
+    {
+        for(size_t w(0); w<max<size_t>(1, options.workers); w++)
+        {
+            this->m_workers.emplace_back(&Batcher::_work, this);
+        }
+    }
+    
+    // Answers every queued request before returning
+    ~Batcher()
+    {
+        {
+            lock_guard<mutex> lock(this->m_mutex);
+            this->m_stop = true;
+        }
+        this->m_changed.notify_all();
+        for(thread& t:this->m_workers)
+        {
+            t.join();
+        }
+    }
+    
+    void push(Request&& request)
+    {
+        {
+            lock_guard<mutex> lock(this->m_mutex);
+            this->m_queue.push_back(std::move(request));
+        }
+        this->m_changed.notify_one();
+    }
+
+private:
+    const Network& m_network;
+    const Options& m_options;
+    Stats& m_stats;
+    
+    mutex m_mutex;
+    condition_variable m_changed;
+    deque<Request> m_queue;
+    bool m_stop;
+    vector<thread> m_workers;
+    
+    void _work()
+    {
+        const size_t inputSize(this->m_network.sizes().front()), outputSize(this->m_network.sizes().back());
+        vector<Request> batch;
+        MatrixXf input;
+        vector<double> latencies;
+        while(true)
+        {
+            {
+                unique_lock<mutex> lock(this->m_mutex);
+                this->m_changed.wait(lock, [this]{return this->m_stop or !this->m_queue.empty();});
+                if(this->m_queue.empty())
+                {
+                    return;
+                }
+                const auto deadline(this->m_queue.front().arrival + chrono::microseconds(this->m_options.maxDelay));
+                this->m_changed.wait_until(lock, deadline, [this]{return this->m_stop or this->m_queue.empty() or this->m_queue.size() >= this->m_options.maxBatch;});
+                
+                // Another worker may have taken the requests meanwhile
+                const size_t n(min(this->m_queue.size(), this->m_options.maxBatch));
+                if(!n)
+                {
+                    continue;
+                }
+                batch.clear();
+                for(size_t i(0); i<n; i++)
+                {
+                    batch.push_back(std::move(this->m_queue.front()));
+                    this->m_queue.pop_front();
+                }
+            }
+            
+            input.resize(inputSize, batch.size());
+            for(size_t i(0); i<batch.size(); i++)
+            {
+                memcpy(input.col(i).data(), batch[i].input.data(), inputSize * sizeof(float));
+            }
+            const MatrixXf output(this->m_network.feedForwardBatch(input));
+            
+            latencies.clear();
+            for(size_t i(0); i<batch.size(); i++)
+            {
+                batch[i].connection->send(ResponseHeader{batch[i].id, Status::Ok, (uint32_t)outputSize}, output.col(i).data(), outputSize);
+                latencies.push_back(chrono::duration<double>(chrono::steady_clock::now() - batch[i].arrival).count());
+            }
+            this->m_stats.add(latencies);
+            batch.clear();
+        }
+    }
+};
+
+// Reads frames until the end of the stream, queueing well formed requests
+static void serve(const shared_ptr<Connection>& connection, const Network& network, Batcher& batcher)
+{
+    const Hello hello{Hello::Magic, Hello::Version, (uint32_t)network.sizes().front(), (uint32_t)network.sizes().back()};
+    connection->send(hello);
+    
+    RequestHeader header;
+    while(!Stop and readFull(connection->input(), &header, sizeof(header)))
+    {
+        if(header.count != hello.inputSize)
+        {
+            // Skip the payload by pieces, whatever size the client claims
+            vector<float> discarded(hello.inputSize);
+            size_t left(header.count);
+            while(left and readFull(connection->input(), discarded.data(), min(left, discarded.size()) * sizeof(float)))
+            {
+                left -= min(left, discarded.size());
+            }
+            if(left)
+            {
+                break;
+            }
+            connection->send(ResponseHeader{header.id, Status::WrongSize, 0});
+            continue;
+        }
+        vector<float> input(header.count);
+        if(!readFull(connection->input(), input.data(), header.count * sizeof(float)))
+        {
+            break;
+        }
+        batcher.push(Request{connection, header.id, std::move(input), chrono::steady_clock::now()});
+    }
+}
+
+int main(int argc, const char * argv[])
+{
+    Options options;
+    for(int i(1); i<argc; i++)
+    {
+        const string arg(argv[i]);
+        const bool hasValue(i+1 < argc);
+        if(arg == "--socket" and hasValue)
+        {
+            options.socket = argv[++i];
+        }
+        else if(arg == "--max-batch" and hasValue)
+        {
+            options.maxBatch = max(1ul, stoul(argv[++i]));
+        }
+        else if(arg == "--max-delay" and hasValue)
+        {
+            options.maxDelay = stoul(argv[++i]);
+        }
+        else if(arg == "--workers" and hasValue)
+        {
+            options.workers = stoul(argv[++i]);
+        }
+        else if(arg == "--report" and hasValue)
+        {
+            options.report = stod(argv[++i]);
+        }
+        else if(arg[0] != '-' and options.model.empty())
+        {
+            options.model = arg;
+        }
+        else
+        {
+            options.model.clear();
+            break;
+        }
+    }
+    if(options.model.empty())
+    {
+        cerr << "Usage : " << argv[0] << " model [--socket path] [--max-batch n] [--max-delay us] [--workers n] [--report seconds]\n";
+        return 2;
+    }
+    
+    unique_ptr<Network> network(Network::loadFile(options.model));
+    cerr << "Serving " << options.model << " (" << network->sizes().front() << " inputs, " << network->sizes().back() << " outputs)\n";
+    
+    // SIGINT and SIGTERM are blocked before any thread starts, so that every thread inherits
+    // the mask : they only reach the main thread, while it waits with the previous mask
+    sigset_t signals, waiting;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &waiting);
+    
+    // No SA_RESTART : blocking reads and waits return when a signal arrives
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+    
+    Stats stats;
+    thread reporter;
+    mutex reporterMutex;
+    condition_variable reporterStop;
+    bool stopped(false);
+    if(options.report > 0)
+    {
+        reporter = thread([&]
+        {
+            unique_lock<mutex> lock(reporterMutex);
+            while(!reporterStop.wait_for(lock, chrono::duration<double>(options.report), [&]{return stopped;}))
+            {
+                stats.report();
+            }
+        });
+    }
+    
+    {
+        Batcher batcher(*network, options, stats);
+        if(options.socket.empty())
+        {
+            // Every thread is started, stdin reads may be interrupted from now on
+            pthread_sigmask(SIG_SETMASK, &waiting, nullptr);
+            serve(make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO, false), *network, batcher);
+        }
+        else
+        {
+            const int listener(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0));
+            sockaddr_un address;
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if(listener < 0 or options.socket.size() >= sizeof(address.sun_path))
+            {
+                throw logic_error("Could not create socket : "+options.socket);
+            }
+            strcpy(address.sun_path, options.socket.c_str());
+            unlink(options.socket.c_str());
+            if(::bind(listener, (sockaddr*)&address, sizeof(address)) != 0 or listen(listener, 64) != 0)
+            {
+                throw logic_error("Could not listen on "+options.socket+" : "+strerror(errno));
+            }
+            
+            list<pair<weak_ptr<Connection>, thread>> clients;
+            while(!Stop)
+            {
+                // The signals are only let through during the wait, so one arriving after Stop
+                // was checked still interrupts it
+                pollfd waiter{listener, POLLIN, 0};
+                if(ppoll(&waiter, 1, nullptr, &waiting) <= 0)
+                {
+                    continue;
+                }
+                const int fd(accept(listener, nullptr, nullptr));
+                if(fd < 0)
+                {
+                    continue;
+                }
+                shared_ptr<Connection> connection(make_shared<Connection>(fd, fd, true));
+                clients.emplace_back(connection, thread([connection, &network, &batcher]
+                {
+                    serve(connection, *network, batcher);
+                }));
+                
+                // Forget clients that are gone
+                clients.remove_if([](pair<weak_ptr<Connection>, thread>& c)
+                {
+                    if(!c.first.expired())
+                    {
+                        return false;
+                    }
+                    c.second.join();
+                    return true;
+                });
+            }
+            for(auto& c:clients)
+            {
+                if(shared_ptr<Connection> connection = c.first.lock())
+                {
+                    connection->shutdown();
+                }
+                c.second.join();
+            }
+            close(listener);
+            unlink(options.socket.c_str());
+        }
+    }
+    
+    if(reporter.joinable())
+    {
+        {
+            lock_guard<mutex> lock(reporterMutex);
+            stopped = true;
+        }
+        reporterStop.notify_all();
+        reporter.join();
+    }
+    stats.report();
+    return 0;
+}
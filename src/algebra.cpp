@@ -2,6 +2,7 @@
 #include <cmath>
 #include <Eigen/Dense>
 #include <iostream>
+#include <stdexcept>
 
 #include <cassert>
 
@@ -12,7 +13,16 @@ using Eigen::VectorXf;
 
 void Sigmoid::main(VectorXf& input) const
 {
-    input = input.unaryExpr( [](float x){return 1 / (1+exp(-x));} );
+    sigmoid(input.data(), nullptr, nullptr, input.size(), 1, this->m_expMode);
+}
+
+void Sigmoid::main(VectorXf& input, const float* bias, VectorXf* derivative) const
+{
+    if(derivative)
+    {
+        derivative->resize(input.size());
+    }
+    sigmoid(input.data(), bias, derivative ? derivative->data() : nullptr, input.size(), 1, this->m_expMode);
 }
 
 void Sigmoid::prim(const VectorXf& activation, VectorXf& output) const
@@ -20,19 +30,39 @@ void Sigmoid::prim(const VectorXf& activation, VectorXf& output) const
     output = activation.array() * (1-activation.array());
 }
 
-Activation* Sigmoid::clone() const
+void Sigmoid::main(MatrixXf& input) const
+{
+    sigmoid(input.data(), nullptr, nullptr, input.size(), 1, this->m_expMode);
+}
+
+void Sigmoid::main(MatrixXf& input, const float* bias, MatrixXf* derivative) const
 {
-    return new Sigmoid();
+    if(derivative)
+    {
+        derivative->resize(input.rows(), input.cols());
+    }
+    sigmoid(input.data(), bias, derivative ? derivative->data() : nullptr, input.rows(), input.cols(), this->m_expMode);
 }
 
+void Sigmoid::prim(const MatrixXf& activation, MatrixXf& output) const
+{
+    output = activation.array() * (1-activation.array());
+}
+
+
 void Softmax::main(VectorXf& input) const
 {
-    // Normalize before computing softmax
-    input.array() -= input.maxCoeff();
+    // Shifted by the maximum, exponentials and their sum computed in the same pass
+    softmax(input.data(), nullptr, nullptr, input.size(), 1, this->m_expMode);
+}
 
-    // Softmax formula
-    input = input.unaryExpr( [](float x){return exp(x);} );
-    input /= input.sum();
+void Softmax::main(VectorXf& input, const float* bias, VectorXf* derivative) const
+{
+    if(derivative)
+    {
+        derivative->resize(input.size());
+    }
+    softmax(input.data(), bias, derivative ? derivative->data() : nullptr, input.size(), 1, this->m_expMode);
 }
 
 void Softmax::prim(const VectorXf& activation, VectorXf& output) const
@@ -40,22 +70,97 @@ void Softmax::prim(const VectorXf& activation, VectorXf& output) const
     output = activation.array() * (1-activation.array());
 }
 
-Activation* Softmax::clone() const
+void Softmax::main(MatrixXf& input) const
 {
-    return new Softmax();
+    // Column by column, samples are contiguous
+    softmax(input.data(), nullptr, nullptr, input.rows(), input.cols(), this->m_expMode);
 }
 
-Quadratic::Quadratic(VectorXf* derivative):m_derivative(derivative){}
+void Softmax::main(MatrixXf& input, const float* bias, MatrixXf* derivative) const
+{
+    if(derivative)
+    {
+        derivative->resize(input.rows(), input.cols());
+    }
+    softmax(input.data(), bias, derivative ? derivative->data() : nullptr, input.rows(), input.cols(), this->m_expMode);
+}
 
-void Quadratic::getGradient(const VectorXf& computedOutput, const VectorXf& expectedOutput, VectorXf& result) const
+void Softmax::prim(const MatrixXf& activation, MatrixXf& output) const
+{
+    output = activation.array() * (1-activation.array());
+}
+
+ActivationEngine makeActivation(const ActivationType& type)
+{
+    switch(type)
+    {
+        case ActivationType::Sigmoid:
+            return Sigmoid();
+        case ActivationType::Softmax:
+            return Softmax();
+        default:
+            throw logic_error("Unknown activation type");
+    }
+}
+
+CostEngine makeCost(const CostType& type)
+{
+    switch(type)
+    {
+        case CostType::Quadratic:
+            return Quadratic();
+        case CostType::CrossEntropy:
+            return CrossEntropy();
+        default:
+            throw logic_error("Unknown cost type");
+    }
+}
+
+void Quadratic::getGradient(const VectorXf& computedOutput, const VectorXf& expectedOutput, const VectorXf& derivative, VectorXf& result) const
 {
     // NablaC = x-y
-    result = (computedOutput-expectedOutput).array() * this->m_derivative->array();
+    result = (computedOutput-expectedOutput).array() * derivative.array();
 }
 
-CrossEntropy::CrossEntropy(){}
+void Quadratic::getGradient(const MatrixXf& computedOutput, const MatrixXf& expectedOutput, const MatrixXf& derivative, MatrixXf& result) const
+{
+    result = (computedOutput-expectedOutput).array() * derivative.array();
+}
 
-void CrossEntropy::getGradient(const VectorXf& computedOutput, const VectorXf& expectedOutput, VectorXf& result) const
+float Quadratic::getLoss(const VectorXf& computedOutput, const VectorXf& expectedOutput) const
+{
+    return 0.5f * (computedOutput-expectedOutput).squaredNorm();
+}
+
+float Quadratic::getLoss(const MatrixXf& computedOutput, const MatrixXf& expectedOutput) const
+{
+    return 0.5f * (computedOutput-expectedOutput).squaredNorm();
+}
+
+void CrossEntropy::getGradient(const VectorXf& computedOutput, const VectorXf& expectedOutput, const VectorXf&, VectorXf& result) const
 {
     result = (computedOutput-expectedOutput).array();
 }
+
+void CrossEntropy::getGradient(const MatrixXf& computedOutput, const MatrixXf& expectedOutput, const MatrixXf&, MatrixXf& result) const
+{
+    result = computedOutput-expectedOutput;
+}
+
+template<class Matrix>
+static float crossEntropyLoss(const Matrix& computedOutput, const Matrix& expectedOutput)
+{
+    const auto a(computedOutput.array().max(1e-7f).min(1.f-1e-7f));
+    const auto y(expectedOutput.array());
+    return -(y * a.log() + (1.f-y) * (1.f-a).log()).sum();
+}
+
+float CrossEntropy::getLoss(const VectorXf& computedOutput, const VectorXf& expectedOutput) const
+{
+    return crossEntropyLoss(computedOutput, expectedOutput);
+}
+
+float CrossEntropy::getLoss(const MatrixXf& computedOutput, const MatrixXf& expectedOutput) const
+{
+    return crossEntropyLoss(computedOutput, expectedOutput);
+}
@@ -0,0 +1,200 @@
+#include "checkpoint.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+
+using namespace std;
+
+static void saveTensors(boost::archive::binary_oarchive& ar, const vector<VectorXf>& tensors)
+{
+    ar << tensors.size();
+    for(const VectorXf& t:tensors)
+    {
+        const size_t n(t.size());
+        ar << n;
+        ar.save_binary(t.data(), n * sizeof(float));
+    }
+}
+
+static void loadTensors(boost::archive::binary_iarchive& ar, vector<VectorXf>& tensors)
+{
+    size_t count; ar >> count;
+    tensors.resize(count);
+    for(VectorXf& t:tensors)
+    {
+        size_t n; ar >> n;
+        t.resize(n);
+        ar.load_binary(t.data(), n * sizeof(float));
+    }
+}
+
+// Flushes a file or a directory to the disk
+static void syncPath(const string& path, const int& flags)
+{
+    const int fd(open(path.c_str(), flags));
+    if(fd < 0)
+    {
+        throw logic_error("Could not open "+path+" : "+strerror(errno));
+    }
+    const bool synced(fsync(fd) == 0);
+    const int error(errno);
+    close(fd);
+    if(!synced)
+    {
+        throw logic_error("Could not sync "+path+" : "+strerror(error));
+    }
+}
+
+void TrainingState::save(const string& fileName) const
+{
+    const string temporary(fileName + ".tmp");
+    {
+        ofstream file(temporary, ios::binary);
+        if(!file.is_open())
+        {
+            throw logic_error("Could not open filename : "+temporary);
+        }
+        boost::archive::binary_oarchive ar(file);
+        ar << Magic << Version;
+        ar << this->activationType << this->costType << this->sizes;
+        ar << this->epoch << this->batch << this->batchCount;
+        saveTensors(ar, this->weights);
+        saveTensors(ar, this->optimizerState);
+        ar << this->optimizerSteps;
+        ar << this->datasetGenerator << this->layerGenerator;
+        ar << this->sourceState;
+        ar << this->bestAccuracy << this->bestBatch << this->staleCount;
+        saveTensors(ar, this->bestWeights);
+        file.flush();
+        if(!file.good())
+        {
+            throw logic_error("Could not write checkpoint : "+temporary);
+        }
+    }
+    
+    // The data must be on the disk before the rename makes it the checkpoint, and the
+    // rename itself before training goes on, or a crash could leave nothing to resume from
+    syncPath(temporary, O_RDONLY);
+    if(rename(temporary.c_str(), fileName.c_str()) != 0)
+    {
+        throw logic_error("Could not rename checkpoint to "+fileName);
+    }
+    const filesystem::path directory(filesystem::path(fileName).parent_path());
+    syncPath(directory.empty() ? "." : directory.string(), O_RDONLY | O_DIRECTORY);
+}
+
+void TrainingState::load(const string& fileName)
+{
+    ifstream file(fileName, ios::binary);
+    if(!file.is_open())
+    {
+        throw logic_error("Could not open filename : "+fileName);
+    }
+    boost::archive::binary_iarchive ar(file);
+    uint32_t magic, version;
+    ar >> magic >> version;
+    if(magic != Magic or version != Version)
+    {
+        throw logic_error("Not a checkpoint file : "+fileName);
+    }
+    ar >> this->activationType >> this->costType >> this->sizes;
+    ar >> this->epoch >> this->batch >> this->batchCount;
+    loadTensors(ar, this->weights);
+    loadTensors(ar, this->optimizerState);
+    ar >> this->optimizerSteps;
+    ar >> this->datasetGenerator >> this->layerGenerator;
+    ar >> this->sourceState;
+    ar >> this->bestAccuracy >> this->bestBatch >> this->staleCount;
+    loadTensors(ar, this->bestWeights);
+}
+
+CheckpointWriter::CheckpointWriter(const string& fileName):
+m_fileName(fileName),
+m_writing(false),
+m_stop(false),
+m_written(0)
+{
+    this->m_thread = thread(&CheckpointWriter::_run, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    {
+        lock_guard<mutex> lock(this->m_mutex);
+        this->m_stop = true;
+    }
+    this->m_changed.notify_all();
+    this->m_thread.join();
+}
+
+void CheckpointWriter::submit(unique_ptr<TrainingState> state)
+{
+    {
+        lock_guard<mutex> lock(this->m_mutex);
+        if(this->m_error)
+        {
+            rethrow_exception(this->m_error);
+        }
+        this->m_pending = move(state);
+    }
+    this->m_changed.notify_all();
+}
+
+void CheckpointWriter::flush()
+{
+    unique_lock<mutex> lock(this->m_mutex);
+    this->m_changed.wait(lock, [this](){ return !this->m_pending and !this->m_writing; });
+    if(this->m_error)
+    {
+        rethrow_exception(this->m_error);
+    }
+}
+
+size_t CheckpointWriter::written() const
+{
+    lock_guard<mutex> lock(this->m_mutex);
+    return this->m_written;
+}
+
+void CheckpointWriter::_run()
+{
+    unique_lock<mutex> lock(this->m_mutex);
+    while(true)
+    {
+        this->m_changed.wait(lock, [this](){ return this->m_pending or this->m_stop; });
+        if(!this->m_pending)
+        {
+            return;
+        }
+        unique_ptr<TrainingState> state(move(this->m_pending));
+        this->m_writing = true;
+        lock.unlock();
+        
+        try
+        {
+            state->save(this->m_fileName);
+            state.reset();
+            lock.lock();
+            this->m_written++;
+        }
+        catch(...)
+        {
+            lock.lock();
+            this->m_error = current_exception();
+        }
+        this->m_writing = false;
+        this->m_changed.notify_all();
+    }
+}
@@ -0,0 +1,312 @@
+#include "collective.hpp"
+
+#include <chrono>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <Eigen/Dense>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+// Socket address of an endpoint, UNIX path or host:port
+struct Endpoint
+{
+    sockaddr_storage address;
+    socklen_t length;
+    int family;
+};
+
+static Endpoint resolve(const string& endpoint)
+{
+    Endpoint result;
+    memset(&result.address, 0, sizeof(result.address));
+    if(endpoint.find('/') != string::npos)
+    {
+        sockaddr_un* address(reinterpret_cast<sockaddr_un*>(&result.address));
+        if(endpoint.size() >= sizeof(address->sun_path))
+        {
+            throw logic_error("Socket path too long : "+endpoint);
+        }
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, endpoint.c_str());
+        result.length = sizeof(sockaddr_un);
+        result.family = AF_UNIX;
+        return result;
+    }
+    
+    const size_t colon(endpoint.rfind(':'));
+    if(colon == string::npos)
+    {
+        throw logic_error("Invalid endpoint : "+endpoint);
+    }
+    addrinfo hints, *info(nullptr);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(endpoint.substr(0, colon).c_str(), endpoint.substr(colon+1).c_str(), &hints, &info) != 0 or !info)
+    {
+        throw logic_error("Could not resolve endpoint : "+endpoint);
+    }
+    memcpy(&result.address, info->ai_addr, info->ai_addrlen);
+    result.length = info->ai_addrlen;
+    result.family = info->ai_family;
+    freeaddrinfo(info);
+    return result;
+}
+
+static void setNoDelay(const int& fd, const int& family)
+{
+    if(family != AF_UNIX)
+    {
+        const int one(1);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+}
+
+Communicator::Communicator(const size_t& rank, const vector<string>& endpoints):
+m_rank(rank),
+m_size(endpoints.size()),
+m_listener(-1),
+m_next(-1),
+m_previous(-1)
+{
+    if(rank >= endpoints.size())
+    {
+        throw logic_error("Rank "+to_string(rank)+" out of "+to_string(endpoints.size()));
+    }
+    if(this->m_size == 1)
+    {
+        return;
+    }
+    
+    // The destructor does not run when the constructor throws
+    try
+    {
+        this->_connect(endpoints);
+    }
+    catch(...)
+    {
+        this->_close();
+        throw;
+    }
+}
+
+Communicator::~Communicator()
+{
+    this->_close();
+}
+
+void Communicator::_close()
+{
+    for(int* fd:{&this->m_next, &this->m_previous, &this->m_listener})
+    {
+        if(*fd >= 0)
+        {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+    if(!this->m_path.empty())
+    {
+        unlink(this->m_path.c_str());
+        this->m_path.clear();
+    }
+}
+
+void Communicator::_connect(const vector<string>& endpoints)
+{
+    const size_t& rank(this->m_rank);
+    
+    // Listen first, so that the previous rank can connect before we accept
+    const Endpoint local(resolve(endpoints[rank]));
+    this->m_listener = socket(local.family, SOCK_STREAM, 0);
+    const int one(1);
+    setsockopt(this->m_listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(local.family == AF_UNIX)
+    {
+        unlink(endpoints[rank].c_str());
+    }
+    if(this->m_listener < 0 or ::bind(this->m_listener, (const sockaddr*)&local.address, local.length) != 0 or listen(this->m_listener, 4) != 0)
+    {
+        throw logic_error("Could not listen on "+endpoints[rank]+" : "+strerror(errno));
+    }
+    if(local.family == AF_UNIX)
+    {
+        this->m_path = endpoints[rank];
+    }
+    
+    // The next rank may not be listening yet
+    const Endpoint next(resolve(endpoints[(rank + 1) % this->m_size]));
+    const auto deadline(chrono::steady_clock::now() + chrono::seconds(60));
+    while(true)
+    {
+        this->m_next = socket(next.family, SOCK_STREAM, 0);
+        if(connect(this->m_next, (const sockaddr*)&next.address, next.length) == 0)
+        {
+            break;
+        }
+        close(this->m_next);
+        this->m_next = -1;
+        if(chrono::steady_clock::now() > deadline)
+        {
+            throw logic_error("Could not connect to "+endpoints[(rank + 1) % this->m_size]);
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    setNoDelay(this->m_next, next.family);
+    
+    this->m_previous = accept(this->m_listener, nullptr, nullptr);
+    if(this->m_previous < 0)
+    {
+        throw logic_error(string("Could not accept the previous rank : ")+strerror(errno));
+    }
+    setNoDelay(this->m_previous, local.family);
+    
+    // Both ends check that the ring is the expected one
+    const uint64_t sent(rank);
+    uint64_t received;
+    this->_exchange(&sent, sizeof(sent), &received, sizeof(received));
+    if(received != (rank + this->m_size - 1) % this->m_size)
+    {
+        throw logic_error("Unexpected rank "+to_string(received)+" connected to rank "+to_string(rank));
+    }
+    
+    for(const int& fd:{this->m_next, this->m_previous})
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+shared_ptr<Communicator> Communicator::fromEnvironment()
+{
+    const char* rank(getenv("NN_RANK"));
+    const char* endpoints(getenv("NN_ENDPOINTS"));
+    if(!rank or !endpoints)
+    {
+        return nullptr;
+    }
+    vector<string> list;
+    istringstream stream(endpoints);
+    string endpoint;
+    while(getline(stream, endpoint, ','))
+    {
+        list.push_back(endpoint);
+    }
+    const char* size(getenv("NN_WORLD_SIZE"));
+    if(size and stoul(size) != list.size())
+    {
+        throw logic_error("NN_WORLD_SIZE is "+string(size)+" but NN_ENDPOINTS lists "+to_string(list.size())+" ranks");
+    }
+    return make_shared<Communicator>(stoul(rank), list);
+}
+
+void Communicator::_exchange(const void* send, const size_t& sendBytes, void* receive, const size_t& receiveBytes)
+{
+    const char* out(static_cast<const char*>(send));
+    char* in(static_cast<char*>(receive));
+    size_t sent(0), received(0);
+    while(sent < sendBytes or received < receiveBytes)
+    {
+        pollfd fds[2];
+        nfds_t count(0);
+        if(sent < sendBytes)
+        {
+            fds[count++] = {this->m_next, POLLOUT, 0};
+        }
+        if(received < receiveBytes)
+        {
+            fds[count++] = {this->m_previous, POLLIN, 0};
+        }
+        if(poll(fds, count, -1) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            throw logic_error(string("Ring poll failed : ")+strerror(errno));
+        }
+        
+        for(nfds_t i(0); i<count; i++)
+        {
+            if(!fds[i].revents)
+            {
+                continue;
+            }
+            const bool sending(fds[i].fd == this->m_next and sent < sendBytes);
+            const ssize_t n(sending ? ::send(fds[i].fd, out + sent, sendBytes - sent, MSG_NOSIGNAL)
+                                    : recv(fds[i].fd, in + received, receiveBytes - received, 0));
+            if(n < 0 and (errno == EAGAIN or errno == EWOULDBLOCK or errno == EINTR))
+            {
+                continue;
+            }
+            if(n <= 0)
+            {
+                throw logic_error("Ring connection lost on rank "+to_string(this->m_rank));
+            }
+            (sending ? sent : received) += n;
+        }
+    }
+}
+
+void Communicator::allreduce(float* data, const size_t& n)
+{
+    const size_t p(this->m_size);
+    if(p == 1)
+    {
+        return;
+    }
+    auto begin = [&](const size_t& chunk){ return chunk * n / p; };
+    auto length = [&](const size_t& chunk){ return begin(chunk + 1) - begin(chunk); };
+    this->m_received.resize(length(p - 1) + 1);
+    
+    // Reduce-scatter : after p-1 steps, this rank holds the full sum of chunk rank+1
+    for(size_t s(0); s+1<p; s++)
+    {
+        const size_t out((this->m_rank + p - s) % p), in((this->m_rank + 2*p - s - 1) % p);
+        this->_exchange(data + begin(out), length(out) * sizeof(float), this->m_received.data(), length(in) * sizeof(float));
+        Eigen::Map<Eigen::VectorXf>(data + begin(in), length(in)) += Eigen::Map<const Eigen::VectorXf>(this->m_received.data(), length(in));
+    }
+    
+    // Allgather : reduced chunks travel around the ring, copied as they are
+    for(size_t s(0); s+1<p; s++)
+    {
+        const size_t out((this->m_rank + 1 + p - s) % p), in((this->m_rank + p - s) % p);
+        this->_exchange(data + begin(out), length(out) * sizeof(float), data + begin(in), length(in) * sizeof(float));
+    }
+}
+
+void Communicator::broadcast(float* data, const size_t& n, const size_t& root)
+{
+    if(this->m_size == 1)
+    {
+        return;
+    }
+    // Passed along the ring, the rank before root does not forward it
+    const size_t bytes(n * sizeof(float));
+    if(this->m_rank != root)
+    {
+        this->_exchange(nullptr, 0, data, bytes);
+    }
+    if((this->m_rank + 1) % this->m_size != root)
+    {
+        this->_exchange(data, bytes, nullptr, 0);
+    }
+}
+
+void Communicator::barrier()
+{
+    float value(0);
+    this->allreduce(&value, 1);
+}
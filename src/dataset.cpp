@@ -5,12 +5,20 @@
 #include <algorithm>
 #include <random>
 #include <fstream>
+#include <numeric>
+#include <cstring>
+#include <cmath>
+#include <cstdio>
+#include <unistd.h>
+
+#include "simd.hpp"
 
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 
 using namespace std;
 
+using Eigen::MatrixXf;
 using Eigen::VectorXf;
 
 mt19937 Generator(0);
@@ -28,12 +36,65 @@ output(VectorXf(outputDim))
     output.setZero();
 }
 
+size_t sampleBytes(const SampleType& type, const size_t& dim)
+{
+    switch(type)
+    {
+        case SampleType::Float32:
+            return dim * sizeof(float);
+        case SampleType::UInt8:
+            return dim * sizeof(uint8_t);
+        case SampleType::Float16:
+            return dim * sizeof(uint16_t);
+        case SampleType::Label:
+            return sizeof(uint16_t);
+        default:
+            throw logic_error("Unknown sample type");
+    }
+}
+
+void decodeSample(const SampleType& type, const char* block, const size_t& dim, const size_t& idx, const float& scale, float* dst)
+{
+    switch(type)
+    {
+        case SampleType::Float32:
+            memcpy(dst, reinterpret_cast<const float*>(block) + idx * dim, dim * sizeof(float));
+            break;
+        case SampleType::UInt8:
+            convertUInt8(reinterpret_cast<const uint8_t*>(block) + idx * dim, dst, dim, scale);
+            break;
+        case SampleType::Float16:
+            convertHalf(reinterpret_cast<const uint16_t*>(block) + idx * dim, dst, dim);
+            break;
+        case SampleType::Label:
+            fill(dst, dst + dim, 0.f);
+            dst[reinterpret_cast<const uint16_t*>(block)[idx]] = 1;
+            break;
+        default:
+            throw logic_error("Unknown sample type");
+    }
+}
+
+bool labelsInRange(const char* block, const size_t& count, const size_t& classes)
+{
+    const uint16_t* labels(reinterpret_cast<const uint16_t*>(block));
+    return all_of(labels, labels + count, [&](const uint16_t& label){return label < classes;});
+}
+
 Dataset::Dataset():
-m_sizeTraining(0),
-m_sizeValidation(0)
+m_inputSize(0),
+m_outputSize(0),
+m_inputType(SampleType::Float32),
+m_outputType(SampleType::Float32),
+m_inputScale(1)
 {}
 
 Dataset::Dataset(const string& filename):Dataset()
+{
+    this->loadFile(filename);
+}
+
+void Dataset::loadFile(const string& filename)
 {
     // Check if file exists
     ifstream file(filename, ios::binary);
@@ -42,107 +103,432 @@ Dataset::Dataset(const string& filename):Dataset()
         throw logic_error("Could not open filename : "+filename);
     }
     
+    // Pick the loader from the magic number
+    uint32_t magic(0);
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    if(file and magic == DatasetFileHeader::Magic)
+    {
+        file.close();
+        this->_loadMapped(filename);
+    }
+    else
+    {
+        file.clear();
+        file.seekg(0);
+        this->_loadBinary(file);
+    }
+}
+
+void Dataset::_loadBinary(ifstream& file)
+{
     // Open file
     boost::archive::binary_iarchive input(file);
 
     // Extract data from file
+    size_t sizeTraining;
     input >> this->m_inputSize;
     input >> this->m_outputSize;
-    input >> this->m_sizeTraining;
+    input >> sizeTraining;
     
-    this->m_training = new DataPair*[this->m_sizeTraining];
+    MatrixXf trainingInput(this->m_inputSize, sizeTraining);
+    MatrixXf trainingOutput(this->m_outputSize, sizeTraining);
     
-    for(size_t i(0); i<this->m_sizeTraining; i++)
+    for(size_t i(0); i<sizeTraining; i++)
     {
-        DataPair *dp = new DataPair(this->m_inputSize, this->m_outputSize);
         for(size_t j(0); j<this->m_inputSize; j++)
         {
-            input >> dp->input(j);
+            input >> trainingInput(j, i);
         }
         for(size_t j(0); j<this->m_outputSize; j++)
         {
-            input >> dp->output(j);
+            input >> trainingOutput(j, i);
         }
-        this->m_training[i] = dp;
     }
     
-    // Add training data in vector to shuffle during SGD
-    this->m_data = new vector<DataPair*>(this->m_sizeTraining);
-    for(size_t i(0); i<this->m_sizeTraining; i++)
-    {
-        (*this->m_data)[i] = m_training[i];
-    }
+    this->_encode(this->m_training, trainingInput, trainingOutput);
+    this->_resetIndices();
 }
 
-Dataset::~Dataset()
+void Dataset::_loadMapped(const string& filename)
 {
-    if(this->m_sizeTraining)
+    this->m_mapping = make_unique<MappedFile>(filename);
+    const MappedFile& mapping(*this->m_mapping);
+    
+    if(mapping.size() < sizeof(DatasetFileHeader))
+    {
+        throw logic_error("Truncated dataset file : "+filename);
+    }
+    const DatasetFileHeader& header(*reinterpret_cast<const DatasetFileHeader*>(mapping.data()));
+    if(header.magic != DatasetFileHeader::Magic or header.version != DatasetFileHeader::Version)
+    {
+        throw logic_error("Unsupported dataset file version : "+filename);
+    }
+    if(header.inputType == SampleType::Label or header.inputType > SampleType::Label or header.outputType > SampleType::Label)
+    {
+        throw logic_error("Unsupported sample type in dataset file : "+filename);
+    }
+    
+    this->m_inputSize = header.inputSize;
+    this->m_outputSize = header.outputSize;
+    this->m_inputType = header.inputType;
+    this->m_outputType = header.outputType;
+    this->m_inputScale = header.inputScale;
+    
+    // Every field below comes from the file : bound them before any arithmetic can wrap
+    if(header.inputSize > mapping.size() or header.outputSize > mapping.size())
+    {
+        throw logic_error("Invalid sample size in dataset file : "+filename);
+    }
+    
+    const size_t counts[4] = {header.trainingSize, header.trainingSize, header.validationSize, header.validationSize};
+    const size_t bytes[4] = {
+        sampleBytes(header.inputType, header.inputSize),
+        sampleBytes(header.outputType, header.outputSize),
+        sampleBytes(header.inputType, header.inputSize),
+        sampleBytes(header.outputType, header.outputSize)
+    };
+    for(int i(0); i<4; i++)
     {
-        for(size_t i(0); i<this->m_sizeTraining; i++)
+        if(header.offsets[i] > mapping.size() or (bytes[i] and counts[i] > (mapping.size() - header.offsets[i]) / bytes[i]))
         {
-            delete this->m_training[i];
+            throw logic_error("Truncated dataset file : "+filename);
         }
-        delete[] this->m_training;
-        
-        if(this->m_sizeValidation)
+        // Float blocks are read in place, at the alignment toMapped writes them with
+        if(alignBlock(header.offsets[i]) != header.offsets[i])
         {
-            for(size_t i(0); i<this->m_sizeValidation; i++)
-            {
-                delete this->m_validation[i];
-            }
-            delete[] this->m_validation;
+            throw logic_error("Misaligned block in dataset file : "+filename);
+        }
+    }
+    
+    // Labels index the one-hot outputs, they are checked once here rather than at every decode
+    for(int i(1); i<4 and header.outputType == SampleType::Label; i+=2)
+    {
+        if(!labelsInRange(mapping.data() + header.offsets[i], counts[i], header.outputSize))
+        {
+            throw logic_error("Label out of range in dataset file : "+filename);
         }
     }
+    
+    // Every block is used in place, no copy
+    Samples* splits[2] = {&this->m_training, &this->m_validation};
+    for(int i(0); i<2; i++)
+    {
+        splits[i]->size = counts[2*i];
+        splits[i]->input = mapping.data() + header.offsets[2*i];
+        splits[i]->output = mapping.data() + header.offsets[2*i+1];
+    }
+    this->_resetIndices();
 }
 
 void Dataset::addTrainingData(DataPair **data, const size_t& size)
 {
     this->m_inputSize = data[0]->input.size();
     this->m_outputSize = data[0]->output.size();
+    this->m_inputType = SampleType::Float32;
+    this->m_outputType = SampleType::Float32;
+    this->m_inputScale = 1;
     
-    this->m_sizeTraining = size;
-    this->m_training = new DataPair*[size];
-    this->_populate(this->m_training, data, size);
-    
-    // Add training data in vector to shuffle during SGD
-    this->m_data = new vector<DataPair*>(size);
+    MatrixXf input(this->m_inputSize, size);
+    MatrixXf output(this->m_outputSize, size);
     for(size_t i(0); i<size; i++)
     {
-        (*this->m_data)[i] = m_training[i];
+        input.col(i) = data[i]->input;
+        output.col(i) = data[i]->output;
     }
+    this->_encode(this->m_training, input, output);
+    this->_resetIndices();
 }
 
 void Dataset::addValidationData(DataPair **data, const size_t &size)
 {
-    this->m_sizeValidation = size;
-    this->m_validation = new DataPair*[size];
-    this->_populate(this->m_validation, data, size);
+    MatrixXf input(this->m_inputSize, size);
+    MatrixXf output(this->m_outputSize, size);
+    for(size_t i(0); i<size; i++)
+    {
+        input.col(i) = data[i]->input;
+        output.col(i) = data[i]->output;
+    }
+    this->_encode(this->m_validation, input, output);
+}
+
+void Dataset::addTrainingData(const uint8_t* inputs, const uint16_t* labels, const size_t& size, const size_t& inputSize, const size_t& classes, const float& inputScale)
+{
+    if(!labelsInRange(reinterpret_cast<const char*>(labels), size, classes))
+    {
+        throw logic_error("Label out of range in training data");
+    }
+    auto storage(this->reserveTrainingData(size, inputSize, classes, inputScale));
+    memcpy(storage.first, inputs, size * inputSize);
+    memcpy(storage.second, labels, size * sizeof(uint16_t));
+}
+
+void Dataset::addValidationData(const uint8_t* inputs, const uint16_t* labels, const size_t& size)
+{
+    if(!labelsInRange(reinterpret_cast<const char*>(labels), size, this->m_outputSize))
+    {
+        throw logic_error("Label out of range in validation data");
+    }
+    auto storage(this->reserveValidationData(size));
+    memcpy(storage.first, inputs, size * this->m_inputSize);
+    memcpy(storage.second, labels, size * sizeof(uint16_t));
+}
+
+pair<uint8_t*, uint16_t*> Dataset::reserveTrainingData(const size_t& size, const size_t& inputSize, const size_t& classes, const float& inputScale)
+{
+    this->m_inputSize = inputSize;
+    this->m_outputSize = classes;
+    this->m_inputType = SampleType::UInt8;
+    this->m_outputType = SampleType::Label;
+    this->m_inputScale = inputScale;
+    
+    auto storage(this->_reserve(this->m_training, size));
+    this->_resetIndices();
+    return storage;
+}
+
+pair<uint8_t*, uint16_t*> Dataset::reserveValidationData(const size_t& size)
+{
+    if(this->m_inputType != SampleType::UInt8 or this->m_outputType != SampleType::Label)
+    {
+        throw logic_error("Compact validation samples need compact training samples");
+    }
+    return this->_reserve(this->m_validation, size);
+}
+
+pair<uint8_t*, uint16_t*> Dataset::_reserve(Samples& samples, const size_t& size)
+{
+    samples.size = size;
+    samples.inputStorage.resize(size * this->m_inputSize);
+    samples.outputStorage.resize(size * sizeof(uint16_t));
+    samples.input = samples.inputStorage.data();
+    samples.output = samples.outputStorage.data();
+    return {reinterpret_cast<uint8_t*>(samples.inputStorage.data()), reinterpret_cast<uint16_t*>(samples.outputStorage.data())};
+}
+
+void Dataset::convertStorage(const SampleType& inputType, const float& inputScale, const bool& labels)
+{
+    if(inputType == SampleType::Label)
+    {
+        throw logic_error("Inputs cannot be stored as labels");
+    }
+    
+    // Decode both splits before changing the storage, they may live in the mapping
+    MatrixXf trainingInput, trainingOutput, validationInput, validationOutput;
+    this->_decode(this->m_training, trainingInput, trainingOutput);
+    this->_decode(this->m_validation, validationInput, validationOutput);
+    
+    this->m_inputType = inputType;
+    this->m_outputType = labels ? SampleType::Label : SampleType::Float32;
+    this->m_inputScale = inputType == SampleType::UInt8 ? inputScale : 1;
+    
+    this->_encode(this->m_training, trainingInput, trainingOutput);
+    this->_encode(this->m_validation, validationInput, validationOutput);
+    this->m_mapping.reset();
+}
+
+void Dataset::_decode(const Samples& samples, MatrixXf& input, MatrixXf& output) const
+{
+    input.resize(this->m_inputSize, samples.size);
+    output.resize(this->m_outputSize, samples.size);
+    for(size_t i(0); i<samples.size; i++)
+    {
+        decodeSample(this->m_inputType, samples.input, this->m_inputSize, i, this->m_inputScale, input.col(i).data());
+        decodeSample(this->m_outputType, samples.output, this->m_outputSize, i, 1, output.col(i).data());
+    }
+}
+
+void Dataset::_encode(Samples& samples, const MatrixXf& input, const MatrixXf& output)
+{
+    const size_t size(input.cols());
+    samples.size = size;
+    samples.inputStorage.resize(size * sampleBytes(this->m_inputType, this->m_inputSize));
+    samples.outputStorage.resize(size * sampleBytes(this->m_outputType, this->m_outputSize));
+    
+    switch(this->m_inputType)
+    {
+        case SampleType::Float32:
+            memcpy(samples.inputStorage.data(), input.data(), input.size() * sizeof(float));
+            break;
+        case SampleType::UInt8:
+        {
+            uint8_t* dst(reinterpret_cast<uint8_t*>(samples.inputStorage.data()));
+            for(Eigen::Index i(0); i<input.size(); i++)
+            {
+                dst[i] = static_cast<uint8_t>(clamp(round(input.data()[i] / this->m_inputScale), 0.f, 255.f));
+            }
+            break;
+        }
+        case SampleType::Float16:
+            toHalf(input.data(), reinterpret_cast<uint16_t*>(samples.inputStorage.data()), input.size());
+            break;
+        default:
+            throw logic_error("Inputs cannot be stored as labels");
+    }
+    
+    if(this->m_outputType == SampleType::Label)
+    {
+        uint16_t* dst(reinterpret_cast<uint16_t*>(samples.outputStorage.data()));
+        for(size_t i(0); i<size; i++)
+        {
+            Eigen::Index idx;
+            output.col(i).maxCoeff(&idx);
+            if(output.col(i).sum() != 1 or output(idx, i) != 1)
+            {
+                throw logic_error("Only one-hot outputs can be stored as labels");
+            }
+            dst[i] = static_cast<uint16_t>(idx);
+        }
+    }
+    else
+    {
+        memcpy(samples.outputStorage.data(), output.data(), output.size() * sizeof(float));
+    }
+    
+    samples.input = samples.inputStorage.data();
+    samples.output = samples.outputStorage.data();
 }
 
-void Dataset::_populate(DataPair **container, DataPair **data, const size_t& size)
+void Dataset::_resetIndices()
 {
+    // Identity order, shuffled during SGD
+    this->m_indices.resize(this->m_training.size);
+    iota(this->m_indices.begin(), this->m_indices.end(), 0);
+}
+
+size_t Dataset::trainingSize() const {return this->m_training.size;}
+size_t Dataset::validationSize() const {return this->m_validation.size;}
+
+DataView Dataset::_view(const Samples& samples, const size_t& i) const
+{
+    if(this->m_inputType != SampleType::Float32 or this->m_outputType != SampleType::Float32)
+    {
+        throw logic_error("Sample views need Float32 storage, use getBatch instead");
+    }
+    const float* input(reinterpret_cast<const float*>(samples.input) + i * this->m_inputSize);
+    const float* output(reinterpret_cast<const float*>(samples.output) + i * this->m_outputSize);
+    return DataView{Eigen::Map<const VectorXf>(input, this->m_inputSize), Eigen::Map<const VectorXf>(output, this->m_outputSize)};
+}
+
+DataView Dataset::operator[](const size_t& idx) const
+{
+    return this->_view(this->m_training, this->m_indices[idx]);
+}
+
+DataView Dataset::getTestData(const size_t& i) const
+{
+    return this->_view(this->m_validation, i);
+}
+
+void Dataset::_gather(const Samples& samples, const size_t* indices, const size_t& offset, const size_t& size, MatrixXf& input, MatrixXf& output) const
+{
+    // Compact samples are converted to float here, column by column
+    input.resize(this->m_inputSize, size);
+    output.resize(this->m_outputSize, size);
     for(size_t i(0); i<size; i++)
     {
-        container[i] = new DataPair(data[i]->input, data[i]->output);
+        const size_t idx(indices ? indices[offset + i] : offset + i);
+        decodeSample(this->m_inputType, samples.input, this->m_inputSize, idx, this->m_inputScale, input.col(i).data());
+        decodeSample(this->m_outputType, samples.output, this->m_outputSize, idx, 1, output.col(i).data());
     }
 }
 
-size_t Dataset::trainingSize() const {return this->m_sizeTraining;}
-size_t Dataset::validationSize() const {return this->m_sizeValidation;}
+void Dataset::getBatch(const size_t& offset, const size_t& size, MatrixXf& input, MatrixXf& output) const
+{
+    this->_gather(this->m_training, this->m_indices.data(), offset, size, input, output);
+}
+
+void Dataset::getValidationBatch(const size_t& offset, const size_t& size, MatrixXf& input, MatrixXf& output) const
+{
+    this->_gather(this->m_validation, nullptr, offset, size, input, output);
+}
+
+Eigen::Map<const MatrixXf> Dataset::getValidationInputs(const size_t& offset, const size_t& size, MatrixXf& buffer) const
+{
+    if(this->m_inputType == SampleType::Float32)
+    {
+        return Eigen::Map<const MatrixXf>(reinterpret_cast<const float*>(this->m_validation.input) + offset * this->m_inputSize, this->m_inputSize, size);
+    }
+    
+    if(buffer.rows() != (Eigen::Index)this->m_inputSize or buffer.cols() < (Eigen::Index)size)
+    {
+        buffer.resize(this->m_inputSize, size);
+    }
+    for(size_t i(0); i<size; i++)
+    {
+        decodeSample(this->m_inputType, this->m_validation.input, this->m_inputSize, offset + i, this->m_inputScale, buffer.col(i).data());
+    }
+    return Eigen::Map<const MatrixXf>(buffer.data(), this->m_inputSize, size);
+}
 
-const DataPair& Dataset::operator[](const size_t& idx) const
+void Dataset::getValidationLabels(const size_t& offset, const size_t& size, size_t* labels) const
 {
-    return *(*this->m_data)[idx];
+    for(size_t i(0); i<size; i++)
+    {
+        switch(this->m_outputType)
+        {
+            case SampleType::Label:
+                labels[i] = reinterpret_cast<const uint16_t*>(this->m_validation.output)[offset + i];
+                break;
+            case SampleType::Float32:
+            {
+                const float* output(reinterpret_cast<const float*>(this->m_validation.output) + (offset + i) * this->m_outputSize);
+                labels[i] = max_element(output, output + this->m_outputSize) - output;
+                break;
+            }
+            case SampleType::UInt8:
+            {
+                const uint8_t* output(reinterpret_cast<const uint8_t*>(this->m_validation.output) + (offset + i) * this->m_outputSize);
+                labels[i] = max_element(output, output + this->m_outputSize) - output;
+                break;
+            }
+            case SampleType::Float16:
+            {
+                const uint16_t* output(reinterpret_cast<const uint16_t*>(this->m_validation.output) + (offset + i) * this->m_outputSize);
+                labels[i] = max_element(output, output + this->m_outputSize, [](const uint16_t& a, const uint16_t& b)
+                {
+                    return halfToFloat(a) < halfToFloat(b);
+                }) - output;
+                break;
+            }
+            default:
+                throw logic_error("Unknown sample type");
+        }
+    }
 }
 
-DataPair Dataset::getTestData(const size_t& i) const
+float Dataset::validationAccuracy(const function<MatrixXf(const Eigen::Ref<const MatrixXf>& inputs)>& forward) const
 {
-    return *(this->m_validation[i]);
+    const size_t blockSize(256);
+    MatrixXf buffer;
+    size_t labels[blockSize];
+    size_t success(0);
+    for(size_t offset(0); offset<this->validationSize(); offset+=blockSize)
+    {
+        const size_t size(min(blockSize, this->validationSize() - offset));
+        const MatrixXf outputs(forward(this->getValidationInputs(offset, size, buffer)));
+        this->getValidationLabels(offset, size, labels);
+        for(size_t i(0); i<size; i++)
+        {
+            Eigen::Index predicted;
+            outputs.col(i).maxCoeff(&predicted);
+            success += (size_t)predicted == labels[i];
+        }
+    }
+    return this->validationSize() ? 100.f * success / this->validationSize() : 0;
 }
 
 void Dataset::shuffle() const
 {
-    std::shuffle(this->m_data->begin(), this->m_data->end(), Generator);
+    std::shuffle(this->m_indices.begin(), this->m_indices.end(), Generator);
+}
+
+void Dataset::setOrder(const vector<size_t>& order) const
+{
+    if(order.size() != this->m_training.size)
+    {
+        throw logic_error("Order does not match the training set size");
+    }
+    this->m_indices = order;
 }
 
 ostream& operator<<(ostream& os, const DataPair& datapair)
@@ -180,17 +566,82 @@ void Dataset::toBinary(const string& filename) const
     boost::archive::binary_oarchive output(file);
     output << this->m_inputSize;
     output << this->m_outputSize;
-    output << this->m_sizeTraining;
-    for(size_t i(0); i<this->m_sizeTraining; i++)
+    output << this->trainingSize();
+    
+    MatrixXf trainingInput, trainingOutput;
+    this->_decode(this->m_training, trainingInput, trainingOutput);
+    for(size_t i(0); i<this->trainingSize(); i++)
     {
-        DataPair *dp(this->m_training[i]);
-        for(auto &x:dp->input)
+        for(auto x:trainingInput.col(i))
         {
             output << x;
         }
-        for(auto &x:dp->output)
+        for(auto x:trainingOutput.col(i))
         {
             output << x;
         }
     }
 }
+
+void Dataset::toMapped(const string& filename) const
+{
+    // Written aside then renamed, so that readers never map a partial file
+    const string temporary(filename + ".tmp" + to_string(getpid()));
+    ofstream file(temporary, ios::binary);
+    if(!file.is_open())
+    {
+        throw logic_error("Could not open filename : "+temporary);
+    }
+    
+    DatasetFileHeader header{};
+    header.magic = DatasetFileHeader::Magic;
+    header.version = DatasetFileHeader::Version;
+    header.inputType = this->m_inputType;
+    header.outputType = this->m_outputType;
+    header.inputScale = this->m_inputScale;
+    header.inputSize = this->m_inputSize;
+    header.outputSize = this->m_outputSize;
+    header.trainingSize = this->m_training.size;
+    header.validationSize = this->m_validation.size;
+    
+    const char* blocks[4] = {this->m_training.input, this->m_training.output, this->m_validation.input, this->m_validation.output};
+    const size_t sizes[4] = {
+        this->m_training.size * sampleBytes(this->m_inputType, this->m_inputSize),
+        this->m_training.size * sampleBytes(this->m_outputType, this->m_outputSize),
+        this->m_validation.size * sampleBytes(this->m_inputType, this->m_inputSize),
+        this->m_validation.size * sampleBytes(this->m_outputType, this->m_outputSize)
+    };
+    
+    size_t offset(sizeof(header));
+    for(int i(0); i<4; i++)
+    {
+        header.offsets[i] = alignBlock(offset);
+        offset = header.offsets[i] + sizes[i];
+    }
+    
+    // One bulk write per block, padded to the block alignment
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    offset = sizeof(header);
+    const char padding[64] = {};
+    for(int i(0); i<4; i++)
+    {
+        file.write(padding, header.offsets[i] - offset);
+        if(sizes[i])
+        {
+            file.write(blocks[i], sizes[i]);
+        }
+        offset = header.offsets[i] + sizes[i];
+    }
+    
+    file.close();
+    if(!file)
+    {
+        remove(temporary.c_str());
+        throw logic_error("Could not write filename : "+temporary);
+    }
+    if(rename(temporary.c_str(), filename.c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        throw logic_error("Could not rename "+temporary+" to "+filename);
+    }
+}
@@ -1,14 +1,20 @@
 #include <cmath>
+#include <cstring>
 #include <random>
 #include <string>
 #include <sstream>
 #include <fstream>
 #include <iostream>
 #include <filesystem>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
 #include <Eigen/Dense>
 
 #include "export.hpp"
 #include "engine.hpp"
+#include "checkpoint.hpp"
 
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
@@ -34,18 +40,18 @@ string vectorAsString(const VectorXf& v)
     return ss.str();
 };
 
-Network::Network(const int sizes[], const int& N, const ActivationType& actiType, const CostType& costType):
+Network::Network(const int sizes[], const int& N, const ActivationType& actiType, const CostType& costType, const bool& initialize):
 activationType(actiType),
 costType(costType),
-m_sizes(vector<int>(N)),
+m_sizes(vector<int>(sizes, sizes+N)),
 m_layers(vector<BaseLayer*>(N-1))
 {
     for(int i(0); i<N-2; i++)
     {
-        this->m_layers[i] = new HiddenLayer(sizes[i], sizes[i+1], ActivationType::Sigmoid);
+        this->m_layers[i] = new HiddenLayer(sizes[i], sizes[i+1], ActivationType::Sigmoid, initialize);
     }
     
-    this->m_layers.back() = new OutputLayer(sizes[N-2], sizes[N-1], actiType, costType);
+    this->m_layers.back() = new OutputLayer(sizes[N-2], sizes[N-1], actiType, costType, initialize);
 }
 
 Network::Network(const Network& other):
@@ -72,43 +78,481 @@ Network::~Network()
 
 void Network::SGD(const Dataset& dataset, const size_t& miniBatchSize, const size_t& epoch, const float& eta, const bool displayProgress)
 {
-    size_t nBatches(dataset.trainingSize()/miniBatchSize);
+    TrainingParameters parameters;
+    parameters.miniBatchSize = miniBatchSize;
+    parameters.epoch = epoch;
+    parameters.eta = eta;
+    parameters.displayProgress = displayProgress;
+    this->SGD(dataset, parameters);
+}
+
+TrainingReport Network::SGD(const Dataset& dataset, const TrainingParameters& parameters)
+{
+    const Communicator* communicator(parameters.communicator.get());
+    DatasetSource source(dataset, communicator ? communicator->rank() : 0, communicator ? communicator->size() : 1);
+    return this->SGD(source, parameters, &dataset);
+}
+
+TrainingReport Network::SGD(BatchSource& source, const TrainingParameters& parameters, const Dataset* validation)
+{
+    const size_t& miniBatchSize(parameters.miniBatchSize);
+    if(parameters.prefetch or parameters.augmentation)
+    {
+        // Same training on the prefetched batches, both per-sample and batched paths read them through nextBatch
+        PrefetchSource prefetched(source, miniBatchSize, max<size_t>(2, parameters.prefetch), parameters.augmentation);
+        TrainingParameters direct(parameters);
+        direct.prefetch = 0;
+        direct.augmentation = nullptr;
+        return this->SGD(prefetched, direct, validation);
+    }
+    
+    size_t nBatches(source.size()/miniBatchSize);
     cout << "Running SGD, batches count = "+to_string(nBatches) << "\n";
     
-    if(displayProgress)
+    const bool hasValidation(validation and validation->validationSize());
+    if(parameters.displayProgress or parameters.patience)
     {
-        if(!dataset.validationSize())
+        if(!hasValidation)
         {
             throw logic_error("No validation set provided");
         }
-        float acc(this->evaluateAccuracy(dataset));
+    }
+    
+    // Ranks start from the weights of rank 0, and only it writes files
+    Communicator* communicator(parameters.communicator.get());
+    const size_t ranks(communicator ? communicator->size() : 1);
+    const bool leader(!communicator or communicator->rank() == 0);
+    if(communicator)
+    {
+        if(parameters.asynchronous)
+        {
+            throw logic_error("Asynchronous training cannot run across processes");
+        }
+        for(BaseLayer* l:this->m_layers)
+        {
+            communicator->broadcast(l->weightData(), (size_t)l->outSize * l->inSize);
+            communicator->broadcast(l->biasData(), l->outSize);
+        }
+    }
+    
+    // Batched path buffers, one set per thread, allocated once for the whole training
+    const size_t nThreads(max<size_t>(1, parameters.asynchronous ? parameters.threads : min(parameters.threads, miniBatchSize)));
+    ThreadPool pool(nThreads);
+    if(parameters.displayProgress)
+    {
+        float acc(this->_evaluate(*validation, 1, pool).accuracy());
         cout << "Accuracy BEFORE training : " << acc << "%.\n";
     }
+    vector<vector<LayerBuffers>> buffers(nThreads, vector<LayerBuffers>(this->m_layers.size()));
+    vector<MatrixXf> outputs(nThreads);
+    MatrixXf input, output;
+    
+    shared_ptr<Optimizer> optimizer(parameters.optimizer ? parameters.optimizer : make_shared<SGDOptimizer>());
+    if(parameters.asynchronous and optimizer->hasState())
+    {
+        throw logic_error("Asynchronous training only supports plain SGD");
+    }
+    vector<size_t> tensorSizes;
+    for(const BaseLayer* l:this->m_layers)
+    {
+        tensorSizes.push_back((size_t)l->outSize * l->inSize);
+        tensorSizes.push_back(l->outSize);
+    }
+    optimizer->initialize(tensorSizes);
+    
+    // Instrumentation, read by _backprop while training
+    Telemetry* telemetry(parameters.telemetry.get());
+    this->m_telemetry = telemetry;
+    auto nextBatch = [&](MatrixXf& input, MatrixXf& output)
+    {
+        Telemetry::Scope scope(telemetry, Phase::Batch);
+        return source.nextBatch(miniBatchSize, input, output);
+    };
+    
+    // Sums the gradients of every rank, packed in a single message. They are in the
+    // layers for the per-sample path and in the buffers of thread 0 for the batched one.
+    vector<float> gradients;
+    auto allreduce = [&](vector<LayerBuffers>* layerBuffers)
+    {
+        Telemetry::Scope scope(telemetry, Phase::Allreduce);
+        size_t size(0);
+        for(const BaseLayer* l:this->m_layers)
+        {
+            size += (size_t)l->outSize * l->inSize + l->outSize;
+        }
+        gradients.resize(size);
+        for(bool pack : {true, false})
+        {
+            float* packed(gradients.data());
+            for(size_t l(0); l<this->m_layers.size(); l++)
+            {
+                BaseLayer& layer(*this->m_layers[l]);
+                const size_t weights((size_t)layer.outSize * layer.inSize);
+                float* deltaW(layerBuffers ? (*layerBuffers)[l].deltaW.data() : layer.weightGradientData());
+                float* deltaB(layerBuffers ? (*layerBuffers)[l].deltaB.data() : layer.biasGradientData());
+                if(pack)
+                {
+                    memcpy(packed, deltaW, weights * sizeof(float));
+                    memcpy(packed + weights, deltaB, layer.outSize * sizeof(float));
+                }
+                else
+                {
+                    memcpy(deltaW, packed, weights * sizeof(float));
+                    memcpy(deltaB, packed + weights, layer.outSize * sizeof(float));
+                }
+                packed += weights + layer.outSize;
+            }
+            if(pack)
+            {
+                communicator->allreduce(gradients.data(), size);
+            }
+        }
+    };
+    
+    TrainingReport report;
     
-    float coefficient(eta/miniBatchSize);
-    for(size_t e(0); e < epoch; e++)
+    // Early stopping : measure, keep the best weights, and tell whether patience ran out
+    vector<VectorXf> bestWeights;
+    size_t batchCount(0), staleCount(0);
+    float lastAccuracy(-1);
+    auto validate = [&]()
     {
-        dataset.shuffle();
-        for(size_t batch(0); batch<nBatches; batch++)
+        Telemetry::Scope scope(telemetry, Phase::Evaluation);
+        lastAccuracy = this->_evaluate(*validation, 1, pool).accuracy();
+        if(report.bestAccuracy < 0 or lastAccuracy > report.bestAccuracy + parameters.minDelta)
         {
-            size_t offset(batch * miniBatchSize);
-            for(size_t i(0); i < miniBatchSize; i++)
+            report.bestAccuracy = lastAccuracy;
+            report.bestBatch = batchCount;
+            staleCount = 0;
+            if(parameters.restoreBest)
             {
-                this->_backprop(dataset[i + offset]);
+                this->_copyWeights(bestWeights);
+            }
+            if(!parameters.bestModelFile.empty() and leader)
+            {
+                this->toBinary(parameters.bestModelFile);
+            }
+        }
+        else
+        {
+            staleCount++;
+        }
+        report.stoppedEarly = staleCount >= parameters.patience;
+        return report.stoppedEarly;
+    };
+    
+    // Checkpoints : the snapshot is taken here, between two mini-batches, and written by the writer thread
+    unique_ptr<CheckpointWriter> writer;
+    if(!parameters.checkpointFile.empty() and leader)
+    {
+        writer = make_unique<CheckpointWriter>(parameters.checkpointFile);
+    }
+    size_t firstEpoch(0), epochBatch(0);
+    auto lastCheckpoint = chrono::steady_clock::now();
+    size_t lastCheckpointBatch(0);
+    auto checkpointDue = [&]()
+    {
+        const float elapsed(chrono::duration<float>(chrono::steady_clock::now() - lastCheckpoint).count());
+        return writer and ((parameters.checkpointInterval and batchCount - lastCheckpointBatch >= parameters.checkpointInterval)
+                           or (parameters.checkpointSeconds > 0 and elapsed >= parameters.checkpointSeconds));
+    };
+    auto checkpoint = [&](const size_t& epoch, const size_t& batch)
+    {
+        unique_ptr<TrainingState> state(make_unique<TrainingState>());
+        state->activationType = this->activationType;
+        state->costType = this->costType;
+        state->sizes = this->m_sizes;
+        state->epoch = epoch;
+        state->batch = batch;
+        state->batchCount = batchCount;
+        this->_copyWeights(state->weights);
+        state->optimizerState = optimizer->state();
+        state->optimizerSteps = optimizer->stepCount();
+        ostringstream datasetGenerator, layerGenerator;
+        datasetGenerator << Generator;
+        layerGenerator << BaseLayer::generator();
+        state->datasetGenerator = datasetGenerator.str();
+        state->layerGenerator = layerGenerator.str();
+        source.saveState(state->sourceState);
+        state->bestAccuracy = report.bestAccuracy;
+        state->bestBatch = report.bestBatch;
+        state->staleCount = staleCount;
+        state->bestWeights = bestWeights;
+        writer->submit(move(state));
+        lastCheckpoint = chrono::steady_clock::now();
+        lastCheckpointBatch = batchCount;
+    };
+    
+    unique_ptr<TrainingState> resumed;
+    if(parameters.resume and !parameters.checkpointFile.empty() and filesystem::exists(parameters.checkpointFile))
+    {
+        resumed = make_unique<TrainingState>();
+        resumed->load(parameters.checkpointFile);
+        if(resumed->activationType != this->activationType or resumed->costType != this->costType or resumed->sizes != this->m_sizes)
+        {
+            throw logic_error("Checkpoint does not match the network : "+parameters.checkpointFile);
+        }
+        this->_restoreWeights(resumed->weights);
+        optimizer->restoreState(resumed->optimizerState, resumed->optimizerSteps);
+        istringstream(resumed->datasetGenerator) >> Generator;
+        istringstream(resumed->layerGenerator) >> BaseLayer::generator();
+        firstEpoch = resumed->epoch;
+        batchCount = lastCheckpointBatch = resumed->batchCount;
+        report.bestAccuracy = resumed->bestAccuracy;
+        report.bestBatch = resumed->bestBatch;
+        staleCount = resumed->staleCount;
+        bestWeights = move(resumed->bestWeights);
+        report.stoppedEarly = parameters.patience and staleCount >= parameters.patience;
+        cout << "Resuming at epoch " << resumed->epoch << ", batch " << resumed->batch << "\n";
+    }
+    
+    for(size_t e(firstEpoch); e < parameters.epoch and !report.stoppedEarly; e++)
+    {
+        auto start = chrono::steady_clock::now();
+        if(telemetry)
+        {
+            telemetry->begin(this->m_layers.size());
+        }
+        epochBatch = 0;
+        {
+            Telemetry::Scope scope(telemetry, Phase::Shuffle);
+            // The epoch of a checkpoint goes on from its position, replayed when the source cannot restore it
+            const bool restored(resumed and source.restoreState(resumed->sourceState));
+            if(resumed)
+            {
+                epochBatch = resumed->batch;
+            }
+            if(!restored or !epochBatch)
+            {
+                source.beginEpoch();
+            }
+            source.skip(epochBatch, miniBatchSize);
+            resumed.reset();
+        }
+        const size_t firstBatch(epochBatch);
+        if(parameters.asynchronous)
+        {
+            this->_runAsynchronousEpoch(source, parameters, *optimizer, pool, buffers);
+            batchCount += nBatches - epochBatch;
+            epochBatch = nBatches;
+        }
+        else while(nextBatch(input, output))
+        {
+            batchCount++;
+            epochBatch++;
+            optimizer->beginStep(parameters.eta, 1.f/(miniBatchSize * ranks));
+            if(parameters.batched or nThreads > 1)
+            {
+                pool.run(nThreads, [&](size_t t)
+                {
+                    size_t begin(t * miniBatchSize / nThreads), end((t+1) * miniBatchSize / nThreads);
+                    outputs[t] = output.middleCols(begin, end - begin);
+                    this->_backprop(input.middleCols(begin, end - begin), outputs[t], buffers[t]);
+                });
+                
+                for(size_t l(0); l<this->m_layers.size(); l++)
+                {
+                    Telemetry::Scope scope(telemetry, Phase::Gradient, l);
+                    for(size_t t(1); t<nThreads; t++)
+                    {
+                        buffers[0][l].accumulate(buffers[t][l]);
+                    }
+                }
+                if(communicator)
+                {
+                    allreduce(&buffers[0]);
+                }
+                for(size_t l(0); l<this->m_layers.size(); l++)
+                {
+                    Telemetry::Scope scope(telemetry, Phase::Update, l);
+                    this->m_layers[l]->updateWeightAndBias(*optimizer, l, buffers[0][l]);
+                }
+            }
+            else
+            {
+                for(size_t i(0); i < miniBatchSize; i++)
+                {
+                    this->_backprop(DataView{input.col(i), output.col(i)});
+                }
+                if(communicator)
+                {
+                    allreduce(nullptr);
+                }
+                
+                for(size_t l(0); l<this->m_layers.size(); l++)
+                {
+                    Telemetry::Scope scope(telemetry, Phase::Update, l);
+                    this->m_layers[l]->updateWeightAndBias(*optimizer, l);
+                }
             }
             
-            for(BaseLayer* l:this->m_layers)
+            if(parameters.patience and parameters.validationInterval and batchCount % parameters.validationInterval == 0 and validate())
             {
-                l->updateWeightAndBias(coefficient);
+                break;
+            }
+            
+            if(checkpointDue())
+            {
+                checkpoint(e, epochBatch);
             }
         }
+        
+        EpochReport epochReport;
+        epochReport.epoch = e;
+        epochReport.seconds = chrono::duration<float>(chrono::steady_clock::now() - start).count();
+        const size_t epochBatches(epochBatch - firstBatch);
+        epochReport.samplesPerSecond = epochBatches * miniBatchSize / epochReport.seconds;
+        epochReport.accuracy = -1;
+        if(parameters.patience and (!parameters.validationInterval or parameters.asynchronous))
+        {
+            validate();
+            epochReport.accuracy = lastAccuracy;
+        }
+        else if(parameters.evaluateEachEpoch and hasValidation)
+        {
+            Telemetry::Scope scope(telemetry, Phase::Evaluation);
+            epochReport.accuracy = this->_evaluate(*validation, 1, pool).accuracy();
+        }
+        report.epochs.push_back(epochReport);
+        
+        // Throughput over the training part of the epoch, as in the report
+        if(telemetry)
+        {
+            telemetry->endEpoch(e, epochReport.seconds, epochBatches * miniBatchSize, epochBatches);
+        }
+        
+        // Asynchronous epochs can only be saved here. The last checkpoint is always written,
+        // positioned at the start of the next epoch.
+        if(writer and (checkpointDue() or e+1 == parameters.epoch or report.stoppedEarly))
+        {
+            checkpoint(e+1, 0);
+        }
+        
+        if(parameters.displayProgress)
+        {
+            epochReport.print();
+        }
+    }
+    
+    this->m_telemetry = nullptr;
+    if(writer)
+    {
+        writer->flush();
+    }
+    if(!bestWeights.empty())
+    {
+        this->_restoreWeights(bestWeights);
     }
     
-    if(displayProgress)
+    if(parameters.displayProgress)
     {
-        float acc(this->evaluateAccuracy(dataset));
+        if(report.stoppedEarly)
+        {
+            cout << "Stopped early after " << batchCount << " batches, best accuracy at batch " << report.bestBatch << "\n";
+        }
+        float acc(this->_evaluate(*validation, 1, pool).accuracy());
         cout << "Accuracy AFTER training : " << acc << "%.\n";
     }
+    return report;
+}
+
+void Network::_copyWeights(vector<VectorXf>& weights) const
+{
+    weights.resize(2 * this->m_layers.size());
+    for(size_t l(0); l<this->m_layers.size(); l++)
+    {
+        const BaseLayer& layer(*this->m_layers[l]);
+        weights[2*l] = Eigen::Map<const VectorXf>(layer.weightData(), (size_t)layer.outSize * layer.inSize);
+        weights[2*l+1] = Eigen::Map<const VectorXf>(layer.biasData(), layer.outSize);
+    }
+}
+
+void Network::_restoreWeights(const vector<VectorXf>& weights)
+{
+    for(size_t l(0); l<this->m_layers.size(); l++)
+    {
+        BaseLayer& layer(*this->m_layers[l]);
+        Eigen::Map<VectorXf>(layer.weightData(), weights[2*l].size()) = weights[2*l];
+        Eigen::Map<VectorXf>(layer.biasData(), weights[2*l+1].size()) = weights[2*l+1];
+    }
+}
+
+void Network::_runAsynchronousEpoch(BatchSource& source, const TrainingParameters& parameters, Optimizer& optimizer, ThreadPool& pool, vector<vector<LayerBuffers>>& buffers)
+{
+    const size_t& miniBatchSize(parameters.miniBatchSize);
+    
+    // Stateless optimizer, a single step serves every mini-batch of the epoch
+    optimizer.beginStep(parameters.eta, 1.f/miniBatchSize);
+    
+    // Each thread pulls the next mini-batch of the epoch as soon as it is done with the
+    // previous one, then applies its gradient right away. Concurrent updates of the
+    // same coefficient may lose one contribution, which Hogwild! tolerates by design.
+    pool.run(pool.size(), [&](size_t t)
+    {
+        MatrixXf input, output;
+        while(true)
+        {
+            {
+                Telemetry::Scope scope(this->m_telemetry, Phase::Batch);
+                if(!source.nextBatch(miniBatchSize, input, output))
+                {
+                    break;
+                }
+            }
+            this->_backprop(input, output, buffers[t]);
+            for(size_t l(0); l<this->m_layers.size(); l++)
+            {
+                Telemetry::Scope scope(this->m_telemetry, Phase::Update, l);
+                this->m_layers[l]->updateWeightAndBias(optimizer, l, buffers[t][l]);
+            }
+        }
+    });
+}
+
+void EpochReport::print() const
+{
+    cout << "Epoch " << this->epoch << " : " << this->seconds << " s, " << this->samplesPerSecond << " samples/s";
+    if(this->accuracy >= 0)
+    {
+        cout << ", accuracy " << this->accuracy << "%";
+    }
+    cout << "\n";
+}
+
+void TrainingReport::print() const
+{
+    for(const EpochReport& r:this->epochs)
+    {
+        r.print();
+    }
+    if(this->bestAccuracy >= 0)
+    {
+        cout << "Best accuracy " << this->bestAccuracy << "% after " << this->bestBatch << " batches" << (this->stoppedEarly ? ", stopped early" : "") << "\n";
+    }
+}
+
+float EvaluationReport::accuracy() const
+{
+    return this->samples ? 100.f * this->correct / this->samples : 0;
+}
+
+float EvaluationReport::topKAccuracy() const
+{
+    return this->samples ? 100.f * this->topKCorrect / this->samples : 0;
+}
+
+void EvaluationReport::print() const
+{
+    cout << "Accuracy " << this->accuracy() << "%, top-" << this->k << " " << this->topKAccuracy() << "% over " << this->samples << " samples\n";
+    cout << "Confusion matrix (expected x predicted) :\n" << this->confusion << "\n";
+}
+
+void Network::setExpMode(const ExpMode& mode)
+{
+    for(BaseLayer* l:this->m_layers)
+    {
+        l->setExpMode(mode);
+    }
 }
 
 void Network::feedForward(VectorXf &input) const
@@ -119,59 +563,203 @@ void Network::feedForward(VectorXf &input) const
     }
 }
 
-void Network::_backprop(const DataPair &datapair) const
+MatrixXf Network::feedForwardBatch(const MatrixXf& inputs) const
+{
+    return this->_feedForwardBatch(inputs);
+}
+
+MatrixXf Network::feedForwardBatch(const float* inputs, const size_t& N) const
+{
+    Eigen::Map<const MatrixXf> map(inputs, this->m_sizes.front(), N);
+    return this->_feedForwardBatch(map);
+}
+
+MatrixXf Network::_feedForwardBatch(const Eigen::Ref<const MatrixXf>& inputs) const
+{
+    MatrixXf current, next;
+    this->_feedForwardBatch(inputs, current, next);
+    return current;
+}
+
+const MatrixXf& Network::_feedForwardBatch(const Eigen::Ref<const MatrixXf>& inputs, MatrixXf& current, MatrixXf& next) const
+{
+    // Ping-pong between two buffers so that no layer allocates a temporary,
+    // buffers kept by the caller are only reallocated when the batch size changes
+    this->m_layers.front()->feedForward(inputs, current);
+    for(size_t l(1); l<this->m_layers.size(); l++)
+    {
+        this->m_layers[l]->feedForward(current, next);
+        current.swap(next);
+    }
+    return current;
+}
+
+template<class... Buffers>
+void Network::_getDelta(const size_t& l, Buffers&... buffers) const
 {
-    VectorXf activation(datapair.input);
+    // Leaf layer types are final, so neither call goes through the vtable
+    if(l+1 == this->m_layers.size())
+    {
+        static_cast<OutputLayer*>(this->m_layers[l])->getDelta(buffers...);
+    }
+    else
+    {
+        static_cast<HiddenLayer*>(this->m_layers[l])->getDelta(buffers...);
+    }
+}
 
-    // Feedforward
-    for(auto it = this->m_layers.begin(); it != this->m_layers.end(); it++)
+void Network::_backprop(const DataView &datapair) const
+{
+    Telemetry* telemetry(this->m_telemetry);
+    
+    // Feedforward, each layer reading the activation saved by the previous one
     {
-        (*it)->feedForwardAndSave(activation);
+        Telemetry::Scope scope(telemetry, Phase::Forward, 0);
+        this->m_layers.front()->feedForwardAndSave(datapair.input);
+    }
+    for(size_t l(1); l<this->m_layers.size(); l++)
+    {
+        Telemetry::Scope scope(telemetry, Phase::Forward, l);
+        this->m_layers[l]->feedForwardAndSave(this->m_layers[l-1]->getActivation());
     }
     
-    activation = datapair.output;
+    VectorXf activation(datapair.output);
+    if(telemetry)
+    {
+        telemetry->addLoss(static_cast<const OutputLayer*>(this->m_layers.back())->getLoss(activation));
+    }
 
     // Backward
-    auto it = this->m_layers.rbegin();
-    for(size_t i(0); i<this->m_layers.size()-1; i++)
+    for(size_t l(this->m_layers.size()-1); l>0; l--)
     {
-        (*it)->getDelta(activation);
-        (*it)->updateCost((*next(it))->getActivation());
-        it++;
+        {
+            Telemetry::Scope scope(telemetry, Phase::Delta, l);
+            this->_getDelta(l, activation);
+        }
+        Telemetry::Scope scope(telemetry, Phase::Gradient, l);
+        this->m_layers[l]->updateCost(this->m_layers[l-1]->getActivation());
     }
-    assert(*it == this->m_layers[0]);
-    (*it)->getDelta(activation);
-    (*it)->updateCost(datapair.input);
+    {
+        Telemetry::Scope scope(telemetry, Phase::Delta, 0);
+        this->_getDelta(0, activation);
+    }
+    Telemetry::Scope scope(telemetry, Phase::Gradient, 0);
+    this->m_layers[0]->updateCost(datapair.input);
+}
+
+void Network::_backprop(const Eigen::Ref<const MatrixXf>& input, MatrixXf& output, vector<LayerBuffers>& buffers) const
+{
+    // Same equations as the per-sample version, each column being one sample.
+    // output is consumed as the backward buffer.
+    Telemetry* telemetry(this->m_telemetry);
+    
+    // Feedforward, each layer reading the activation saved by the previous one
+    {
+        Telemetry::Scope scope(telemetry, Phase::Forward, 0);
+        this->m_layers.front()->feedForwardAndSave(input, buffers.front());
+    }
+    for(size_t l(1); l<this->m_layers.size(); l++)
+    {
+        Telemetry::Scope scope(telemetry, Phase::Forward, l);
+        this->m_layers[l]->feedForwardAndSave(buffers[l-1].activation, buffers[l]);
+    }
+    
+    if(telemetry)
+    {
+        telemetry->addLoss(static_cast<const OutputLayer*>(this->m_layers.back())->getLoss(output, buffers.back()));
+    }
+    
+    // Backward
+    for(size_t l(this->m_layers.size()-1); l>0; l--)
+    {
+        {
+            Telemetry::Scope scope(telemetry, Phase::Delta, l);
+            this->_getDelta(l, output, buffers[l]);
+        }
+        Telemetry::Scope scope(telemetry, Phase::Gradient, l);
+        this->m_layers[l]->updateCost(buffers[l-1].activation, buffers[l]);
+    }
+    {
+        Telemetry::Scope scope(telemetry, Phase::Delta, 0);
+        this->_getDelta(0, output, buffers[0]);
+    }
+    Telemetry::Scope scope(telemetry, Phase::Gradient, 0);
+    this->m_layers[0]->updateCost(input, buffers[0]);
 }
 
 float Network::evaluateAccuracy(const Dataset& dataset) const
+{
+    return this->evaluate(dataset).accuracy();
+}
+
+EvaluationReport Network::evaluate(const Dataset& dataset, const size_t& k, const size_t& threads) const
+{
+    ThreadPool pool(max<size_t>(1, threads));
+    return this->_evaluate(dataset, k, pool);
+}
+
+EvaluationReport Network::_evaluate(const Dataset& dataset, const size_t& k, ThreadPool& pool) const
 {
     // A valid output response is an output response where the index 
     // of the largest element is equal to the index of the largest
     // element in the target vector.
     
-    float success(0);
-    size_t idxTarget, idxComputed;
-    for(size_t i(0); i<dataset.validationSize(); i++)
+    const size_t blockSize(256);
+    const size_t classes(this->m_sizes.back());
+    const size_t nBlocks((dataset.validationSize() + blockSize - 1) / blockSize);
+    const size_t nThreads(pool.size());
+    if(dataset.outputSize() != classes)
     {
-        // Get validation data
-        DataPair datapair(dataset.getTestData(i));
-        
-        // Feedfoward input
-        VectorXf activation(datapair.input);
-        this->feedForward(activation);
-        
-        // Compare output from feedforward and output target
-        datapair.output.maxCoeff(&idxTarget);
-        activation.maxCoeff(&idxComputed);
+        throw logic_error("Dataset outputs do not match the network");
+    }
+    
+    // Each thread takes blocks t, t+nThreads, ... with its own buffers and counts
+    vector<EvaluationReport> reports(nThreads);
+    pool.run(nThreads, [&](size_t t)
+    {
+        EvaluationReport& report(reports[t]);
+        report.confusion.setZero(classes, classes);
         
-        // Evaluate success
-        if(idxTarget==idxComputed)
+        MatrixXf decoded, current, next;
+        vector<size_t> labels(blockSize);
+        for(size_t b(t); b<nBlocks; b+=nThreads)
         {
-            success++;
+            const size_t offset(b * blockSize), size(min(blockSize, dataset.validationSize() - offset));
+            
+            // Validation data is read in place when stored as floats
+            const MatrixXf& activation(this->_feedForwardBatch(dataset.getValidationInputs(offset, size, decoded), current, next));
+            dataset.getValidationLabels(offset, size, labels.data());
+            
+            for(size_t i(0); i<size; i++)
+            {
+                const size_t expected(labels[i]);
+                Eigen::Index predicted;
+                activation.col(i).maxCoeff(&predicted);
+                report.confusion(expected, predicted)++;
+                
+                // Rank of the expected class, ties broken by index as maxCoeff does
+                const float score(activation(expected, i));
+                size_t rank(0);
+                for(size_t c(0); c<classes; c++)
+                {
+                    rank += activation(c, i) > score or (activation(c, i) == score and c < expected);
+                }
+                report.topKCorrect += rank < k;
+            }
         }
+    });
+    
+    EvaluationReport report;
+    report.k = k;
+    report.samples = dataset.validationSize();
+    report.confusion.setZero(classes, classes);
+    for(const EvaluationReport& r:reports)
+    {
+        report.topKCorrect += r.topKCorrect;
+        report.confusion += r.confusion;
     }
-    return 100 * success/dataset.validationSize();
+    report.correct = report.confusion.diagonal().sum();
+    return report;
 }
 
 void Network::getStats() const
@@ -242,16 +830,25 @@ Network* Network::loadBinary(boost::archive::binary_iarchive &ar)
     CostType costType; ar >> costType;
     
     size_t N; ar >> N;
-    int sizes[N];
-    for(int i(0); i<(int)N; i++)
+    vector<int> sizes(N);
+    for(int& s:sizes)
     {
-        ar >> sizes[i];
+        ar >> s;
     }
 
-    Network* network = new Network(sizes, (int)N, activationType, costType);
-    for(BaseLayer* l:network->m_layers)
+    // Every weight is overwritten below, skip the random initialization
+    Network* network = new Network(sizes.data(), (int)N, activationType, costType, false);
+    try
+    {
+        for(BaseLayer* l:network->m_layers)
+        {
+            l->fromBinary(ar);
+        }
+    }
+    catch(...)
     {
-        l->fromBinary(ar);
+        delete network;
+        throw;
     }
     return network;
 }
@@ -259,11 +856,201 @@ Network* Network::loadBinary(boost::archive::binary_iarchive &ar)
 Network* Network::loadFile(const string &fileName)
 {
     ifstream file(fileName, ios::binary);
+    if(!file.is_open())
+    {
+        throw logic_error("Could not open filename : "+fileName);
+    }
+    
+    // Pick the loader from the magic number
+    uint32_t magic(0);
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    if(file and magic == ModelFileHeader::Magic)
+    {
+        file.close();
+        return loadMapped(fileName, false);
+    }
+    
+    file.clear();
+    file.seekg(0);
     boost::archive::binary_iarchive input(file);
     
     return loadBinary(input);
 }
 
+vector<size_t> modelBlockOffsets(const vector<int>& sizes, const size_t& weightBytes)
+{
+    vector<size_t> offsets;
+    size_t offset(sizeof(ModelFileHeader) + sizes.size() * sizeof(uint32_t));
+    for(size_t l(0); l+1<sizes.size(); l++)
+    {
+        offsets.push_back(alignBlock(offset));
+        offset = offsets.back() + sizes[l+1] * sizeof(float);
+        offsets.push_back(alignBlock(offset));
+        offset = offsets.back() + (size_t)sizes[l+1] * sizes[l] * weightBytes;
+    }
+    offsets.push_back(offset);
+    return offsets;
+}
+
+static vector<int> checkModelHeader(const ModelFileHeader& header, const string& fileName)
+{
+    if(header.magic != ModelFileHeader::Magic or header.version != ModelFileHeader::Version)
+    {
+        throw logic_error("Unsupported model file version : "+fileName);
+    }
+    if(header.activationType > ActivationType::Softmax or header.costType > CostType::CrossEntropy or header.weightType > WeightType::BFloat16)
+    {
+        throw logic_error("Unsupported layer type in model file : "+fileName);
+    }
+    if(header.sizeCount < 2)
+    {
+        throw logic_error("Invalid layer sizes in model file : "+fileName);
+    }
+    return vector<int>(header.sizeCount);
+}
+
+static void checkModelSizes(const vector<int>& sizes, const string& fileName)
+{
+    for(const int& s:sizes)
+    {
+        if(s <= 0)
+        {
+            throw logic_error("Invalid layer sizes in model file : "+fileName);
+        }
+    }
+}
+
+vector<int> readModelHeader(const MappedFile& mapping, ModelFileHeader& header, const string& fileName)
+{
+    if(mapping.size() < sizeof(header))
+    {
+        throw logic_error("Truncated model file : "+fileName);
+    }
+    header = *reinterpret_cast<const ModelFileHeader*>(mapping.data());
+    vector<int> sizes(checkModelHeader(header, fileName));
+    if(mapping.size() < sizeof(header) + sizes.size() * sizeof(uint32_t))
+    {
+        throw logic_error("Truncated model file : "+fileName);
+    }
+    const uint32_t* stored(reinterpret_cast<const uint32_t*>(mapping.data() + sizeof(header)));
+    copy(stored, stored + sizes.size(), sizes.begin());
+    checkModelSizes(sizes, fileName);
+    return sizes;
+}
+
+void Network::toMapped(const string& dest) const
+{
+    ofstream file(dest, ios::binary);
+    if(!file.is_open())
+    {
+        throw logic_error("Could not open filename : "+dest);
+    }
+    
+    ModelFileHeader header{};
+    header.magic = ModelFileHeader::Magic;
+    header.version = ModelFileHeader::Version;
+    header.activationType = this->activationType;
+    header.costType = this->costType;
+    header.weightType = WeightType::Float32;
+    header.sizeCount = this->m_sizes.size();
+    
+    const vector<uint32_t> sizes(this->m_sizes.begin(), this->m_sizes.end());
+    const vector<size_t> offsets(modelBlockOffsets(this->m_sizes));
+    
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(sizes.data()), sizes.size() * sizeof(uint32_t));
+    
+    // One bulk write per tensor, padded to the block alignment
+    size_t offset(sizeof(header) + sizes.size() * sizeof(uint32_t));
+    const char padding[64] = {};
+    for(size_t l(0); l<this->m_layers.size(); l++)
+    {
+        const BaseLayer& layer(*this->m_layers[l]);
+        const float* blocks[2] = {layer.biasData(), layer.weightData()};
+        const size_t bytes[2] = {layer.outSize * sizeof(float), (size_t)layer.outSize * layer.inSize * sizeof(float)};
+        for(int i(0); i<2; i++)
+        {
+            file.write(padding, offsets[2*l+i] - offset);
+            file.write(reinterpret_cast<const char*>(blocks[i]), bytes[i]);
+            offset = offsets[2*l+i] + bytes[i];
+        }
+    }
+    
+    if(!file)
+    {
+        throw logic_error("Could not write filename : "+dest);
+    }
+}
+
+Network* Network::loadMapped(const string& fileName, const bool& inPlace)
+{
+    shared_ptr<MappedFile> mapping;
+    ifstream file;
+    ModelFileHeader header;
+    vector<int> sizes;
+    
+    if(inPlace)
+    {
+        mapping = make_shared<MappedFile>(fileName, true);
+        sizes = readModelHeader(*mapping, header, fileName);
+    }
+    else
+    {
+        file.open(fileName, ios::binary);
+        if(!file.is_open())
+        {
+            throw logic_error("Could not open filename : "+fileName);
+        }
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if(!file)
+        {
+            throw logic_error("Truncated model file : "+fileName);
+        }
+        sizes = checkModelHeader(header, fileName);
+        vector<uint32_t> stored(sizes.size());
+        file.read(reinterpret_cast<char*>(stored.data()), stored.size() * sizeof(uint32_t));
+        copy(stored.begin(), stored.end(), sizes.begin());
+        checkModelSizes(sizes, fileName);
+    }
+    
+    if(header.weightType != WeightType::Float32)
+    {
+        throw logic_error("Reduced precision model, load it with InferenceModel : "+fileName);
+    }
+    const vector<size_t> offsets(modelBlockOffsets(sizes));
+    if(inPlace and offsets.back() > mapping->size())
+    {
+        throw logic_error("Truncated model file : "+fileName);
+    }
+    
+    // Every weight comes from the file, skip the random initialization
+    Network* network = new Network(sizes.data(), (int)sizes.size(), header.activationType, header.costType, false);
+    for(size_t l(0); l<network->m_layers.size(); l++)
+    {
+        BaseLayer& layer(*network->m_layers[l]);
+        if(inPlace)
+        {
+            layer.bind(mapping,
+                       reinterpret_cast<float*>(mapping->data() + offsets[2*l]),
+                       reinterpret_cast<float*>(mapping->data() + offsets[2*l+1]));
+        }
+        else
+        {
+            file.seekg(offsets[2*l]);
+            file.read(reinterpret_cast<char*>(layer.biasData()), layer.outSize * sizeof(float));
+            file.seekg(offsets[2*l+1]);
+            file.read(reinterpret_cast<char*>(layer.weightData()), (size_t)layer.outSize * layer.inSize * sizeof(float));
+        }
+    }
+    
+    if(!inPlace and !file)
+    {
+        delete network;
+        throw logic_error("Truncated model file : "+fileName);
+    }
+    return network;
+}
+
 bool Network::operator==(const Network& other) const
 {
     if(this->m_sizes != other.m_sizes or
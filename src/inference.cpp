@@ -0,0 +1,214 @@
+#include "inference.hpp"
+#include "simd.hpp"
+
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+using RowMajorMatrixXf = Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+InferenceModel::InferenceModel(const vector<int>& sizes, const ActivationType& actiType, const CostType& costType, const WeightType& weightType):
+activationType(actiType),
+costType(costType),
+m_sizes(sizes),
+m_weightType(weightType)
+{
+    if(weightType != WeightType::Float16 and weightType != WeightType::BFloat16)
+    {
+        throw logic_error("InferenceModel only stores half precision or bfloat16 weights");
+    }
+    for(size_t l(0); l+1<sizes.size(); l++)
+    {
+        const bool output(l+2 == sizes.size());
+        this->m_layers.push_back({(size_t)sizes[l], (size_t)sizes[l+1], nullptr, nullptr,
+                                  makeActivation(output ? actiType : ActivationType::Sigmoid)});
+    }
+}
+
+InferenceModel::InferenceModel(const Network& network, const WeightType& weightType):
+InferenceModel(network.sizes(), network.activationType, network.costType, weightType)
+{
+    for(size_t l(0); l<this->m_layers.size(); l++)
+    {
+        const BaseLayer& source(network.layer(l));
+        Layer& layer(this->m_layers[l]);
+        
+        this->m_biasStorage.emplace_back(Eigen::Map<const VectorXf>(source.biasData(), layer.outSize));
+        
+        // Network weights are column-major, the kernels read one output row at a time
+        const RowMajorMatrixXf weights(Eigen::Map<const MatrixXf>(source.weightData(), layer.outSize, layer.inSize));
+        this->m_weightStorage.emplace_back(weights.size());
+        if(weightType == WeightType::Float16)
+        {
+            toHalf(weights.data(), this->m_weightStorage.back().data(), weights.size());
+        }
+        else
+        {
+            toBFloat16(weights.data(), this->m_weightStorage.back().data(), weights.size());
+        }
+        
+        layer.biases = this->m_biasStorage.back().data();
+        layer.weights = this->m_weightStorage.back().data();
+    }
+}
+
+InferenceModel* InferenceModel::loadMapped(const string& fileName)
+{
+    shared_ptr<MappedFile> mapping(make_shared<MappedFile>(fileName));
+    ModelFileHeader header;
+    const vector<int> sizes(readModelHeader(*mapping, header, fileName));
+    if(header.weightType == WeightType::Float32)
+    {
+        throw logic_error("Full precision model, load it with Network : "+fileName);
+    }
+    const vector<size_t> offsets(modelBlockOffsets(sizes, sizeof(uint16_t)));
+    if(offsets.back() > mapping->size())
+    {
+        throw logic_error("Truncated model file : "+fileName);
+    }
+    
+    InferenceModel* model = new InferenceModel(sizes, header.activationType, header.costType, header.weightType);
+    for(size_t l(0); l<model->m_layers.size(); l++)
+    {
+        model->m_layers[l].biases = reinterpret_cast<const float*>(mapping->data() + offsets[2*l]);
+        model->m_layers[l].weights = reinterpret_cast<const uint16_t*>(mapping->data() + offsets[2*l+1]);
+    }
+    model->m_mapping = mapping;
+    return model;
+}
+
+void InferenceModel::toMapped(const string& dest) const
+{
+    ofstream file(dest, ios::binary);
+    if(!file.is_open())
+    {
+        throw logic_error("Could not open filename : "+dest);
+    }
+    
+    ModelFileHeader header{};
+    header.magic = ModelFileHeader::Magic;
+    header.version = ModelFileHeader::Version;
+    header.activationType = this->activationType;
+    header.costType = this->costType;
+    header.weightType = this->m_weightType;
+    header.sizeCount = this->m_sizes.size();
+    
+    const vector<uint32_t> sizes(this->m_sizes.begin(), this->m_sizes.end());
+    const vector<size_t> offsets(modelBlockOffsets(this->m_sizes, sizeof(uint16_t)));
+    
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(sizes.data()), sizes.size() * sizeof(uint32_t));
+    
+    size_t offset(sizeof(header) + sizes.size() * sizeof(uint32_t));
+    const char padding[64] = {};
+    for(size_t l(0); l<this->m_layers.size(); l++)
+    {
+        const Layer& layer(this->m_layers[l]);
+        const char* blocks[2] = {reinterpret_cast<const char*>(layer.biases), reinterpret_cast<const char*>(layer.weights)};
+        const size_t bytes[2] = {layer.outSize * sizeof(float), layer.outSize * layer.inSize * sizeof(uint16_t)};
+        for(int i(0); i<2; i++)
+        {
+            file.write(padding, offsets[2*l+i] - offset);
+            file.write(blocks[i], bytes[i]);
+            offset = offsets[2*l+i] + bytes[i];
+        }
+    }
+    
+    if(!file)
+    {
+        throw logic_error("Could not write filename : "+dest);
+    }
+}
+
+void InferenceModel::_gemv(const Layer& layer, const float* x, float* y) const
+{
+    if(this->m_weightType == WeightType::Float16)
+    {
+        gemvHalf(layer.weights, x, y, layer.outSize, layer.inSize);
+    }
+    else
+    {
+        gemvBFloat16(layer.weights, x, y, layer.outSize, layer.inSize);
+    }
+}
+
+void InferenceModel::_gemm(const Layer& layer, const Eigen::Ref<const MatrixXf>& inputs, MatrixXf& outputs) const
+{
+    // Blocks of rows are widened into a small float buffer that stays in cache,
+    // so the reduced weights are still read once per batch
+    const size_t blockRows(64);
+    RowMajorMatrixXf block(min(blockRows, layer.outSize), layer.inSize);
+    outputs.resize(layer.outSize, inputs.cols());
+    for(size_t r(0); r<layer.outSize; r+=blockRows)
+    {
+        const size_t rows(min(blockRows, layer.outSize - r));
+        const uint16_t* weights(layer.weights + r * layer.inSize);
+        if(this->m_weightType == WeightType::Float16)
+        {
+            convertHalf(weights, block.data(), rows * layer.inSize);
+        }
+        else
+        {
+            convertBFloat16(weights, block.data(), rows * layer.inSize);
+        }
+        outputs.middleRows(r, rows).noalias() = block.topRows(rows) * inputs;
+    }
+}
+
+void InferenceModel::feedForward(VectorXf& input) const
+{
+    VectorXf output;
+    for(const Layer& layer:this->m_layers)
+    {
+        output.resize(layer.outSize);
+        this->_gemv(layer, input.data(), output.data());
+        visit([&](const auto& engine){ engine.main(output, layer.biases, nullptr); }, layer.activationEngine);
+        input.swap(output);
+    }
+}
+
+MatrixXf InferenceModel::feedForwardBatch(const MatrixXf& inputs) const
+{
+    return this->_feedForwardBatch(inputs);
+}
+
+MatrixXf InferenceModel::feedForwardBatch(const float* inputs, const size_t& N) const
+{
+    Eigen::Map<const MatrixXf> map(inputs, this->m_sizes.front(), N);
+    return this->_feedForwardBatch(map);
+}
+
+MatrixXf InferenceModel::_feedForwardBatch(const Eigen::Ref<const MatrixXf>& inputs) const
+{
+    MatrixXf current, next;
+    this->_gemm(this->m_layers.front(), inputs, current);
+    visit([&](const auto& engine){ engine.main(current, this->m_layers.front().biases, nullptr); }, this->m_layers.front().activationEngine);
+    for(size_t l(1); l<this->m_layers.size(); l++)
+    {
+        const Layer& layer(this->m_layers[l]);
+        this->_gemm(layer, current, next);
+        visit([&](const auto& engine){ engine.main(next, layer.biases, nullptr); }, layer.activationEngine);
+        current.swap(next);
+    }
+    return current;
+}
+
+void InferenceModel::setExpMode(const ExpMode& mode)
+{
+    for(Layer& layer:this->m_layers)
+    {
+        visit([&](Activation& engine){ engine.setExpMode(mode); }, layer.activationEngine);
+    }
+}
+
+float InferenceModel::evaluateAccuracy(const Dataset& dataset) const
+{
+    if(dataset.inputSize() != (size_t)this->m_sizes.front() or dataset.outputSize() != (size_t)this->m_sizes.back())
+    {
+        throw logic_error("Dataset does not match the model");
+    }
+    
+    return dataset.validationAccuracy([this](const Eigen::Ref<const MatrixXf>& inputs){return this->_feedForwardBatch(inputs);});
+}
@@ -1,6 +1,7 @@
 #include "layer.hpp"
 #include <string>
 #include <iostream>
+#include <stdexcept>
 #include "export.hpp"
 
 #include <boost/archive/binary_oarchive.hpp>
@@ -27,62 +28,81 @@ void printStatV2(MatrixXf& mat)
     cout << endl;
 }
 
-BaseLayer::BaseLayer(const int& in, const int& out, const ActivationType& actiType):
+void LayerBuffers::accumulate(const LayerBuffers& other)
+{
+    this->deltaW += other.deltaW;
+    this->deltaB += other.deltaB;
+}
+
+BaseLayer::BaseLayer(const int& in, const int& out, const ActivationType& actiType, const bool& initialize):
 inSize(in),
 outSize(out),
-m_biases(VectorXf(out)),
-m_weights(MatrixXf(out, in)),
+m_biasStorage(VectorXf(out)),
+m_weightStorage(MatrixXf(out, in)),
+m_biases(m_biasStorage.data(), out),
+m_weights(m_weightStorage.data(), out, in),
 m_deltaB(VectorXf(out)),
-m_deltaW(MatrixXf(out, in))
+m_deltaW(MatrixXf(out, in)),
+m_activationEngine(makeActivation(actiType))
 {
     this->_initializeBuffers();
     
-    MatrixXf& W(this->m_weights);
-    VectorXf& B(this->m_biases);
-    
-    W = W.unaryExpr([](float){return distribution(BaseLayer::Generator);});
-    B = B.unaryExpr([](float){return distribution(BaseLayer::Generator);});
-    
-    W /= pow(in, .5);
-
-    switch(actiType)
+    if(initialize)
     {
-        case ActivationType::Sigmoid :
-            this->m_activationEngine = new Sigmoid();
-            break;
-        case ActivationType::Softmax :
-            this->m_activationEngine = new Softmax();
-            break;
-        default :
-            throw;
+        MatrixXf& W(this->m_weightStorage);
+        VectorXf& B(this->m_biasStorage);
+        
+        W = W.unaryExpr([](float){return distribution(BaseLayer::Generator);});
+        B = B.unaryExpr([](float){return distribution(BaseLayer::Generator);});
+        
+        W /= pow(in, .5);
     }
 }
 
 BaseLayer::BaseLayer(const BaseLayer& other):
 inSize(other.inSize),
 outSize(other.outSize),
-m_biases(other.m_biases),
-m_weights(other.m_weights),
+m_biasStorage(other.m_biases),
+m_weightStorage(other.m_weights),
+m_biases(m_biasStorage.data(), other.outSize),
+m_weights(m_weightStorage.data(), other.outSize, other.inSize),
 m_deltaB(other.m_deltaB),
 m_deltaW(other.m_deltaW),
-m_activationEngine(other.m_activationEngine->clone())
+m_activationEngine(other.m_activationEngine)
 {}
 
-BaseLayer::~BaseLayer()
-{
-    delete this->m_activationEngine;
-}
-
 void BaseLayer::_initializeBuffers()
 {
     this->m_deltaW.setZero();
     this->m_deltaB.setZero();
 }
 
+void BaseLayer::_bindStorage()
+{
+    // Placement new is how Eigen rebinds a Map
+    new (&this->m_biases) Eigen::Map<VectorXf>(this->m_biasStorage.data(), this->m_biasStorage.size());
+    new (&this->m_weights) Eigen::Map<MatrixXf>(this->m_weightStorage.data(), this->m_weightStorage.rows(), this->m_weightStorage.cols());
+    this->m_mapping.reset();
+}
+
+void BaseLayer::bind(const shared_ptr<MappedFile>& mapping, float* biases, float* weights)
+{
+    new (&this->m_biases) Eigen::Map<VectorXf>(biases, this->outSize);
+    new (&this->m_weights) Eigen::Map<MatrixXf>(weights, this->outSize, this->inSize);
+    this->m_mapping = mapping;
+    this->m_biasStorage.resize(0);
+    this->m_weightStorage.resize(0, 0);
+}
+
+void BaseLayer::setExpMode(const ExpMode& mode)
+{
+    visit([&](Activation& engine){ engine.setExpMode(mode); }, this->m_activationEngine);
+}
+
 void BaseLayer::_applyMain(VectorXf &a) const
 {
-    a = this->m_weights * a + this->m_biases;
-    this->m_activationEngine->main(a);
+    a = this->m_weights * a;
+    visit([&](const auto& engine){ engine.main(a, this->m_biases.data(), nullptr); }, this->m_activationEngine);
 }
 
 void BaseLayer::feedForward(VectorXf &a) const
@@ -90,20 +110,41 @@ void BaseLayer::feedForward(VectorXf &a) const
     this->_applyMain(a);
 }
 
-void BaseLayer::feedForwardAndSave(VectorXf &a)
+void BaseLayer::feedForward(const Eigen::Ref<const MatrixXf>& input, MatrixXf& output) const
 {
-    this->_applyMain(a);
-    this->m_activation = a;
-    this->m_activationEngine->prim(this->m_activation, this->m_derivative);
+    // One GEMM for the whole batch, bias broadcast over the columns with the activation
+    output.noalias() = this->m_weights * input;
+    visit([&](const auto& engine){ engine.main(output, this->m_biases.data(), nullptr); }, this->m_activationEngine);
+}
+
+void BaseLayer::feedForwardAndSave(const Eigen::Ref<const VectorXf>& input)
+{
+    // Affine output written straight into the saved activation, then bias,
+    // activation and derivative in a single pass
+    this->m_activation.noalias() = this->m_weights * input;
+    visit([&](const auto& engine){ engine.main(this->m_activation, this->m_biases.data(), &this->m_derivative); }, this->m_activationEngine);
 }
 
-void BaseLayer::updateCost(const VectorXf& activation)
+void BaseLayer::updateCost(const Eigen::Ref<const VectorXf>& activation)
 {
     this->m_deltaB += this->m_deltaComputed; // BP3
     this->m_deltaW += this->m_deltaComputed * activation.transpose(); // BP4;
 }
 
-HiddenLayer::HiddenLayer(const int& in, const int& out, const ActivationType& actiType):BaseLayer(in, out, actiType){}
+void BaseLayer::feedForwardAndSave(const Eigen::Ref<const MatrixXf>& input, LayerBuffers& buffers) const
+{
+    buffers.activation.noalias() = this->m_weights * input;
+    visit([&](const auto& engine){ engine.main(buffers.activation, this->m_biases.data(), &buffers.derivative); }, this->m_activationEngine);
+}
+
+void BaseLayer::updateCost(const Eigen::Ref<const MatrixXf>& activation, LayerBuffers& buffers) const
+{
+    // Sum of BP3/BP4 over the batch : one GEMM instead of one outer product per sample
+    buffers.deltaB = buffers.delta.rowwise().sum();
+    buffers.deltaW.noalias() = buffers.delta * activation.transpose();
+}
+
+HiddenLayer::HiddenLayer(const int& in, const int& out, const ActivationType& actiType, const bool& initialize):BaseLayer(in, out, actiType, initialize){}
 
 BaseLayer* HiddenLayer::clone() const
 {
@@ -117,65 +158,47 @@ void HiddenLayer::getDelta(VectorXf &product_next)
     product_next = this->m_weights.transpose() * this->m_deltaComputed;
 }
 
-OutputLayer::OutputLayer(const int& in, const int& out,
-                         const ActivationType& actiType,
-                         const CostType& costType):BaseLayer(in, out, actiType)
+void HiddenLayer::getDelta(MatrixXf &product_next, LayerBuffers& buffers) const
 {
-    switch (costType)
-    {
-        case CostType::Quadratic:
-            this->m_costEngine = new Quadratic(&this->m_derivative);
-            break;
-        case CostType::CrossEntropy:
-            this->m_costEngine = new CrossEntropy();
-            break;
-        default:
-            throw;
-    }
+    buffers.delta = product_next.array() * buffers.derivative.array();
+    product_next.noalias() = this->m_weights.transpose() * buffers.delta;
 }
 
+OutputLayer::OutputLayer(const int& in, const int& out,
+                         const ActivationType& actiType,
+                         const CostType& costType,
+                         const bool& initialize):
+BaseLayer(in, out, actiType, initialize),
+m_costEngine(makeCost(costType))
+{}
+
 BaseLayer* OutputLayer::clone() const
 {
     return new OutputLayer(*this);
 }
 
-OutputLayer::OutputLayer(const OutputLayer& other):
-BaseLayer(other)
+void OutputLayer::getDelta(VectorXf& expectedOutput)
 {
-    if(dynamic_cast<Quadratic*>(this->m_costEngine))
-    {
-        this->m_costEngine = new Quadratic(&this->m_derivative);
-    }
-    else if(dynamic_cast<CrossEntropy*>(this->m_costEngine))
-    {
-        this->m_costEngine = new CrossEntropy();
-    }
+    // Equation BP1
+    // Update expectedOutput as the same vector will be re-used during SGD
+    visit([&](const auto& cost){ cost.getGradient(this->m_activation, expectedOutput, this->m_derivative, this->m_deltaComputed); }, this->m_costEngine);
+    expectedOutput = this->m_weights.transpose() * this->m_deltaComputed;
 }
 
-//OutputLayer::OutputLayer(OutputLayer&& other):BaseLayer(other)
-//{
-//    this->m_costEngine = other.m_costEngine;
-//    if(dynamic_cast<Quadratic*>(this->m_costEngine))
-//    {
-//        this->m_costEngine = new Quadratic(&this->m_derivative);
-//    }
-//    else if(dynamic_cast<CrossEntropy*>(this->m_costEngine))
-//    {
-//        this->m_costEngine = new CrossEntropy();
-//    }
-//};
+void OutputLayer::getDelta(MatrixXf& expectedOutput, LayerBuffers& buffers) const
+{
+    visit([&](const auto& cost){ cost.getGradient(buffers.activation, expectedOutput, buffers.derivative, buffers.delta); }, this->m_costEngine);
+    expectedOutput.noalias() = this->m_weights.transpose() * buffers.delta;
+}
 
-OutputLayer::~OutputLayer()
+float OutputLayer::getLoss(const VectorXf& expectedOutput) const
 {
-    delete this->m_costEngine;
+    return visit([&](const auto& cost){ return cost.getLoss(this->m_activation, expectedOutput); }, this->m_costEngine);
 }
 
-void OutputLayer::getDelta(VectorXf& expectedOutput)
+float OutputLayer::getLoss(const MatrixXf& expectedOutput, const LayerBuffers& buffers) const
 {
-    // Equation BP1
-    // Update expectedOutput as the same vector will be re-used during SGD
-    this->m_costEngine->getGradient(this->m_activation, expectedOutput, this->m_deltaComputed);
-    expectedOutput = this->m_weights.transpose() * this->m_deltaComputed;
+    return visit([&](const auto& cost){ return cost.getLoss(buffers.activation, expectedOutput); }, this->m_costEngine);
 }
 
 void getStatistics(float means[], float stds[], const MatrixXf& W, const VectorXf& B)
@@ -204,25 +227,29 @@ void BaseLayer::print() const
 void BaseLayer::to_csv(const string& dest) const
 {
     string weightsFile(dest + "_weight.csv"), biasesFile(dest + "_bias.csv");
-    export_to_csv(this->m_weights, weightsFile);
-    export_to_csv(this->m_biases, biasesFile);
+    export_to_csv(MatrixXf(this->m_weights), weightsFile);
+    export_to_csv(VectorXf(this->m_biases), biasesFile);
 }
 
-void BaseLayer::updateWeightAndBias(const float &K)
+void BaseLayer::updateWeightAndBias(Optimizer& optimizer, const size_t& index)
 {
-    this->m_weights -= K * this->m_deltaW;
-    this->m_biases -= K * this->m_deltaB;
-    this->_initializeBuffers();
+    optimizer.update(2*index, this->m_weights.data(), this->m_deltaW.data(), false);
+    optimizer.update(2*index+1, this->m_biases.data(), this->m_deltaB.data(), true);
+}
+
+void BaseLayer::updateWeightAndBias(Optimizer& optimizer, const size_t& index, LayerBuffers& buffers)
+{
+    optimizer.update(2*index, this->m_weights.data(), buffers.deltaW.data(), false);
+    optimizer.update(2*index+1, this->m_biases.data(), buffers.deltaB.data(), true);
 }
 
+// Values are stored column-major as raw floats, so each tensor is a single
+// binary block : the bytes are the same as writing every value on its own.
 template<class Archive>
-void serializeVector(Archive& ar, const VectorXf& v)
+void serializeVector(Archive& ar, const Eigen::Ref<const VectorXf>& v)
 {
     ar << v.size();
-    for(int i(0); i<v.size(); i++)
-    {
-        ar << v(i);
-    }
+    ar.save_binary(v.data(), v.size() * sizeof(float));
 }
 
 template<class Archive>
@@ -230,24 +257,15 @@ void unserializeVector(Archive& ar, VectorXf& v)
 {
     size_t N; ar >> N;
     v = VectorXf(N);
-    for(size_t i(0); i<N; i++)
-    {
-        ar >> v(i);
-    }
+    ar.load_binary(v.data(), N * sizeof(float));
 }
 
 template<class Archive>
-void serializeMatrix(Archive & ar, const MatrixXf& m)
+void serializeMatrix(Archive & ar, const Eigen::Ref<const MatrixXf>& m)
 {
     size_t cols(m.cols()), rows(m.rows());
     ar << cols << rows;
-    for(size_t col(0); col<cols; col++)
-    {
-        for(size_t row(0); row<rows; row++)
-        {
-            ar << m(row, col);
-        }
-    }
+    ar.save_binary(m.data(), m.size() * sizeof(float));
 }
 
 template<class Archive>
@@ -257,13 +275,7 @@ void unserializeMatrix(Archive & ar, MatrixXf& m)
     ar >> cols;
     ar >> rows;
     m = MatrixXf(rows, cols);
-    for(size_t col(0); col<cols; col++)
-    {
-        for(size_t row(0); row<rows; row++)
-        {
-            ar >> m(row, col);
-        }
-    }
+    ar.load_binary(m.data(), m.size() * sizeof(float));
 }
 
 void BaseLayer::toBinary(boost::archive::binary_oarchive & ar) const
@@ -274,8 +286,14 @@ void BaseLayer::toBinary(boost::archive::binary_oarchive & ar) const
 
 void BaseLayer::fromBinary(boost::archive::binary_iarchive & ar)
 {
-    unserializeVector(ar, this->m_biases);
-    unserializeMatrix(ar, this->m_weights);
+    unserializeVector(ar, this->m_biasStorage);
+    unserializeMatrix(ar, this->m_weightStorage);
+    if(this->m_biasStorage.size() != this->outSize or
+       this->m_weightStorage.rows() != this->outSize or this->m_weightStorage.cols() != this->inSize)
+    {
+        throw logic_error("Layer size does not match the model file");
+    }
+    this->_bindStorage();
 }
 
 bool BaseLayer::equals(const BaseLayer& other) const
@@ -2,6 +2,7 @@
 #include "mnist.hpp"
 #include "dataset.hpp"
 #include "engine.hpp"
+#include "quantization.hpp"
 #include <chrono>
 #include <fstream>
 
@@ -35,7 +36,7 @@ void trainWithMnist(const ActivationType& activationType, const CostType& costTy
     Dataset dataset;
     
     std::cout << "Load MNIST dataset" << std::endl;
-    MNIST::load(dataset);
+    MNIST::load(dataset, "./data/", "./data/mnist.nnds");
     
     // Initialize the network for MNIST with 30 hidden neurons
     const int N(3);
@@ -55,13 +56,70 @@ void trainWithMnist(const ActivationType& activationType, const CostType& costTy
     net.toBinary("./exports/myNetwork");
 }
 
+void quantizeWithMnist()
+{
+    Dataset dataset;
+    
+    std::cout << "Load MNIST dataset" << std::endl;
+    MNIST::load(dataset, "./data/", "./data/mnist.nnds");
+    
+    // Model trained by trainWithMnist()
+    Network* net = Network::loadFile("./exports/myNetwork");
+    
+    for(const QuantizationScale& scale:{QuantizationScale::PerLayer, QuantizationScale::PerRow})
+    {
+        std::cout << (scale == QuantizationScale::PerLayer ? "Per-layer" : "Per-row") << " int8 weights : ";
+        QuantizedModel quantized(*net, dataset, scale);
+        quantized.compare(*net, dataset).print();
+    }
+    delete net;
+}
+
+// Run by neuralnetwork_launch : each rank trains on its shard of MNIST
+void distributedTrainingWithMnist()
+{
+    std::shared_ptr<Communicator> communicator(Communicator::fromEnvironment());
+    if(!communicator)
+    {
+        std::cout << "Start with : ./neuralnetwork_launch -n 2 ./neuralnetwork 4" << std::endl;
+        return;
+    }
+    
+    // Rank 0 alone (re)builds the shared cache, the others map it once it is written
+    Dataset dataset;
+    if(communicator->rank() == 0)
+    {
+        MNIST::load(dataset, "./data/", "./data/mnist.nnds");
+    }
+    communicator->barrier();
+    if(communicator->rank() != 0)
+    {
+        MNIST::load(dataset, "./data/", "./data/mnist.nnds");
+    }
+    
+    const int N(3);
+    const int sizes[N] = {784,30,10};
+    Network net(sizes, N, ActivationType::Sigmoid, CostType::CrossEntropy);
+    
+    TrainingParameters parameters;
+    parameters.epoch = 5;
+    parameters.communicator = communicator;
+    parameters.evaluateEachEpoch = true;
+    TrainingReport report(net.SGD(dataset, parameters));
+    if(communicator->rank() == 0)
+    {
+        report.print();
+        net.toBinary("./exports/myNetwork");
+    }
+}
+
 int main(int argc, const char * argv[])
 {
     char testToRun(0);
     char trainActivationMode(0), trainCostMode(0);
     if(argc == 1)
     {
-        std::cout << "Valid arguments:\n- 1 : saveAndLoad()\n- 2 : trainWithMnist()\nInput : ";
+        std::cout << "Valid arguments:\n- 1 : saveAndLoad()\n- 2 : trainWithMnist()\n- 3 : quantizeWithMnist()\n- 4 : distributedTrainingWithMnist()\nInput : ";
         std::cin >> testToRun;
         if(testToRun == '2')
         {
@@ -121,6 +179,12 @@ int main(int argc, const char * argv[])
             
             trainWithMnist(actiType, costType);
             break;
+        case '3':
+            quantizeWithMnist();
+            break;
+        case '4':
+            distributedTrainingWithMnist();
+            break;
         default:
             throw;
     }
@@ -0,0 +1,52 @@
+#include "mapping.hpp"
+
+#include <string>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+MappedFile::MappedFile(const string& filename, const bool& copyOnWrite):
+m_data(nullptr),
+m_size(0)
+{
+    int fd(open(filename.c_str(), O_RDONLY));
+    if(fd < 0)
+    {
+        throw logic_error("Could not open filename : "+filename);
+    }
+    
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw logic_error("Could not stat filename : "+filename);
+    }
+    this->m_size = st.st_size;
+    
+    if(this->m_size)
+    {
+        void* address(mmap(nullptr, this->m_size, copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0));
+        if(address == MAP_FAILED)
+        {
+            close(fd);
+            throw logic_error("Could not map filename : "+filename);
+        }
+        this->m_data = static_cast<char*>(address);
+    }
+    
+    // The mapping stays valid once the descriptor is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if(this->m_data)
+    {
+        munmap(this->m_data, this->m_size);
+    }
+}
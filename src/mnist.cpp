@@ -1,104 +1,133 @@
 #include "mnist.hpp"
 
-#include <fstream>
 #include <string>
+#include <cstring>
+#include <filesystem>
+#include <algorithm>
 #include <Eigen/Dense>
 #include <vector>
 #include "dataset.hpp"
+#include "threadpool.hpp"
 
 #include <cassert>
 
 using namespace std;
 
-// Function to read integers in big-endian format
-template<typename T>
-T readInt(ifstream& file) {
-    T value;
-    file.read(reinterpret_cast<char*>(&value), sizeof(T));
-    reverse(reinterpret_cast<char*>(&value), reinterpret_cast<char*>(&value) + sizeof(T));
-    return value;
+// Read integers in big-endian format
+static uint32_t readInt(const char* data)
+{
+    const uint8_t* b(reinterpret_cast<const uint8_t*>(data));
+    return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | uint32_t(b[3]);
+}
+
+IDXFile::IDXFile(const string& filename):
+m_mapping(filename),
+m_data(nullptr)
+{
+    // Magic number : two zero bytes, data type, count of dimensions
+    const char* data(this->m_mapping.data());
+    if(this->m_mapping.size() < 4 or data[0] != 0 or data[1] != 0)
+    {
+        throw logic_error("Invalid magic number in "+filename);
+    }
+    if(data[2] != 0x08)
+    {
+        throw logic_error("Only unsigned byte IDX files are supported : "+filename);
+    }
+    
+    const size_t nDimensions(static_cast<uint8_t>(data[3]));
+    const size_t headerSize(4 + 4 * nDimensions);
+    if(!nDimensions or this->m_mapping.size() < headerSize)
+    {
+        throw logic_error("Truncated IDX header in "+filename);
+    }
+    for(size_t i(0); i<nDimensions; i++)
+    {
+        this->m_dimensions.push_back(readInt(data + 4 + 4 * i));
+    }
+    
+    if(this->m_mapping.size() < headerSize + this->count() * this->itemSize())
+    {
+        throw logic_error("Truncated IDX data in "+filename);
+    }
+    this->m_data = reinterpret_cast<const uint8_t*>(data + headerSize);
+}
+
+size_t IDXFile::itemSize() const
+{
+    size_t size(1);
+    for(size_t i(1); i<this->m_dimensions.size(); i++)
+    {
+        size *= this->m_dimensions[i];
+    }
+    return size;
 }
 
-void loadBinary(const string &key, Dataset& dataset)
+void IDX::load(const string& images, const string& labels, Dataset& dataset, const bool& validation, const size_t& classes, const size_t& threads)
 {
-    int N = key == "train" ? 60000 : 10000;
+    IDXFile imageFile(images), labelFile(labels);
     
-    // Create output
-    DataPair** data = new DataPair*[N];
+    const size_t N(imageFile.count()), size(imageFile.itemSize());
+    if(N != labelFile.count() or labelFile.itemSize() != 1)
+    {
+        throw logic_error("Inconsistent count of imageFile and labelFile");
+    }
+    if(validation and size != dataset.inputSize())
+    {
+        throw logic_error("Validation images do not match training images size");
+    }
     
-    // Read images
-    string ROOT("./data/");
-    string imageFileName(ROOT + key + "-images-idx3-ubyte");
-    string labelFileName(ROOT + key + "-labels-idx1-ubyte");
-    ifstream imageFile(imageFileName, ios::binary);
-    ifstream labelFile(labelFileName, ios::binary);
+    auto storage(validation ? dataset.reserveValidationData(N) : dataset.reserveTrainingData(N, size, classes, 1.f/255));
     
-    if(imageFile.is_open() and labelFile.is_open())
+    // Pixels are already in their final format, labels are widened to class indices
+    ThreadPool pool(max<size_t>(1, threads));
+    const size_t nChunks(pool.size());
+    vector<char> invalid(nChunks, 0);
+    pool.run(nChunks, [&](size_t c)
     {
-        // Read magic number : test 1
-        int magicNumberImage(readInt<int>(imageFile)), magicNumberLabel(readInt<int>(labelFile));
-        if(magicNumberImage!=2051 or magicNumberLabel!=2049)
-        {
-            throw logic_error("Invalid in magic numbers.\n");
-        }
-        
-        // Read data size : test 2
-        int numItems(readInt<int>(imageFile)), numItemsb(readInt<int>(labelFile));
-        if(numItems!=numItemsb)
+        size_t begin(c * N / nChunks), end((c+1) * N / nChunks);
+        memcpy(storage.first + begin * size, imageFile.data() + begin * size, (end - begin) * size);
+        for(size_t i(begin); i<end; i++)
         {
-            throw logic_error("Inconsistent count of imageFile and labelFile");
+            storage.second[i] = labelFile.data()[i];
+            invalid[c] |= storage.second[i] >= classes;
         }
-        
-        int numRows(readInt<int>(imageFile)), numCols(readInt<int>(imageFile));
-        int size(numRows*numCols);
-        
-        unsigned char label;
-        unsigned char image_char[size];
-        
-        for(int i(0); i<numItems; i++)
-        {
-            imageFile.read(reinterpret_cast<char*>(image_char), size);
-            labelFile.read(reinterpret_cast<char*>(&label), sizeof(label));
-            
-            Eigen::VectorXf image(size);
-            for(int j(0); j<size; j++)
-            {
-                image(j) = static_cast<float>(image_char[j])/255;
-            }
-            VectorXf output(10);
-            output.setZero();
-            output[label] = 1;
-
-            data[i] = new DataPair(image, output);
-        }
-        
-        imageFile.close();
-        labelFile.close();
+    });
+    if(any_of(invalid.begin(), invalid.end(), [](char c){return c;}))
+    {
+        throw logic_error("Label out of range in "+labels);
     }
-    else
+}
+
+void MNIST::load(Dataset& dataset, const string& root, const string& cache)
+{
+    const string files[4] = {
+        root + "train-images-idx3-ubyte",
+        root + "train-labels-idx1-ubyte",
+        root + "t10k-images-idx3-ubyte",
+        root + "t10k-labels-idx1-ubyte"
+    };
+    
+    // Reuse the decoded cache while it is newer than every source file
+    if(!cache.empty() and filesystem::exists(cache))
     {
-        if(!imageFile.is_open() and !labelFile.is_open())
+        bool upToDate(true);
+        for(const string& file:files)
         {
-            throw logic_error("Could not open files.");
+            upToDate &= !filesystem::exists(file) or filesystem::last_write_time(file) <= filesystem::last_write_time(cache);
         }
-        else
+        if(upToDate)
         {
-            throw;
+            dataset.loadFile(cache);
+            return;
         }
     }
     
-    (key == "train") ? dataset.addTrainingData(data, N) : dataset.addValidationData(data, N);
+    IDX::load(files[0], files[1], dataset, false, 10);
+    IDX::load(files[2], files[3], dataset, true, 10);
     
-    for(int i(0); i<N; i++)
+    if(!cache.empty())
     {
-        delete data[i];
+        dataset.toMapped(cache);
     }
-    delete[] data;
-}
-
-void MNIST::load(Dataset& dataset)
-{
-    // Load training
-    loadBinary("train", dataset);
-    loadBinary("t10k", dataset);
 }
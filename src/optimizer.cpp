@@ -0,0 +1,114 @@
+#include "optimizer.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+Optimizer::Optimizer(const UpdateRule& rule, const size_t& stateCount):
+m_rule(rule),
+m_stateCount(stateCount)
+{
+}
+
+void Optimizer::initialize(const vector<size_t>& tensorSizes)
+{
+    if(tensorSizes == this->m_sizes)
+    {
+        return;
+    }
+    this->m_sizes = tensorSizes;
+    this->m_state.clear();
+    for(const size_t& n:tensorSizes)
+    {
+        for(size_t i(0); i<this->m_stateCount; i++)
+        {
+            this->m_state.push_back(VectorXf::Zero(n));
+        }
+    }
+    this->m_stepCount = 0;
+}
+
+void Optimizer::restoreState(const vector<VectorXf>& state, const size_t& stepCount)
+{
+    if(state.size() != this->m_state.size())
+    {
+        throw logic_error("Optimizer state does not match the checkpoint");
+    }
+    for(size_t i(0); i<state.size(); i++)
+    {
+        if(state[i].size() != this->m_state[i].size())
+        {
+            throw logic_error("Optimizer state does not match the checkpoint");
+        }
+        this->m_state[i] = state[i];
+    }
+    this->m_stepCount = stepCount;
+}
+
+void Optimizer::beginStep(const float& eta, const float& gradientScale)
+{
+    this->m_step.eta = eta;
+    this->m_step.gradientScale = gradientScale;
+    this->m_stepCount++;
+}
+
+void Optimizer::update(const size_t& tensor, float* parameters, float* gradient, const bool& bias)
+{
+    if(tensor >= this->m_sizes.size())
+    {
+        throw logic_error("Optimizer is not initialized for tensor "+to_string(tensor));
+    }
+    float* first(this->m_stateCount > 0 ? this->m_state[tensor * this->m_stateCount].data() : nullptr);
+    float* second(this->m_stateCount > 1 ? this->m_state[tensor * this->m_stateCount + 1].data() : nullptr);
+    // Local copy, Hogwild! threads update tensors concurrently
+    UpdateStep step(this->m_step);
+    step.decay = bias ? 0 : this->m_weightDecay;
+    applyUpdate(this->m_rule, step, parameters, gradient, first, second, this->m_sizes[tensor]);
+}
+
+SGDOptimizer::SGDOptimizer():
+Optimizer(UpdateRule::SGD, 0)
+{
+}
+
+MomentumOptimizer::MomentumOptimizer(const float& momentum, const bool& nesterov):
+Optimizer(nesterov ? UpdateRule::Nesterov : UpdateRule::Momentum, 1)
+{
+    this->m_step.momentum = momentum;
+}
+
+AdamOptimizer::AdamOptimizer(const float& beta1, const float& beta2, const float& epsilon, const float& weightDecay):
+Optimizer(UpdateRule::Adam, 2)
+{
+    this->m_step.beta1 = beta1;
+    this->m_step.beta2 = beta2;
+    this->m_step.epsilon = epsilon;
+    this->m_weightDecay = weightDecay;
+}
+
+void AdamOptimizer::beginStep(const float& eta, const float& gradientScale)
+{
+    Optimizer::beginStep(eta, gradientScale);
+    this->m_step.firstCorrection = 1 / (1 - pow((double)this->m_step.beta1, (double)this->m_stepCount));
+    this->m_step.secondCorrection = 1 / (1 - pow((double)this->m_step.beta2, (double)this->m_stepCount));
+}
+
+shared_ptr<Optimizer> makeOptimizer(const OptimizerType& type)
+{
+    switch(type)
+    {
+        case OptimizerType::SGD:
+            return make_shared<SGDOptimizer>();
+        case OptimizerType::Momentum:
+            return make_shared<MomentumOptimizer>();
+        case OptimizerType::Nesterov:
+            return make_shared<MomentumOptimizer>(0.9f, true);
+        case OptimizerType::Adam:
+            return make_shared<AdamOptimizer>();
+        case OptimizerType::AdamW:
+            return make_shared<AdamOptimizer>(0.9f, 0.999f, 1e-8f, 0.01f);
+        default:
+            throw logic_error("Unknown optimizer type");
+    }
+}
@@ -0,0 +1,183 @@
+#include "prefetch.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+PrefetchSource::PrefetchSource(BatchSource& source, const size_t& batchSize, const size_t& buffers, const Augmentation& augmentation):
+m_source(source),
+m_batchSize(batchSize),
+m_augmentation(augmentation),
+m_consumed(0),
+m_free(max<size_t>(1, buffers)),
+m_stop(false),
+m_finished(true)
+{}
+
+PrefetchSource::~PrefetchSource()
+{
+    this->_stopProducer();
+}
+
+size_t PrefetchSource::size() const
+{
+    return this->m_source.size();
+}
+
+void PrefetchSource::beginEpoch()
+{
+    this->_stopProducer();
+    this->m_source.beginEpoch();
+    this->m_source.saveState(this->m_epochState);
+    this->_start(0);
+}
+
+void PrefetchSource::_start(const size_t& skip)
+{
+    this->m_consumed = skip;
+    this->m_finished = false;
+    this->m_producer = thread(&PrefetchSource::_produce, this, skip);
+}
+
+void PrefetchSource::_stopProducer()
+{
+    if(this->m_producer.joinable())
+    {
+        {
+            lock_guard<mutex> lock(this->m_mutex);
+            this->m_stop = true;
+        }
+        this->m_changed.notify_all();
+        this->m_producer.join();
+    }
+    // Buffers keep their allocation from one epoch to the next
+    while(!this->m_ready.empty())
+    {
+        this->m_free.push_back(std::move(this->m_ready.front()));
+        this->m_ready.pop_front();
+    }
+    this->m_stop = false;
+    this->m_finished = true;
+    this->m_error = nullptr;
+}
+
+void PrefetchSource::_produce(size_t skip)
+{
+    try
+    {
+        Buffer buffer;
+        for(; skip>0; skip--)
+        {
+            if(!this->m_source.nextBatch(this->m_batchSize, buffer.input, buffer.output))
+            {
+                break;
+            }
+        }
+        
+        while(true)
+        {
+            {
+                unique_lock<mutex> lock(this->m_mutex);
+                this->m_changed.wait(lock, [this]{return this->m_stop or !this->m_free.empty();});
+                if(this->m_stop)
+                {
+                    return;
+                }
+                buffer = std::move(this->m_free.front());
+                this->m_free.pop_front();
+            }
+            
+            const bool available(this->m_source.nextBatch(this->m_batchSize, buffer.input, buffer.output));
+            if(available and this->m_augmentation)
+            {
+                this->m_augmentation(buffer.input, buffer.output);
+            }
+            
+            lock_guard<mutex> lock(this->m_mutex);
+            if(!available)
+            {
+                this->m_free.push_back(std::move(buffer));
+                break;
+            }
+            this->m_ready.push_back(std::move(buffer));
+            this->m_changed.notify_all();
+        }
+    }
+    catch(...)
+    {
+        lock_guard<mutex> lock(this->m_mutex);
+        this->m_error = current_exception();
+    }
+    
+    {
+        lock_guard<mutex> lock(this->m_mutex);
+        this->m_finished = true;
+    }
+    this->m_changed.notify_all();
+}
+
+bool PrefetchSource::nextBatch(const size_t& size, MatrixXf& input, MatrixXf& output)
+{
+    if(size != this->m_batchSize)
+    {
+        throw logic_error("Prefetched mini-batches have "+to_string(this->m_batchSize)+" samples");
+    }
+    
+    unique_lock<mutex> lock(this->m_mutex);
+    this->m_changed.wait(lock, [this]{return this->m_finished or !this->m_ready.empty();});
+    if(this->m_ready.empty())
+    {
+        if(this->m_error)
+        {
+            rethrow_exception(this->m_error);
+        }
+        return false;
+    }
+    Buffer buffer(std::move(this->m_ready.front()));
+    this->m_ready.pop_front();
+    input.swap(buffer.input);
+    output.swap(buffer.output);
+    this->m_free.push_back(std::move(buffer));
+    this->m_consumed++;
+    lock.unlock();
+    this->m_changed.notify_all();
+    return true;
+}
+
+void PrefetchSource::saveState(vector<char>& state) const
+{
+    state = this->m_epochState;
+}
+
+bool PrefetchSource::restoreState(const vector<char>& state)
+{
+    this->_stopProducer();
+    if(!this->m_source.restoreState(state))
+    {
+        return false;
+    }
+    this->m_epochState = state;
+    this->_start(0);
+    return true;
+}
+
+void PrefetchSource::skip(const size_t& batches, const size_t& size)
+{
+    if(size != this->m_batchSize)
+    {
+        throw logic_error("Prefetched mini-batches have "+to_string(this->m_batchSize)+" samples");
+    }
+    
+    // Sources without state are read through, the others are replayed from the start of the
+    // epoch by the producer, without augmentation
+    if(this->m_epochState.empty())
+    {
+        BatchSource::skip(batches, size);
+        return;
+    }
+    this->_stopProducer();
+    const size_t consumed(this->m_consumed);
+    this->m_source.restoreState(this->m_epochState);
+    this->_start(consumed + batches);
+}
@@ -0,0 +1,196 @@
+#include "quantization.hpp"
+#include "simd.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+void QuantizationReport::print() const
+{
+    cout << "Accuracy " << this->referenceAccuracy << "% -> " << this->quantizedAccuracy << "% ("
+         << showpos << this->accuracyDelta() << noshowpos << "), same prediction on " << this->agreement
+         << "% of " << this->samples << " samples\n";
+}
+
+static void checkDataset(const vector<int>& sizes, const Dataset& dataset)
+{
+    if(dataset.inputSize() != (size_t)sizes.front() or dataset.outputSize() != (size_t)sizes.back())
+    {
+        throw logic_error("Dataset does not match the model");
+    }
+}
+
+QuantizedModel::QuantizedModel(const Network& network, const Dataset& calibration, const QuantizationScale& scale, const size_t& calibrationSamples):
+activationType(network.activationType),
+costType(network.costType),
+m_sizes(network.sizes())
+{
+    checkDataset(this->m_sizes, calibration);
+    const size_t depth(this->m_sizes.size() - 1);
+    const size_t samples(calibrationSamples ? min(calibrationSamples, calibration.validationSize()) : calibration.validationSize());
+    if(samples == 0)
+    {
+        throw logic_error("Quantization needs validation samples for calibration");
+    }
+    
+    // Range of the inputs of every layer, always including 0 so that it stays exact
+    vector<float> low(depth, 0.f), high(depth, 0.f);
+    const size_t blockSize(256);
+    MatrixXf buffer, current, next;
+    for(size_t offset(0); offset<samples; offset+=blockSize)
+    {
+        const size_t size(min(blockSize, samples - offset));
+        Eigen::Map<const MatrixXf> inputs(calibration.getValidationInputs(offset, size, buffer));
+        low[0] = min(low[0], inputs.minCoeff());
+        high[0] = max(high[0], inputs.maxCoeff());
+        network.layer(0).feedForward(inputs, current);
+        for(size_t l(1); l<depth; l++)
+        {
+            low[l] = min(low[l], current.minCoeff());
+            high[l] = max(high[l], current.maxCoeff());
+            network.layer(l).feedForward(current, next);
+            current.swap(next);
+        }
+    }
+    
+    for(size_t l(0); l<depth; l++)
+    {
+        const BaseLayer& source(network.layer(l));
+        Layer layer;
+        layer.inSize = source.inSize;
+        layer.outSize = source.outSize;
+        layer.stride = (layer.inSize + 63) / 64 * 64;
+        layer.biases = Eigen::Map<const VectorXf>(source.biasData(), layer.outSize);
+        layer.activationEngine = makeActivation(l+1 == depth ? this->activationType : ActivationType::Sigmoid);
+        
+        // Affine uint8 inputs : x = inputScale * (q - zeroPoint)
+        const float inputScale(high[l] > low[l] ? (high[l] - low[l]) / 255 : 1.f);
+        layer.inverseScale = 1 / inputScale;
+        layer.zeroPoint = nearbyint(-low[l] / inputScale);
+        
+        // Symmetric int8 weights : w = weightScale * q
+        Eigen::Map<const MatrixXf> weights(source.weightData(), layer.outSize, layer.inSize);
+        VectorXf weightScales(weights.cwiseAbs().rowwise().maxCoeff() / 127);
+        if(scale == QuantizationScale::PerLayer)
+        {
+            weightScales.setConstant(weightScales.maxCoeff());
+        }
+        weightScales = (weightScales.array() > 0).select(weightScales, 1.f);
+        
+        layer.weights.assign(layer.outSize * layer.stride, 0);
+        layer.offsets.resize(layer.outSize);
+        for(size_t r(0); r<layer.outSize; r++)
+        {
+            int32_t sum(0);
+            for(size_t i(0); i<layer.inSize; i++)
+            {
+                const int8_t q((int8_t)nearbyint(min(max(weights(r, i) / weightScales(r), -127.f), 127.f)));
+                layer.weights[r * layer.stride + i] = q;
+                sum += q;
+            }
+            layer.offsets(r) = (int32_t)layer.zeroPoint * sum;
+        }
+        layer.scales = weightScales * inputScale;
+        
+        this->m_layers.push_back(move(layer));
+    }
+}
+
+void QuantizedModel::feedForward(VectorXf& input) const
+{
+    input = this->_feedForwardBatch(input);
+}
+
+MatrixXf QuantizedModel::feedForwardBatch(const MatrixXf& inputs) const
+{
+    return this->_feedForwardBatch(inputs);
+}
+
+MatrixXf QuantizedModel::feedForwardBatch(const float* inputs, const size_t& N) const
+{
+    Eigen::Map<const MatrixXf> map(inputs, this->m_sizes.front(), N);
+    return this->_feedForwardBatch(map);
+}
+
+MatrixXf QuantizedModel::_feedForwardBatch(const Eigen::Ref<const MatrixXf>& inputs) const
+{
+    const size_t N(inputs.cols());
+    Eigen::Matrix<uint8_t, Eigen::Dynamic, Eigen::Dynamic> quantized;
+    Eigen::MatrixXi accumulators;
+    MatrixXf current(inputs), next;
+    for(const Layer& layer:this->m_layers)
+    {
+        // Padding of every sample stays zero, as the padding of the weights
+        quantized.setZero(layer.stride, N);
+        for(size_t j(0); j<N; j++)
+        {
+            quantizeUInt8(current.col(j).data(), quantized.col(j).data(), layer.inSize, layer.inverseScale, layer.zeroPoint);
+        }
+        
+        accumulators.resize(layer.outSize, N);
+        gemmInt8(layer.weights.data(), quantized.data(), accumulators.data(), layer.outSize, layer.stride, N);
+        next = (accumulators.colwise() - layer.offsets).cast<float>().array().colwise() * layer.scales.array();
+        visit([&](const auto& engine){ engine.main(next, layer.biases.data(), nullptr); }, layer.activationEngine);
+        current.swap(next);
+    }
+    return current;
+}
+
+void QuantizedModel::setExpMode(const ExpMode& mode)
+{
+    for(Layer& layer:this->m_layers)
+    {
+        visit([&](Activation& engine){ engine.setExpMode(mode); }, layer.activationEngine);
+    }
+}
+
+float QuantizedModel::evaluateAccuracy(const Dataset& dataset) const
+{
+    checkDataset(this->m_sizes, dataset);
+    
+    return dataset.validationAccuracy([this](const Eigen::Ref<const MatrixXf>& inputs){return this->_feedForwardBatch(inputs);});
+}
+
+QuantizationReport QuantizedModel::compare(const Network& reference, const Dataset& dataset) const
+{
+    checkDataset(this->m_sizes, dataset);
+    if(reference.sizes() != this->m_sizes)
+    {
+        throw logic_error("Reference network does not match the model");
+    }
+    
+    const size_t blockSize(256);
+    MatrixXf buffer;
+    size_t labels[blockSize];
+    size_t referenceCorrect(0), quantizedCorrect(0), agreement(0);
+    for(size_t offset(0); offset<dataset.validationSize(); offset+=blockSize)
+    {
+        const size_t size(min(blockSize, dataset.validationSize() - offset));
+        Eigen::Map<const MatrixXf> inputs(dataset.getValidationInputs(offset, size, buffer));
+        const MatrixXf expected(reference.feedForwardBatch(inputs.data(), size));
+        const MatrixXf outputs(this->_feedForwardBatch(inputs));
+        dataset.getValidationLabels(offset, size, labels);
+        for(size_t i(0); i<size; i++)
+        {
+            Eigen::Index a, b;
+            expected.col(i).maxCoeff(&a);
+            outputs.col(i).maxCoeff(&b);
+            referenceCorrect += (size_t)a == labels[i];
+            quantizedCorrect += (size_t)b == labels[i];
+            agreement += a == b;
+        }
+    }
+    
+    QuantizationReport report;
+    report.samples = dataset.validationSize();
+    if(report.samples)
+    {
+        report.referenceAccuracy = 100.f * referenceCorrect / report.samples;
+        report.quantizedAccuracy = 100.f * quantizedCorrect / report.samples;
+        report.agreement = 100.f * agreement / report.samples;
+    }
+    return report;
+}
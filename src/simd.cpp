@@ -0,0 +1,1222 @@
+#include "simd.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <immintrin.h>
+
+using namespace std;
+
+float halfToFloat(const uint16_t& h)
+{
+    uint32_t sign((h & 0x8000u) << 16), exponent((h >> 10) & 0x1f), mantissa(h & 0x3ff), x;
+    if(exponent == 0)
+    {
+        if(mantissa == 0)
+        {
+            x = sign;
+        }
+        else
+        {
+            // Subnormal half, normal float
+            exponent = 127 - 15 + 1;
+            while(!(mantissa & 0x400))
+            {
+                mantissa <<= 1;
+                exponent--;
+            }
+            x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    }
+    else if(exponent == 31)
+    {
+        x = sign | 0x7f800000u | (mantissa << 13);
+    }
+    else
+    {
+        x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+uint16_t floatToHalf(const float& f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    
+    uint32_t sign((x >> 16) & 0x8000), mantissa(x & 0x7fffff);
+    int32_t exponent((x >> 23) & 0xff);
+    if(exponent == 255)
+    {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    
+    exponent += 15 - 127;
+    if(exponent >= 31)
+    {
+        return sign | 0x7c00;
+    }
+    
+    uint32_t h, remainder, halfway;
+    if(exponent <= 0)
+    {
+        // Subnormal half
+        if(exponent < -10)
+        {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        uint32_t shift(14 - exponent);
+        h = mantissa >> shift;
+        remainder = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else
+    {
+        h = (exponent << 10) | (mantissa >> 13);
+        remainder = mantissa & 0x1fff;
+        halfway = 0x1000;
+    }
+    
+    // Round to nearest even, a carry into the exponent is still correct
+    if(remainder > halfway or (remainder == halfway and (h & 1)))
+    {
+        h++;
+    }
+    return sign | h;
+}
+
+float bfloat16ToFloat(const uint16_t& b)
+{
+    const uint32_t x(uint32_t(b) << 16);
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+uint16_t floatToBFloat16(const float& f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if((x & 0x7fffffff) > 0x7f800000)
+    {
+        // Keep NaNs quiet, rounding could turn them into infinities
+        return (x >> 16) | 0x40;
+    }
+    if(!(x & 0x7f800000))
+    {
+        // Denormals become signed zeros, as with AVX-512 BF16
+        return (x >> 16) & 0x8000;
+    }
+    // Round to nearest even, overflows correctly become infinities
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static void convertUInt8Scalar(const uint8_t* src, float* dst, const size_t& n, const float& scale)
+{
+    for(size_t i(0); i<n; i++)
+    {
+        dst[i] = src[i] * scale;
+    }
+}
+
+__attribute__((target("avx2")))
+static void convertUInt8AVX2(const uint8_t* src, float* dst, const size_t& n, const float& scale)
+{
+    const __m256 s(_mm256_set1_ps(scale));
+    size_t i(0);
+    for(; i+8<=n; i+=8)
+    {
+        __m256i w(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i))));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(w), s));
+    }
+    convertUInt8Scalar(src + i, dst + i, n - i, scale);
+}
+
+static void convertHalfScalar(const uint16_t* src, float* dst, const size_t& n)
+{
+    for(size_t i(0); i<n; i++)
+    {
+        dst[i] = halfToFloat(src[i]);
+    }
+}
+
+__attribute__((target("avx,f16c")))
+static void convertHalfF16C(const uint16_t* src, float* dst, const size_t& n)
+{
+    size_t i(0);
+    for(; i+8<=n; i+=8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+    }
+    convertHalfScalar(src + i, dst + i, n - i);
+}
+
+static void toHalfScalar(const float* src, uint16_t* dst, const size_t& n)
+{
+    for(size_t i(0); i<n; i++)
+    {
+        dst[i] = floatToHalf(src[i]);
+    }
+}
+
+__attribute__((target("avx,f16c")))
+static void toHalfF16C(const float* src, uint16_t* dst, const size_t& n)
+{
+    size_t i(0);
+    for(; i+8<=n; i+=8)
+    {
+        __m128i h(_mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+    }
+    toHalfScalar(src + i, dst + i, n - i);
+}
+
+static void convertBFloat16Scalar(const uint16_t* src, float* dst, const size_t& n)
+{
+    for(size_t i(0); i<n; i++)
+    {
+        dst[i] = bfloat16ToFloat(src[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void convertBFloat16AVX2(const uint16_t* src, float* dst, const size_t& n)
+{
+    size_t i(0);
+    for(; i+8<=n; i+=8)
+    {
+        __m256i w(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(w, 16)));
+    }
+    convertBFloat16Scalar(src + i, dst + i, n - i);
+}
+
+static void toBFloat16Scalar(const float* src, uint16_t* dst, const size_t& n)
+{
+    for(size_t i(0); i<n; i++)
+    {
+        dst[i] = floatToBFloat16(src[i]);
+    }
+}
+
+__attribute__((target("avx512f,avx512bf16")))
+static void toBFloat16AVX512(const float* src, uint16_t* dst, const size_t& n)
+{
+    size_t i(0);
+    for(; i+16<=n; i+=16)
+    {
+        __m256bh b(_mm512_cvtneps_pbh(_mm512_loadu_ps(src + i)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), reinterpret_cast<__m256i&>(b));
+    }
+    toBFloat16Scalar(src + i, dst + i, n - i);
+}
+
+// exp(x) = 2^n * 2^f with x*log2(e) = n + f. Exact mode takes n to the nearest integer
+// and a Cephes polynomial of x - n*ln(2), fast mode takes n = floor and a cubic fitted
+// on 2^f for f in [0, 1), with a maximum relative error of 9e-5 in float arithmetic.
+static const float ExpLow(-87.f), ExpHigh(88.f), Log2e(1.44269504088896341f);
+static const float Ln2High(0.693359375f), Ln2Low(-2.12194440e-4f);
+static const float ExactP[6] = {1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f, 4.1665795894e-2f, 1.6666665459e-1f, 5.0000001201e-1f};
+static const float FastP[3] = {0.695116689f, 0.227645423f, 0.0770666468f};
+
+static float fastExp(float x)
+{
+    const float t(min(max(x, ExpLow), ExpHigh) * Log2e), n(floor(t)), f(t - n);
+    const float p(1 + f * (FastP[0] + f * (FastP[1] + f * FastP[2])));
+    const uint32_t bits((int32_t(n) + 127) << 23);
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+static float exactExp(float x)
+{
+    return exp(min(max(x, ExpLow), ExpHigh));
+}
+
+template<ExpMode Mode>
+static float scalarExp(const float& x)
+{
+    return Mode == ExpMode::Fast ? fastExp(x) : exactExp(x);
+}
+
+template<ExpMode Mode>
+static void sigmoidScalar(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols)
+{
+    for(size_t c(0); c<cols; c++)
+    {
+        for(size_t i(0); i<rows; i++)
+        {
+            const float a(1 / (1 + scalarExp<Mode>(-(bias ? x[i] + bias[i] : x[i]))));
+            x[i] = a;
+            if(derivative)
+            {
+                derivative[i] = a * (1 - a);
+            }
+        }
+        x += rows;
+        derivative = derivative ? derivative + rows : nullptr;
+    }
+}
+
+template<ExpMode Mode>
+static void softmaxScalar(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols)
+{
+    for(size_t c(0); c<cols; c++)
+    {
+        float m(-INFINITY);
+        for(size_t i(0); i<rows; i++)
+        {
+            x[i] = bias ? x[i] + bias[i] : x[i];
+            m = max(m, x[i]);
+        }
+        float sum(0);
+        for(size_t i(0); i<rows; i++)
+        {
+            x[i] = scalarExp<Mode>(x[i] - m);
+            sum += x[i];
+        }
+        const float inverse(1 / sum);
+        for(size_t i(0); i<rows; i++)
+        {
+            x[i] *= inverse;
+            if(derivative)
+            {
+                derivative[i] = x[i] * (1 - x[i]);
+            }
+        }
+        x += rows;
+        derivative = derivative ? derivative + rows : nullptr;
+    }
+}
+
+// Columns shorter than half a vector : per-column vector code would stall on store forwarding,
+// since masked loads and stores overlap the neighbouring columns. The reductions stay scalar
+// around one exponential pass over the whole block.
+static void softmaxNarrow(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols, void (* const exp)(float*, const size_t&))
+{
+    for(size_t c(0); c<cols; c++)
+    {
+        float* v(x + c * rows);
+        float m(-INFINITY);
+        for(size_t i(0); i<rows; i++)
+        {
+            v[i] = bias ? v[i] + bias[i] : v[i];
+            m = max(m, v[i]);
+        }
+        for(size_t i(0); i<rows; i++)
+        {
+            v[i] -= m;
+        }
+    }
+    
+    exp(x, rows * cols);
+    
+    for(size_t c(0); c<cols; c++)
+    {
+        float* v(x + c * rows);
+        float sum(0);
+        for(size_t i(0); i<rows; i++)
+        {
+            sum += v[i];
+        }
+        const float inverse(1 / sum);
+        for(size_t i(0); i<rows; i++)
+        {
+            v[i] *= inverse;
+            if(derivative)
+            {
+                derivative[c * rows + i] = v[i] * (1 - v[i]);
+            }
+        }
+    }
+}
+
+template<ExpMode Mode>
+__attribute__((target("avx2,fma")))
+static inline __m256 expAVX2(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(ExpLow)), _mm256_set1_ps(ExpHigh));
+    __m256 n, p;
+    if(Mode == ExpMode::Fast)
+    {
+        const __m256 t(_mm256_mul_ps(x, _mm256_set1_ps(Log2e)));
+        n = _mm256_floor_ps(t);
+        const __m256 f(_mm256_sub_ps(t, n));
+        p = _mm256_fmadd_ps(_mm256_set1_ps(FastP[2]), f, _mm256_set1_ps(FastP[1]));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(FastP[0]));
+        p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1));
+    }
+    else
+    {
+        n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(Log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m256 r(_mm256_fnmadd_ps(n, _mm256_set1_ps(Ln2High), x));
+        r = _mm256_fnmadd_ps(n, _mm256_set1_ps(Ln2Low), r);
+        p = _mm256_set1_ps(ExactP[0]);
+        for(int i(1); i<6; i++)
+        {
+            p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(ExactP[i]));
+        }
+        p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1)));
+    }
+    const __m256i e(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23));
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+// Tails use masked loads and stores, so every value goes through the vector code
+__attribute__((target("avx2,fma")))
+static inline __m256i tailMaskAVX2(const size_t& remaining)
+{
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32(min<size_t>(remaining, 8)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+__attribute__((target("avx2,fma")))
+static inline float sumAVX2(const __m256& v)
+{
+    __m128 s(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma")))
+static inline float maxAVX2(const __m256& v)
+{
+    __m128 s(_mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+    s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_max_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+template<ExpMode Mode>
+__attribute__((target("avx2,fma")))
+static void sigmoidAVX2(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols)
+{
+    const __m256 one(_mm256_set1_ps(1));
+    for(size_t c(0); c<cols; c++)
+    {
+        for(size_t i(0); i<rows; i+=8)
+        {
+            const __m256i k(tailMaskAVX2(rows - i));
+            __m256 z(_mm256_maskload_ps(x + i, k));
+            if(bias)
+            {
+                z = _mm256_add_ps(z, _mm256_maskload_ps(bias + i, k));
+            }
+            const __m256 a(_mm256_div_ps(one, _mm256_add_ps(one, expAVX2<Mode>(_mm256_sub_ps(_mm256_setzero_ps(), z)))));
+            _mm256_maskstore_ps(x + i, k, a);
+            if(derivative)
+            {
+                _mm256_maskstore_ps(derivative + i, k, _mm256_mul_ps(a, _mm256_sub_ps(one, a)));
+            }
+        }
+        x += rows;
+        derivative = derivative ? derivative + rows : nullptr;
+    }
+}
+
+template<ExpMode Mode>
+__attribute__((target("avx2,fma")))
+static void expArrayAVX2(float* x, const size_t& n)
+{
+    for(size_t i(0); i<n; i+=8)
+    {
+        const __m256i k(tailMaskAVX2(n - i));
+        _mm256_maskstore_ps(x + i, k, expAVX2<Mode>(_mm256_maskload_ps(x + i, k)));
+    }
+}
+
+// Columns of one or two vectors stay in registers. The next column is loaded before the
+// current one is stored, so that loads never wait on the masked store of the previous column.
+template<ExpMode Mode, bool Two>
+__attribute__((target("avx2,fma")))
+static void softmaxColumnsAVX2(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols)
+{
+    const __m256 one(_mm256_set1_ps(1)), lowest(_mm256_set1_ps(-INFINITY)), zero(_mm256_setzero_ps());
+    const __m256i k0(tailMaskAVX2(rows)), k1(tailMaskAVX2(Two ? rows - 8 : 0));
+    const __m256 b0(bias ? _mm256_maskload_ps(bias, k0) : zero), b1(bias and Two ? _mm256_maskload_ps(bias + 8, k1) : zero);
+    __m256 next0(_mm256_maskload_ps(x, k0)), next1(Two ? _mm256_maskload_ps(x + 8, k1) : zero);
+    for(size_t c(0); c<cols; c++)
+    {
+        const __m256 z0(_mm256_add_ps(next0, b0)), z1(_mm256_add_ps(next1, b1));
+        if(c+1 < cols)
+        {
+            next0 = _mm256_maskload_ps(x + rows, k0);
+            next1 = Two ? _mm256_maskload_ps(x + rows + 8, k1) : zero;
+        }
+        
+        __m256 m(_mm256_blendv_ps(lowest, z0, _mm256_castsi256_ps(k0)));
+        m = Two ? _mm256_max_ps(m, _mm256_blendv_ps(lowest, z1, _mm256_castsi256_ps(k1))) : m;
+        const __m256 shift(_mm256_set1_ps(maxAVX2(m)));
+        const __m256 e0(_mm256_and_ps(expAVX2<Mode>(_mm256_sub_ps(z0, shift)), _mm256_castsi256_ps(k0)));
+        const __m256 e1(Two ? _mm256_and_ps(expAVX2<Mode>(_mm256_sub_ps(z1, shift)), _mm256_castsi256_ps(k1)) : zero);
+        const __m256 inverse(_mm256_set1_ps(1 / sumAVX2(_mm256_add_ps(e0, e1))));
+        
+        const __m256 a0(_mm256_mul_ps(e0, inverse)), a1(_mm256_mul_ps(e1, inverse));
+        _mm256_maskstore_ps(x, k0, a0);
+        if(Two)
+        {
+            _mm256_maskstore_ps(x + 8, k1, a1);
+        }
+        if(derivative)
+        {
+            _mm256_maskstore_ps(derivative, k0, _mm256_mul_ps(a0, _mm256_sub_ps(one, a0)));
+            if(Two)
+            {
+                _mm256_maskstore_ps(derivative + 8, k1, _mm256_mul_ps(a1, _mm256_sub_ps(one, a1)));
+            }
+        }
+        x += rows;
+        derivative = derivative ? derivative + rows : nullptr;
+    }
+}
+
+// Longer columns : bias and maximum, then the shift, per column. The exponentials are taken
+// in one pass over the whole block, then the sum, normalization and derivative per column.
+// Lanes past the tail of a column are left out of the reductions.
+template<ExpMode Mode>
+__attribute__((target("avx2,fma")))
+static void softmaxBlockAVX2(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols)
+{
+    const __m256 one(_mm256_set1_ps(1)), lowest(_mm256_set1_ps(-INFINITY));
+    for(size_t c(0); c<cols; c++)
+    {
+        float* v(x + c * rows);
+        __m256 m(lowest);
+        for(size_t i(0); i<rows; i+=8)
+        {
+            const __m256i k(tailMaskAVX2(rows - i));
+            __m256 z(_mm256_maskload_ps(v + i, k));
+            if(bias)
+            {
+                z = _mm256_add_ps(z, _mm256_maskload_ps(bias + i, k));
+            }
+            m = _mm256_max_ps(m, _mm256_blendv_ps(lowest, z, _mm256_castsi256_ps(k)));
+        }
+        const __m256 shift(_mm256_set1_ps(maxAVX2(m)));
+        for(size_t i(0); i<rows; i+=8)
+        {
+            const __m256i k(tailMaskAVX2(rows - i));
+            __m256 z(_mm256_maskload_ps(v + i, k));
+            if(bias)
+            {
+                z = _mm256_add_ps(z, _mm256_maskload_ps(bias + i, k));
+            }
+            _mm256_maskstore_ps(v + i, k, _mm256_sub_ps(z, shift));
+        }
+    }
+    
+    expArrayAVX2<Mode>(x, rows * cols);
+    
+    // Normalization and derivative in the same pass
+    for(size_t c(0); c<cols; c++)
+    {
+        float* v(x + c * rows);
+        __m256 sum(_mm256_setzero_ps());
+        for(size_t i(0); i<rows; i+=8)
+        {
+            sum = _mm256_add_ps(sum, _mm256_maskload_ps(v + i, tailMaskAVX2(rows - i)));
+        }
+        const __m256 inverse(_mm256_set1_ps(1 / sumAVX2(sum)));
+        for(size_t i(0); i<rows; i+=8)
+        {
+            const __m256i k(tailMaskAVX2(rows - i));
+            const __m256 a(_mm256_mul_ps(_mm256_maskload_ps(v + i, k), inverse));
+            _mm256_maskstore_ps(v + i, k, a);
+            if(derivative)
+            {
+                _mm256_maskstore_ps(derivative + c * rows + i, k, _mm256_mul_ps(a, _mm256_sub_ps(one, a)));
+            }
+        }
+    }
+}
+
+template<ExpMode Mode>
+__attribute__((target("avx2,fma")))
+static void softmaxAVX2(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols)
+{
+    if(rows < 4)
+    {
+        softmaxNarrow(x, bias, derivative, rows, cols, expArrayAVX2<Mode>);
+    }
+    else if(rows <= 8)
+    {
+        softmaxColumnsAVX2<Mode, false>(x, bias, derivative, rows, cols);
+    }
+    else if(rows <= 16)
+    {
+        softmaxColumnsAVX2<Mode, true>(x, bias, derivative, rows, cols);
+    }
+    else
+    {
+        softmaxBlockAVX2<Mode>(x, bias, derivative, rows, cols);
+    }
+}
+
+template<UpdateRule Rule>
+static void updateScalar(const UpdateStep& step, float* p, float* gradient, float* m, float* v, const size_t& n)
+{
+    for(size_t i(0); i<n; i++)
+    {
+        const float g(gradient[i] * step.gradientScale);
+        gradient[i] = 0;
+        if(Rule == UpdateRule::SGD)
+        {
+            p[i] -= step.eta * g;
+        }
+        else if(Rule == UpdateRule::Momentum)
+        {
+            m[i] = step.momentum * m[i] + g;
+            p[i] -= step.eta * m[i];
+        }
+        else if(Rule == UpdateRule::Nesterov)
+        {
+            m[i] = step.momentum * m[i] + g;
+            p[i] -= step.eta * (g + step.momentum * m[i]);
+        }
+        else
+        {
+            m[i] = step.beta1 * m[i] + (1 - step.beta1) * g;
+            v[i] = step.beta2 * v[i] + (1 - step.beta2) * g * g;
+            p[i] -= step.eta * (step.firstCorrection * m[i] / (sqrt(step.secondCorrection * v[i]) + step.epsilon) + step.decay * p[i]);
+        }
+    }
+}
+
+template<UpdateRule Rule>
+__attribute__((target("avx2,fma")))
+static void updateAVX2(const UpdateStep& step, float* p, float* gradient, float* m, float* v, const size_t& n)
+{
+    const __m256 eta(_mm256_set1_ps(step.eta)), scale(_mm256_set1_ps(step.gradientScale)), mu(_mm256_set1_ps(step.momentum));
+    const __m256 b1(_mm256_set1_ps(step.beta1)), b2(_mm256_set1_ps(step.beta2)), c1(_mm256_set1_ps(step.firstCorrection)), c2(_mm256_set1_ps(step.secondCorrection));
+    const __m256 oneMinusB1(_mm256_set1_ps(1 - step.beta1)), oneMinusB2(_mm256_set1_ps(1 - step.beta2));
+    const __m256 epsilon(_mm256_set1_ps(step.epsilon)), decay(_mm256_set1_ps(step.decay));
+    for(size_t i(0); i<n; i+=8)
+    {
+        const __m256i k(tailMaskAVX2(n - i));
+        const __m256 g(_mm256_mul_ps(_mm256_maskload_ps(gradient + i, k), scale));
+        _mm256_maskstore_ps(gradient + i, k, _mm256_setzero_ps());
+        __m256 x(_mm256_maskload_ps(p + i, k)), u;
+        if(Rule == UpdateRule::SGD)
+        {
+            u = g;
+        }
+        else if(Rule == UpdateRule::Momentum or Rule == UpdateRule::Nesterov)
+        {
+            const __m256 a(_mm256_fmadd_ps(mu, _mm256_maskload_ps(m + i, k), g));
+            _mm256_maskstore_ps(m + i, k, a);
+            u = Rule == UpdateRule::Momentum ? a : _mm256_fmadd_ps(mu, a, g);
+        }
+        else
+        {
+            const __m256 a(_mm256_fmadd_ps(b1, _mm256_maskload_ps(m + i, k), _mm256_mul_ps(oneMinusB1, g)));
+            const __m256 b(_mm256_fmadd_ps(b2, _mm256_maskload_ps(v + i, k), _mm256_mul_ps(oneMinusB2, _mm256_mul_ps(g, g))));
+            _mm256_maskstore_ps(m + i, k, a);
+            _mm256_maskstore_ps(v + i, k, b);
+            u = _mm256_div_ps(_mm256_mul_ps(c1, a), _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(c2, b)), epsilon));
+            u = _mm256_fmadd_ps(decay, x, u);
+        }
+        _mm256_maskstore_ps(p + i, k, _mm256_fnmadd_ps(eta, u, x));
+    }
+}
+
+// GCC 12 reports the self-initialized _mm512_undefined_ps of its own headers
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+template<ExpMode Mode>
+__attribute__((target("avx512f")))
+static inline __m512 expAVX512(__m512 x)
+{
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(ExpLow)), _mm512_set1_ps(ExpHigh));
+    __m512 n, p;
+    if(Mode == ExpMode::Fast)
+    {
+        const __m512 t(_mm512_mul_ps(x, _mm512_set1_ps(Log2e)));
+        n = _mm512_roundscale_ps(t, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        const __m512 f(_mm512_sub_ps(t, n));
+        p = _mm512_fmadd_ps(_mm512_set1_ps(FastP[2]), f, _mm512_set1_ps(FastP[1]));
+        p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(FastP[0]));
+        p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(1));
+    }
+    else
+    {
+        n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(Log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m512 r(_mm512_fnmadd_ps(n, _mm512_set1_ps(Ln2High), x));
+        r = _mm512_fnmadd_ps(n, _mm512_set1_ps(Ln2Low), r);
+        p = _mm512_set1_ps(ExactP[0]);
+        for(int i(1); i<6; i++)
+        {
+            p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(ExactP[i]));
+        }
+        p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1)));
+    }
+    return _mm512_scalef_ps(p, n);
+}
+
+// Tails use masked loads and stores, so every value goes through the vector code
+__attribute__((target("avx512f")))
+static inline __mmask16 tailMask(const size_t& remaining)
+{
+    return remaining >= 16 ? 0xffff : (__mmask16)((1u << remaining) - 1);
+}
+
+template<ExpMode Mode>
+__attribute__((target("avx512f")))
+static void sigmoidAVX512(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols)
+{
+    const __m512 one(_mm512_set1_ps(1));
+    for(size_t c(0); c<cols; c++)
+    {
+        for(size_t i(0); i<rows; i+=16)
+        {
+            const __mmask16 k(tailMask(rows - i));
+            __m512 z(_mm512_maskz_loadu_ps(k, x + i));
+            if(bias)
+            {
+                z = _mm512_add_ps(z, _mm512_maskz_loadu_ps(k, bias + i));
+            }
+            const __m512 a(_mm512_div_ps(one, _mm512_add_ps(one, expAVX512<Mode>(_mm512_sub_ps(_mm512_setzero_ps(), z)))));
+            _mm512_mask_storeu_ps(x + i, k, a);
+            if(derivative)
+            {
+                _mm512_mask_storeu_ps(derivative + i, k, _mm512_mul_ps(a, _mm512_sub_ps(one, a)));
+            }
+        }
+        x += rows;
+        derivative = derivative ? derivative + rows : nullptr;
+    }
+}
+
+template<ExpMode Mode>
+__attribute__((target("avx512f")))
+static void expArrayAVX512(float* x, const size_t& n)
+{
+    for(size_t i(0); i<n; i+=16)
+    {
+        const __mmask16 k(tailMask(n - i));
+        _mm512_mask_storeu_ps(x + i, k, expAVX512<Mode>(_mm512_maskz_loadu_ps(k, x + i)));
+    }
+}
+
+// Same paths as softmaxAVX2, masked lanes are left out of the reductions
+template<ExpMode Mode, bool Two>
+__attribute__((target("avx512f")))
+static void softmaxColumnsAVX512(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols)
+{
+    const __m512 one(_mm512_set1_ps(1)), zero(_mm512_setzero_ps());
+    const __mmask16 k0(tailMask(rows)), k1(Two ? tailMask(rows - 16) : 0);
+    const __m512 b0(bias ? _mm512_maskz_loadu_ps(k0, bias) : zero), b1(bias and Two ? _mm512_maskz_loadu_ps(k1, bias + 16) : zero);
+    __m512 next0(_mm512_maskz_loadu_ps(k0, x)), next1(Two ? _mm512_maskz_loadu_ps(k1, x + 16) : zero);
+    for(size_t c(0); c<cols; c++)
+    {
+        const __m512 z0(_mm512_add_ps(next0, b0)), z1(_mm512_add_ps(next1, b1));
+        if(c+1 < cols)
+        {
+            next0 = _mm512_maskz_loadu_ps(k0, x + rows);
+            next1 = Two ? _mm512_maskz_loadu_ps(k1, x + rows + 16) : zero;
+        }
+        
+        const __m512 m(Two ? _mm512_mask_max_ps(z0, k1, z0, z1) : z0);
+        const __m512 shift(_mm512_set1_ps(_mm512_mask_reduce_max_ps(k0, m)));
+        const __m512 e0(expAVX512<Mode>(_mm512_sub_ps(z0, shift)));
+        const __m512 e1(Two ? expAVX512<Mode>(_mm512_sub_ps(z1, shift)) : zero);
+        const __m512 sum(Two ? _mm512_mask_add_ps(e0, k1, e0, e1) : e0);
+        const __m512 inverse(_mm512_set1_ps(1 / _mm512_mask_reduce_add_ps(k0, sum)));
+        
+        const __m512 a0(_mm512_mul_ps(e0, inverse)), a1(_mm512_mul_ps(e1, inverse));
+        _mm512_mask_storeu_ps(x, k0, a0);
+        if(Two)
+        {
+            _mm512_mask_storeu_ps(x + 16, k1, a1);
+        }
+        if(derivative)
+        {
+            _mm512_mask_storeu_ps(derivative, k0, _mm512_mul_ps(a0, _mm512_sub_ps(one, a0)));
+            if(Two)
+            {
+                _mm512_mask_storeu_ps(derivative + 16, k1, _mm512_mul_ps(a1, _mm512_sub_ps(one, a1)));
+            }
+        }
+        x += rows;
+        derivative = derivative ? derivative + rows : nullptr;
+    }
+}
+
+template<ExpMode Mode>
+__attribute__((target("avx512f")))
+static void softmaxBlockAVX512(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols)
+{
+    const __m512 one(_mm512_set1_ps(1));
+    for(size_t c(0); c<cols; c++)
+    {
+        float* v(x + c * rows);
+        __m512 m(_mm512_set1_ps(-INFINITY));
+        for(size_t i(0); i<rows; i+=16)
+        {
+            const __mmask16 k(tailMask(rows - i));
+            __m512 z(_mm512_maskz_loadu_ps(k, v + i));
+            if(bias)
+            {
+                z = _mm512_add_ps(z, _mm512_maskz_loadu_ps(k, bias + i));
+            }
+            m = _mm512_mask_max_ps(m, k, m, z);
+        }
+        const __m512 shift(_mm512_set1_ps(_mm512_reduce_max_ps(m)));
+        for(size_t i(0); i<rows; i+=16)
+        {
+            const __mmask16 k(tailMask(rows - i));
+            __m512 z(_mm512_maskz_loadu_ps(k, v + i));
+            if(bias)
+            {
+                z = _mm512_add_ps(z, _mm512_maskz_loadu_ps(k, bias + i));
+            }
+            _mm512_mask_storeu_ps(v + i, k, _mm512_sub_ps(z, shift));
+        }
+    }
+    
+    expArrayAVX512<Mode>(x, rows * cols);
+    
+    for(size_t c(0); c<cols; c++)
+    {
+        float* v(x + c * rows);
+        __m512 sum(_mm512_setzero_ps());
+        for(size_t i(0); i<rows; i+=16)
+        {
+            sum = _mm512_add_ps(sum, _mm512_maskz_loadu_ps(tailMask(rows - i), v + i));
+        }
+        const __m512 inverse(_mm512_set1_ps(1 / _mm512_reduce_add_ps(sum)));
+        for(size_t i(0); i<rows; i+=16)
+        {
+            const __mmask16 k(tailMask(rows - i));
+            const __m512 a(_mm512_mul_ps(_mm512_maskz_loadu_ps(k, v + i), inverse));
+            _mm512_mask_storeu_ps(v + i, k, a);
+            if(derivative)
+            {
+                _mm512_mask_storeu_ps(derivative + c * rows + i, k, _mm512_mul_ps(a, _mm512_sub_ps(one, a)));
+            }
+        }
+    }
+}
+
+template<ExpMode Mode>
+__attribute__((target("avx512f")))
+static void softmaxAVX512(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols)
+{
+    if(rows < 8)
+    {
+        softmaxNarrow(x, bias, derivative, rows, cols, expArrayAVX512<Mode>);
+    }
+    else if(rows <= 16)
+    {
+        softmaxColumnsAVX512<Mode, false>(x, bias, derivative, rows, cols);
+    }
+    else if(rows <= 32)
+    {
+        softmaxColumnsAVX512<Mode, true>(x, bias, derivative, rows, cols);
+    }
+    else
+    {
+        softmaxBlockAVX512<Mode>(x, bias, derivative, rows, cols);
+    }
+}
+
+template<UpdateRule Rule>
+__attribute__((target("avx512f")))
+static void updateAVX512(const UpdateStep& step, float* p, float* gradient, float* m, float* v, const size_t& n)
+{
+    const __m512 eta(_mm512_set1_ps(step.eta)), scale(_mm512_set1_ps(step.gradientScale)), mu(_mm512_set1_ps(step.momentum));
+    const __m512 b1(_mm512_set1_ps(step.beta1)), b2(_mm512_set1_ps(step.beta2)), c1(_mm512_set1_ps(step.firstCorrection)), c2(_mm512_set1_ps(step.secondCorrection));
+    const __m512 oneMinusB1(_mm512_set1_ps(1 - step.beta1)), oneMinusB2(_mm512_set1_ps(1 - step.beta2));
+    const __m512 epsilon(_mm512_set1_ps(step.epsilon)), decay(_mm512_set1_ps(step.decay));
+    for(size_t i(0); i<n; i+=16)
+    {
+        const __mmask16 k(tailMask(n - i));
+        const __m512 g(_mm512_mul_ps(_mm512_maskz_loadu_ps(k, gradient + i), scale));
+        _mm512_mask_storeu_ps(gradient + i, k, _mm512_setzero_ps());
+        __m512 x(_mm512_maskz_loadu_ps(k, p + i)), u;
+        if(Rule == UpdateRule::SGD)
+        {
+            u = g;
+        }
+        else if(Rule == UpdateRule::Momentum or Rule == UpdateRule::Nesterov)
+        {
+            const __m512 a(_mm512_fmadd_ps(mu, _mm512_maskz_loadu_ps(k, m + i), g));
+            _mm512_mask_storeu_ps(m + i, k, a);
+            u = Rule == UpdateRule::Momentum ? a : _mm512_fmadd_ps(mu, a, g);
+        }
+        else
+        {
+            const __m512 a(_mm512_fmadd_ps(b1, _mm512_maskz_loadu_ps(k, m + i), _mm512_mul_ps(oneMinusB1, g)));
+            const __m512 b(_mm512_fmadd_ps(b2, _mm512_maskz_loadu_ps(k, v + i), _mm512_mul_ps(oneMinusB2, _mm512_mul_ps(g, g))));
+            _mm512_mask_storeu_ps(m + i, k, a);
+            _mm512_mask_storeu_ps(v + i, k, b);
+            u = _mm512_div_ps(_mm512_mul_ps(c1, a), _mm512_add_ps(_mm512_sqrt_ps(_mm512_mul_ps(c2, b)), epsilon));
+            u = _mm512_fmadd_ps(decay, x, u);
+        }
+        _mm512_mask_storeu_ps(p + i, k, _mm512_fnmadd_ps(eta, u, x));
+    }
+}
+
+// Reduced precision GEMV, one dot product per row of weights. Both formats widen
+// to float before the FMA, so accumulation stays in single precision.
+template<bool BFloat16>
+static void gemvScalar(const uint16_t* weights, const float* x, float* y, const size_t& rows, const size_t& cols)
+{
+    for(size_t r(0); r<rows; r++)
+    {
+        const uint16_t* w(weights + r * cols);
+        float sum(0);
+        for(size_t i(0); i<cols; i++)
+        {
+            sum += (BFloat16 ? bfloat16ToFloat(w[i]) : halfToFloat(w[i])) * x[i];
+        }
+        y[r] = sum;
+    }
+}
+
+template<bool BFloat16>
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 loadAVX2(const uint16_t* w)
+{
+    const __m128i h(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w)));
+    if(BFloat16)
+    {
+        return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+    }
+    return _mm256_cvtph_ps(h);
+}
+
+template<bool BFloat16>
+__attribute__((target("avx2,fma,f16c")))
+static void gemvAVX2(const uint16_t* weights, const float* x, float* y, const size_t& rows, const size_t& cols)
+{
+    for(size_t r(0); r<rows; r++)
+    {
+        const uint16_t* w(weights + r * cols);
+        __m256 a(_mm256_setzero_ps()), b(_mm256_setzero_ps());
+        size_t i(0);
+        for(; i+16<=cols; i+=16)
+        {
+            a = _mm256_fmadd_ps(loadAVX2<BFloat16>(w + i), _mm256_loadu_ps(x + i), a);
+            b = _mm256_fmadd_ps(loadAVX2<BFloat16>(w + i + 8), _mm256_loadu_ps(x + i + 8), b);
+        }
+        for(; i+8<=cols; i+=8)
+        {
+            a = _mm256_fmadd_ps(loadAVX2<BFloat16>(w + i), _mm256_loadu_ps(x + i), a);
+        }
+        if(i < cols)
+        {
+            // Zero-padded copy of the tail, scalar conversion of halves is much slower
+            uint16_t wTail[8] = {};
+            float xTail[8] = {};
+            copy(w + i, w + cols, wTail);
+            copy(x + i, x + cols, xTail);
+            b = _mm256_fmadd_ps(loadAVX2<BFloat16>(wTail), _mm256_loadu_ps(xTail), b);
+        }
+        y[r] = sumAVX2(_mm256_add_ps(a, b));
+    }
+}
+
+template<bool BFloat16>
+__attribute__((target("avx512f")))
+static inline __m512 loadAVX512(const uint16_t* w)
+{
+    const __m256i h(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(w)));
+    if(BFloat16)
+    {
+        return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16));
+    }
+    return _mm512_cvtph_ps(h);
+}
+
+template<bool BFloat16>
+__attribute__((target("avx512f")))
+static void gemvAVX512(const uint16_t* weights, const float* x, float* y, const size_t& rows, const size_t& cols)
+{
+    for(size_t r(0); r<rows; r++)
+    {
+        const uint16_t* w(weights + r * cols);
+        __m512 a(_mm512_setzero_ps()), b(_mm512_setzero_ps());
+        size_t i(0);
+        for(; i+32<=cols; i+=32)
+        {
+            a = _mm512_fmadd_ps(loadAVX512<BFloat16>(w + i), _mm512_loadu_ps(x + i), a);
+            b = _mm512_fmadd_ps(loadAVX512<BFloat16>(w + i + 16), _mm512_loadu_ps(x + i + 16), b);
+        }
+        for(; i+16<=cols; i+=16)
+        {
+            a = _mm512_fmadd_ps(loadAVX512<BFloat16>(w + i), _mm512_loadu_ps(x + i), a);
+        }
+        if(i < cols)
+        {
+            // Masked 16-bit loads would need AVX-512 BW
+            uint16_t wTail[16] = {};
+            copy(w + i, w + cols, wTail);
+            b = _mm512_fmadd_ps(loadAVX512<BFloat16>(wTail), _mm512_maskz_loadu_ps(tailMask(cols - i), x + i), b);
+        }
+        y[r] = _mm512_reduce_add_ps(_mm512_add_ps(a, b));
+    }
+}
+
+// Integer GEMM with cols a multiple of 64. Each block of 4 weight rows is reused over every
+// sample while it stays in L1, and each load of inputs is shared by the 4 rows.
+static void gemmInt8Scalar(const int8_t* weights, const uint8_t* x, int32_t* y, const size_t& rows, const size_t& cols, const size_t& n)
+{
+    for(size_t j(0); j<n; j++)
+    {
+        for(size_t r(0); r<rows; r++)
+        {
+            int32_t sum(0);
+            for(size_t i(0); i<cols; i++)
+            {
+                sum += int32_t(weights[r * cols + i]) * x[j * cols + i];
+            }
+            y[j * rows + r] = sum;
+        }
+    }
+}
+
+// Products are widened to 16 bits before madd, maddubs could saturate
+__attribute__((target("avx2")))
+static inline __m256i dotInt8AVX2(__m256i sum, const __m256i& x, const int8_t* w)
+{
+    const __m256i w16(_mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w))));
+    return _mm256_add_epi32(sum, _mm256_madd_epi16(x, w16));
+}
+
+__attribute__((target("avx2")))
+static inline int32_t reduceAVX2(const __m256i& v)
+{
+    __m128i s(_mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+static void gemmInt8AVX2(const int8_t* weights, const uint8_t* x, int32_t* y, const size_t& rows, const size_t& cols, const size_t& n)
+{
+    size_t r(0);
+    for(; r+4<=rows; r+=4)
+    {
+        const int8_t* w(weights + r * cols);
+        for(size_t j(0); j<n; j++)
+        {
+            __m256i a(_mm256_setzero_si256()), b(a), c(a), d(a);
+            for(size_t i(0); i<cols; i+=16)
+            {
+                const __m256i v(_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + j * cols + i))));
+                a = dotInt8AVX2(a, v, w + i);
+                b = dotInt8AVX2(b, v, w + cols + i);
+                c = dotInt8AVX2(c, v, w + 2 * cols + i);
+                d = dotInt8AVX2(d, v, w + 3 * cols + i);
+            }
+            int32_t* out(y + j * rows + r);
+            out[0] = reduceAVX2(a);
+            out[1] = reduceAVX2(b);
+            out[2] = reduceAVX2(c);
+            out[3] = reduceAVX2(d);
+        }
+    }
+    for(; r<rows; r++)
+    {
+        for(size_t j(0); j<n; j++)
+        {
+            __m256i a(_mm256_setzero_si256());
+            for(size_t i(0); i<cols; i+=16)
+            {
+                a = dotInt8AVX2(a, _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + j * cols + i))), weights + r * cols + i);
+            }
+            y[j * rows + r] = reduceAVX2(a);
+        }
+    }
+}
+
+// vpdpbusd : 4 adjacent uint8 x int8 products summed into each int32 lane, without saturation
+__attribute__((target("avx512f,avx512vnni")))
+static void gemmInt8VNNI(const int8_t* weights, const uint8_t* x, int32_t* y, const size_t& rows, const size_t& cols, const size_t& n)
+{
+    size_t r(0);
+    for(; r+4<=rows; r+=4)
+    {
+        const int8_t* w(weights + r * cols);
+        for(size_t j(0); j<n; j++)
+        {
+            __m512i a(_mm512_setzero_si512()), b(a), c(a), d(a);
+            for(size_t i(0); i<cols; i+=64)
+            {
+                const __m512i v(_mm512_loadu_si512(x + j * cols + i));
+                a = _mm512_dpbusd_epi32(a, v, _mm512_loadu_si512(w + i));
+                b = _mm512_dpbusd_epi32(b, v, _mm512_loadu_si512(w + cols + i));
+                c = _mm512_dpbusd_epi32(c, v, _mm512_loadu_si512(w + 2 * cols + i));
+                d = _mm512_dpbusd_epi32(d, v, _mm512_loadu_si512(w + 3 * cols + i));
+            }
+            int32_t* out(y + j * rows + r);
+            out[0] = _mm512_reduce_add_epi32(a);
+            out[1] = _mm512_reduce_add_epi32(b);
+            out[2] = _mm512_reduce_add_epi32(c);
+            out[3] = _mm512_reduce_add_epi32(d);
+        }
+    }
+    for(; r<rows; r++)
+    {
+        for(size_t j(0); j<n; j++)
+        {
+            __m512i a(_mm512_setzero_si512());
+            for(size_t i(0); i<cols; i+=64)
+            {
+                a = _mm512_dpbusd_epi32(a, _mm512_loadu_si512(x + j * cols + i), _mm512_loadu_si512(weights + r * cols + i));
+            }
+            y[j * rows + r] = _mm512_reduce_add_epi32(a);
+        }
+    }
+}
+
+static void quantizeUInt8Scalar(const float* src, uint8_t* dst, const size_t& n, const float& inverseScale, const float& zeroPoint)
+{
+    for(size_t i(0); i<n; i++)
+    {
+        dst[i] = (uint8_t)nearbyint(min(max(src[i] * inverseScale + zeroPoint, 0.f), 255.f));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void quantizeUInt8AVX512(const float* src, uint8_t* dst, const size_t& n, const float& inverseScale, const float& zeroPoint)
+{
+    const __m512 s(_mm512_set1_ps(inverseScale)), z(_mm512_set1_ps(zeroPoint));
+    const __m512 low(_mm512_setzero_ps()), high(_mm512_set1_ps(255.f));
+    size_t i(0);
+    for(; i+16<=n; i+=16)
+    {
+        const __m512 v(_mm512_min_ps(_mm512_max_ps(_mm512_fmadd_ps(_mm512_loadu_ps(src + i), s, z), low), high));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm512_cvtepi32_epi8(_mm512_cvtps_epi32(v)));
+    }
+    quantizeUInt8Scalar(src + i, dst + i, n - i, inverseScale, zeroPoint);
+}
+
+#pragma GCC diagnostic pop
+
+// Kernels picked from the CPU features
+struct Kernels
+{
+    void (*convertUInt8)(const uint8_t*, float*, const size_t&, const float&);
+    void (*convertHalf)(const uint16_t*, float*, const size_t&);
+    void (*toHalf)(const float*, uint16_t*, const size_t&);
+    void (*convertBFloat16)(const uint16_t*, float*, const size_t&);
+    void (*toBFloat16)(const float*, uint16_t*, const size_t&);
+    void (*quantizeUInt8)(const float*, uint8_t*, const size_t&, const float&, const float&);
+    void (*gemmInt8)(const int8_t*, const uint8_t*, int32_t*, const size_t&, const size_t&, const size_t&);
+    
+    // Indexed by ExpMode
+    void (*sigmoid[2])(float*, const float*, float*, const size_t&, const size_t&);
+    void (*softmax[2])(float*, const float*, float*, const size_t&, const size_t&);
+    
+    // Indexed by UpdateRule
+    void (*update[4])(const UpdateStep&, float*, float*, float*, float*, const size_t&);
+    
+    // Indexed by BFloat16
+    void (*gemv[2])(const uint16_t*, const float*, float*, const size_t&, const size_t&);
+};
+
+static Kernels resolveKernels()
+{
+    __builtin_cpu_init();
+    const bool hasAVX512(__builtin_cpu_supports("avx512f")), hasAVX2(__builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma"));
+    
+    Kernels k;
+    k.convertUInt8 = __builtin_cpu_supports("avx2") ? convertUInt8AVX2 : convertUInt8Scalar;
+    k.convertHalf = __builtin_cpu_supports("f16c") ? convertHalfF16C : convertHalfScalar;
+    k.toHalf = __builtin_cpu_supports("f16c") ? toHalfF16C : toHalfScalar;
+    k.convertBFloat16 = __builtin_cpu_supports("avx2") ? convertBFloat16AVX2 : convertBFloat16Scalar;
+    k.toBFloat16 = __builtin_cpu_supports("avx512bf16") ? toBFloat16AVX512 : toBFloat16Scalar;
+    k.quantizeUInt8 = hasAVX512 ? quantizeUInt8AVX512 : quantizeUInt8Scalar;
+    k.gemmInt8 = hasAVX512 and __builtin_cpu_supports("avx512vnni") ? gemmInt8VNNI : __builtin_cpu_supports("avx2") ? gemmInt8AVX2 : gemmInt8Scalar;
+    
+    k.sigmoid[0] = hasAVX512 ? sigmoidAVX512<ExpMode::Exact> : hasAVX2 ? sigmoidAVX2<ExpMode::Exact> : sigmoidScalar<ExpMode::Exact>;
+    k.sigmoid[1] = hasAVX512 ? sigmoidAVX512<ExpMode::Fast> : hasAVX2 ? sigmoidAVX2<ExpMode::Fast> : sigmoidScalar<ExpMode::Fast>;
+    k.softmax[0] = hasAVX512 ? softmaxAVX512<ExpMode::Exact> : hasAVX2 ? softmaxAVX2<ExpMode::Exact> : softmaxScalar<ExpMode::Exact>;
+    k.softmax[1] = hasAVX512 ? softmaxAVX512<ExpMode::Fast> : hasAVX2 ? softmaxAVX2<ExpMode::Fast> : softmaxScalar<ExpMode::Fast>;
+    
+    k.update[0] = hasAVX512 ? updateAVX512<UpdateRule::SGD> : hasAVX2 ? updateAVX2<UpdateRule::SGD> : updateScalar<UpdateRule::SGD>;
+    k.update[1] = hasAVX512 ? updateAVX512<UpdateRule::Momentum> : hasAVX2 ? updateAVX2<UpdateRule::Momentum> : updateScalar<UpdateRule::Momentum>;
+    k.update[2] = hasAVX512 ? updateAVX512<UpdateRule::Nesterov> : hasAVX2 ? updateAVX2<UpdateRule::Nesterov> : updateScalar<UpdateRule::Nesterov>;
+    k.update[3] = hasAVX512 ? updateAVX512<UpdateRule::Adam> : hasAVX2 ? updateAVX2<UpdateRule::Adam> : updateScalar<UpdateRule::Adam>;
+    
+    // The half path of AVX2 also needs F16C
+    k.gemv[0] = hasAVX512 ? gemvAVX512<false> : hasAVX2 and __builtin_cpu_supports("f16c") ? gemvAVX2<false> : gemvScalar<false>;
+    k.gemv[1] = hasAVX512 ? gemvAVX512<true> : hasAVX2 ? gemvAVX2<true> : gemvScalar<true>;
+    return k;
+}
+
+// Resolved on first use rather than with the other statics, so that code running from the
+// static initializers of other translation units never sees them unset
+static const Kernels& kernels()
+{
+    static const Kernels k(resolveKernels());
+    return k;
+}
+
+void convertUInt8(const uint8_t* src, float* dst, const size_t& n, const float& scale)
+{
+    kernels().convertUInt8(src, dst, n, scale);
+}
+
+void convertHalf(const uint16_t* src, float* dst, const size_t& n)
+{
+    kernels().convertHalf(src, dst, n);
+}
+
+void toHalf(const float* src, uint16_t* dst, const size_t& n)
+{
+    kernels().toHalf(src, dst, n);
+}
+
+void convertBFloat16(const uint16_t* src, float* dst, const size_t& n)
+{
+    kernels().convertBFloat16(src, dst, n);
+}
+
+void toBFloat16(const float* src, uint16_t* dst, const size_t& n)
+{
+    kernels().toBFloat16(src, dst, n);
+}
+
+void gemvHalf(const uint16_t* weights, const float* x, float* y, const size_t& rows, const size_t& cols)
+{
+    kernels().gemv[0](weights, x, y, rows, cols);
+}
+
+void gemvBFloat16(const uint16_t* weights, const float* x, float* y, const size_t& rows, const size_t& cols)
+{
+    kernels().gemv[1](weights, x, y, rows, cols);
+}
+
+void quantizeUInt8(const float* src, uint8_t* dst, const size_t& n, const float& inverseScale, const float& zeroPoint)
+{
+    kernels().quantizeUInt8(src, dst, n, inverseScale, zeroPoint);
+}
+
+void gemmInt8(const int8_t* weights, const uint8_t* x, int32_t* y, const size_t& rows, const size_t& cols, const size_t& n)
+{
+    kernels().gemmInt8(weights, x, y, rows, cols, n);
+}
+
+void sigmoid(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols, const ExpMode& mode)
+{
+    kernels().sigmoid[(int)mode](x, bias, derivative, rows, cols);
+}
+
+void softmax(float* x, const float* bias, float* derivative, const size_t& rows, const size_t& cols, const ExpMode& mode)
+{
+    kernels().softmax[(int)mode](x, bias, derivative, rows, cols);
+}
+
+void applyUpdate(const UpdateRule& rule, const UpdateStep& step, float* parameters, float* gradient, float* first, float* second, const size_t& n)
+{
+    kernels().update[(int)rule](step, parameters, gradient, first, second, n);
+}
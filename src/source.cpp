@@ -0,0 +1,79 @@
+#include "source.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+void BatchSource::skip(const size_t& batches, const size_t& size)
+{
+    MatrixXf input, output;
+    for(size_t b(0); b<batches; b++)
+    {
+        if(!this->nextBatch(size, input, output))
+        {
+            break;
+        }
+    }
+}
+
+DatasetSource::DatasetSource(const Dataset& dataset, const size_t& shard, const size_t& shards):
+m_dataset(dataset),
+m_first(shard * (dataset.trainingSize() / shards)),
+m_size(dataset.trainingSize() / shards),
+m_offset(0)
+{
+    if(shard >= shards)
+    {
+        throw logic_error("Shard "+to_string(shard)+" out of "+to_string(shards));
+    }
+}
+
+size_t DatasetSource::size() const
+{
+    return this->m_size;
+}
+
+void DatasetSource::beginEpoch()
+{
+    this->m_dataset.shuffle();
+    this->m_offset = 0;
+}
+
+bool DatasetSource::nextBatch(const size_t& size, MatrixXf& input, MatrixXf& output)
+{
+    // Claim a range of the shuffled order, then gather it without holding anything
+    size_t offset(this->m_offset.fetch_add(size));
+    if(offset + size > this->m_size)
+    {
+        return false;
+    }
+    this->m_dataset.getBatch(this->m_first + offset, size, input, output);
+    return true;
+}
+
+void DatasetSource::saveState(vector<char>& state) const
+{
+    // Shuffled order of the epoch
+    const vector<size_t>& order(this->m_dataset.order());
+    state.resize(order.size() * sizeof(size_t));
+    memcpy(state.data(), order.data(), state.size());
+}
+
+bool DatasetSource::restoreState(const vector<char>& state)
+{
+    if(state.size() != this->m_dataset.trainingSize() * sizeof(size_t))
+    {
+        throw logic_error("Checkpoint does not match the training set size");
+    }
+    vector<size_t> order(this->m_dataset.trainingSize());
+    memcpy(order.data(), state.data(), state.size());
+    this->m_dataset.setOrder(order);
+    this->m_offset = 0;
+    return true;
+}
+
+void DatasetSource::skip(const size_t& batches, const size_t& size)
+{
+    this->m_offset += batches * size;
+}
@@ -0,0 +1,285 @@
+#include "streaming.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+StreamingDataset::StreamingDataset(const vector<string>& shards, const size_t& chunkSize, const size_t& prefetch, const unsigned& seed):
+m_size(0),
+m_inputSize(0),
+m_outputSize(0),
+m_prefetch(max<size_t>(1, prefetch)),
+m_generator(seed),
+m_epochSeed(0),
+m_stop(false),
+m_finished(true),
+m_consumed(0)
+{
+    if(shards.empty() or !chunkSize)
+    {
+        throw logic_error("StreamingDataset needs at least one shard and a positive chunk size");
+    }
+    
+    for(const string& filename:shards)
+    {
+        ifstream file(filename, ios::binary);
+        if(!file.is_open())
+        {
+            throw logic_error("Could not open filename : "+filename);
+        }
+        
+        Shard shard;
+        shard.filename = filename;
+        file.read(reinterpret_cast<char*>(&shard.header), sizeof(shard.header));
+        const DatasetFileHeader& header(shard.header);
+        if(!file or header.magic != DatasetFileHeader::Magic or header.version != DatasetFileHeader::Version)
+        {
+            throw logic_error("Not a mapped dataset file : "+filename);
+        }
+        if(header.inputType == SampleType::Label or header.inputType > SampleType::Label or header.outputType > SampleType::Label)
+        {
+            throw logic_error("Unsupported sample type in dataset file : "+filename);
+        }
+        if(this->m_shards.size() and (header.inputSize != this->m_inputSize or header.outputSize != this->m_outputSize))
+        {
+            throw logic_error("Inconsistent sample dimensions in shard : "+filename);
+        }
+        this->m_inputSize = header.inputSize;
+        this->m_outputSize = header.outputSize;
+        
+        for(size_t first(0); first<header.trainingSize; first+=chunkSize)
+        {
+            this->m_chunks.push_back(ChunkLocation{this->m_shards.size(), first, min<size_t>(chunkSize, header.trainingSize - first)});
+        }
+        this->m_size += header.trainingSize;
+        this->m_shards.push_back(shard);
+    }
+}
+
+StreamingDataset::~StreamingDataset()
+{
+    this->_stopProducer();
+}
+
+size_t StreamingDataset::size() const
+{
+    return this->m_size;
+}
+
+void StreamingDataset::beginEpoch()
+{
+    this->_stopProducer();
+    
+    shuffle(this->m_chunks.begin(), this->m_chunks.end(), this->m_generator);
+    this->m_epochSeed = this->m_generator();
+    this->_start(0);
+}
+
+void StreamingDataset::saveState(vector<char>& state) const
+{
+    // Seed of the epoch, chunk order, then the generator in text form
+    ostringstream generator;
+    generator << this->m_generator;
+    const string text(generator.str());
+    const size_t header[2] = {this->m_epochSeed, this->m_chunks.size()};
+    const size_t chunkBytes(this->m_chunks.size() * sizeof(ChunkLocation));
+    state.resize(sizeof(header) + chunkBytes + text.size());
+    memcpy(state.data(), header, sizeof(header));
+    memcpy(state.data() + sizeof(header), this->m_chunks.data(), chunkBytes);
+    memcpy(state.data() + sizeof(header) + chunkBytes, text.data(), text.size());
+}
+
+bool StreamingDataset::restoreState(const vector<char>& state)
+{
+    size_t header[2];
+    if(state.size() < sizeof(header))
+    {
+        throw logic_error("Invalid streaming dataset state");
+    }
+    memcpy(header, state.data(), sizeof(header));
+    const size_t chunkBytes(header[1] * sizeof(ChunkLocation));
+    if(header[1] != this->m_chunks.size() or state.size() < sizeof(header) + chunkBytes)
+    {
+        throw logic_error("Checkpoint does not match the streamed shards");
+    }
+    vector<ChunkLocation> chunks(header[1]);
+    memcpy(chunks.data(), state.data() + sizeof(header), chunkBytes);
+    for(const ChunkLocation& location:chunks)
+    {
+        if(location.shard >= this->m_shards.size() or location.first + location.count > this->m_shards[location.shard].header.trainingSize)
+        {
+            throw logic_error("Checkpoint does not match the streamed shards");
+        }
+    }
+    
+    this->_stopProducer();
+    istringstream(string(state.begin() + sizeof(header) + chunkBytes, state.end())) >> this->m_generator;
+    this->m_chunks = std::move(chunks);
+    this->m_epochSeed = header[0];
+    this->_start(0);
+    return true;
+}
+
+void StreamingDataset::skip(const size_t& batches, const size_t& size)
+{
+    this->_stopProducer();
+    this->_start(this->m_consumed + batches * size);
+}
+
+void StreamingDataset::_start(const size_t& consumed)
+{
+    // Chunks already consumed are not read, the current one resumes at its position
+    size_t skip(0), position(consumed);
+    while(skip < this->m_chunks.size() and position >= this->m_chunks[skip].count)
+    {
+        position -= this->m_chunks[skip++].count;
+    }
+    this->m_current = Chunk();
+    this->m_consumed = consumed;
+    this->m_finished = false;
+    this->m_producer = thread(&StreamingDataset::_produce, this, this->m_chunks, this->m_epochSeed, skip);
+    if(position and this->_pop())
+    {
+        this->m_current.position = position;
+    }
+}
+
+void StreamingDataset::_stopProducer()
+{
+    if(this->m_producer.joinable())
+    {
+        {
+            lock_guard<mutex> lock(this->m_queueMutex);
+            this->m_stop = true;
+        }
+        this->m_queueChanged.notify_all();
+        this->m_producer.join();
+    }
+    this->m_queue.clear();
+    this->m_stop = false;
+    this->m_error = nullptr;
+}
+
+void StreamingDataset::_produce(vector<ChunkLocation> chunks, unsigned seed, size_t skip)
+{
+    mt19937 generator(seed);
+    vector<size_t> order;
+    for(size_t c(0); c<skip; c++)
+    {
+        order.resize(chunks[c].count);
+        shuffle(order.begin(), order.end(), generator);
+    }
+    chunks.erase(chunks.begin(), chunks.begin() + skip);
+    try
+    {
+        vector<ifstream> files;
+        for(const Shard& shard:this->m_shards)
+        {
+            files.emplace_back(shard.filename, ios::binary);
+        }
+        
+        vector<char> rawInput, rawOutput;
+        for(const ChunkLocation& location:chunks)
+        {
+            const Shard& shard(this->m_shards[location.shard]);
+            const DatasetFileHeader& header(shard.header);
+            ifstream& file(files[location.shard]);
+            
+            // Samples are stored one per column, so a chunk is one contiguous range per block
+            const size_t inputBytes(sampleBytes(header.inputType, this->m_inputSize));
+            const size_t outputBytes(sampleBytes(header.outputType, this->m_outputSize));
+            rawInput.resize(location.count * inputBytes);
+            rawOutput.resize(location.count * outputBytes);
+            file.seekg(header.offsets[0] + location.first * inputBytes);
+            file.read(rawInput.data(), rawInput.size());
+            file.seekg(header.offsets[1] + location.first * outputBytes);
+            file.read(rawOutput.data(), rawOutput.size());
+            if(!file)
+            {
+                throw logic_error("Could not read shard : "+shard.filename);
+            }
+            if(header.outputType == SampleType::Label and !labelsInRange(rawOutput.data(), location.count, this->m_outputSize))
+            {
+                throw logic_error("Label out of range in shard : "+shard.filename);
+            }
+            
+            Chunk chunk;
+            chunk.input.resize(this->m_inputSize, location.count);
+            chunk.output.resize(this->m_outputSize, location.count);
+            for(size_t i(0); i<location.count; i++)
+            {
+                decodeSample(header.inputType, rawInput.data(), this->m_inputSize, i, header.inputScale, chunk.input.col(i).data());
+                decodeSample(header.outputType, rawOutput.data(), this->m_outputSize, i, 1, chunk.output.col(i).data());
+            }
+            
+            chunk.order.resize(location.count);
+            iota(chunk.order.begin(), chunk.order.end(), 0);
+            shuffle(chunk.order.begin(), chunk.order.end(), generator);
+            
+            unique_lock<mutex> lock(this->m_queueMutex);
+            this->m_queueChanged.wait(lock, [this]{return this->m_stop or this->m_queue.size() < this->m_prefetch;});
+            if(this->m_stop)
+            {
+                return;
+            }
+            this->m_queue.push_back(std::move(chunk));
+            lock.unlock();
+            this->m_queueChanged.notify_all();
+        }
+    }
+    catch(...)
+    {
+        lock_guard<mutex> lock(this->m_queueMutex);
+        this->m_error = current_exception();
+    }
+    
+    {
+        lock_guard<mutex> lock(this->m_queueMutex);
+        this->m_finished = true;
+    }
+    this->m_queueChanged.notify_all();
+}
+
+bool StreamingDataset::_pop()
+{
+    unique_lock<mutex> lock(this->m_queueMutex);
+    this->m_queueChanged.wait(lock, [this]{return this->m_finished or !this->m_queue.empty();});
+    if(this->m_queue.empty())
+    {
+        if(this->m_error)
+        {
+            rethrow_exception(this->m_error);
+        }
+        return false;
+    }
+    this->m_current = std::move(this->m_queue.front());
+    this->m_queue.pop_front();
+    lock.unlock();
+    this->m_queueChanged.notify_all();
+    return true;
+}
+
+bool StreamingDataset::nextBatch(const size_t& size, MatrixXf& input, MatrixXf& output)
+{
+    lock_guard<mutex> lock(this->m_consumerMutex);
+    
+    input.resize(this->m_inputSize, size);
+    output.resize(this->m_outputSize, size);
+    for(size_t i(0); i<size; i++)
+    {
+        if(this->m_current.position == this->m_current.order.size() and !this->_pop())
+        {
+            return false;
+        }
+        const size_t& idx(this->m_current.order[this->m_current.position++]);
+        input.col(i) = this->m_current.input.col(idx);
+        output.col(i) = this->m_current.output.col(idx);
+    }
+    this->m_consumed += size;
+    return true;
+}
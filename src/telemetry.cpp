@@ -0,0 +1,147 @@
+#include "telemetry.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+const char* phaseName(const Phase& phase)
+{
+    static const char* names[PhaseCount] = {"forward", "delta", "gradient", "update", "batch", "shuffle", "evaluation", "allreduce"};
+    return names[(size_t)phase];
+}
+
+string EpochTelemetry::toJson() const
+{
+    ostringstream json;
+    json << "{\"epoch\": " << this->epoch << ", \"seconds\": " << this->seconds
+         << ", \"samples\": " << this->samples << ", \"batches\": " << this->batches
+         << ", \"samples_per_s\": " << this->samplesPerSecond() << ", \"batches_per_s\": " << this->batchesPerSecond()
+         << ", \"loss\": " << this->loss << ", \"phases\": {";
+    for(size_t p(0); p<PhaseCount; p++)
+    {
+        json << (p ? ", " : "") << "\"" << phaseName((Phase)p) << "\": " << this->phaseSeconds[p];
+    }
+    json << "}, \"layers\": [";
+    for(size_t l(0); l<this->layerSeconds.size(); l++)
+    {
+        json << (l ? ", {" : "{");
+        for(size_t p(0); p<LayerPhaseCount; p++)
+        {
+            json << (p ? ", " : "") << "\"" << phaseName((Phase)p) << "\": " << this->layerSeconds[l][p];
+        }
+        json << "}";
+    }
+    json << "]}";
+    return json.str();
+}
+
+void EpochTelemetry::print() const
+{
+    cout << "Epoch " << this->epoch << " : loss " << this->loss << ", " << this->samplesPerSecond() << " samples/s, "
+         << this->batchesPerSecond() << " batches/s\n";
+    for(size_t p(0); p<PhaseCount; p++)
+    {
+        cout << "  " << phaseName((Phase)p) << " " << this->phaseSeconds[p] << " s";
+        if(p < LayerPhaseCount)
+        {
+            cout << " (layers";
+            for(const auto& layer:this->layerSeconds)
+            {
+                cout << " " << layer[p];
+            }
+            cout << ")";
+        }
+        cout << "\n";
+    }
+}
+
+void Telemetry::setJsonOutput(const string& fileName)
+{
+    this->m_json.open(fileName, ios::app);
+    if(!this->m_json.is_open())
+    {
+        throw logic_error("Could not open filename : "+fileName);
+    }
+}
+
+Telemetry::Scope::Scope(Telemetry* telemetry, const Phase& phase, const size_t& layer):
+m_telemetry(telemetry),
+m_phase(phase),
+m_layer(layer)
+{
+    if(telemetry)
+    {
+        this->m_start = chrono::steady_clock::now();
+    }
+}
+
+Telemetry::Scope::~Scope()
+{
+    if(this->m_telemetry)
+    {
+        const auto elapsed(chrono::steady_clock::now() - this->m_start);
+        this->m_telemetry->add(this->m_phase, this->m_layer, chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+    }
+}
+
+void Telemetry::begin(const size_t& layers)
+{
+    if(layers != this->m_layerCount)
+    {
+        this->m_layers.reset(new atomic<uint64_t>[layers * LayerPhaseCount]);
+        this->m_layerCount = layers;
+    }
+    for(size_t i(0); i<layers * LayerPhaseCount; i++)
+    {
+        this->m_layers[i] = 0;
+    }
+    for(atomic<uint64_t>& p:this->m_phases)
+    {
+        p = 0;
+    }
+    this->m_loss = 0;
+}
+
+void Telemetry::add(const Phase& phase, const size_t& layer, const uint64_t& nanoseconds)
+{
+    this->m_phases[(size_t)phase].fetch_add(nanoseconds, memory_order_relaxed);
+    if(layer != NoLayer)
+    {
+        this->m_layers[layer * LayerPhaseCount + (size_t)phase].fetch_add(nanoseconds, memory_order_relaxed);
+    }
+}
+
+void Telemetry::addLoss(const double& loss)
+{
+    this->m_loss.fetch_add(loss, memory_order_relaxed);
+}
+
+void Telemetry::endEpoch(const size_t& epoch, const double& seconds, const size_t& samples, const size_t& batches)
+{
+    EpochTelemetry e;
+    e.epoch = epoch;
+    e.seconds = seconds;
+    e.samples = samples;
+    e.batches = batches;
+    e.loss = samples ? this->m_loss.exchange(0) / samples : 0;
+    for(size_t p(0); p<PhaseCount; p++)
+    {
+        e.phaseSeconds[p] = this->m_phases[p].exchange(0) * 1e-9;
+    }
+    e.layerSeconds.resize(this->m_layerCount);
+    for(size_t l(0); l<this->m_layerCount; l++)
+    {
+        for(size_t p(0); p<LayerPhaseCount; p++)
+        {
+            e.layerSeconds[l][p] = this->m_layers[l * LayerPhaseCount + p].exchange(0) * 1e-9;
+        }
+    }
+    
+    if(this->m_json.is_open())
+    {
+        this->m_json << e.toJson() << endl;
+    }
+    this->m_epochs.push_back(e);
+}
@@ -0,0 +1,119 @@
+#include "threadpool.hpp"
+
+using namespace std;
+
+ThreadPool::ThreadPool(const size_t& size):
+m_task(nullptr),
+m_taskCount(0),
+m_generation(0),
+m_running(0),
+m_stop(false),
+m_next(0)
+{
+    for(size_t i(1); i<size; i++)
+    {
+        this->m_workers.emplace_back(&ThreadPool::_work, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(this->m_mutex);
+        this->m_stop = true;
+    }
+    this->m_start.notify_all();
+    for(thread& t:this->m_workers)
+    {
+        t.join();
+    }
+}
+
+size_t ThreadPool::size() const
+{
+    return this->m_workers.size() + 1;
+}
+
+void ThreadPool::run(const size_t& N, const function<void(size_t)>& task)
+{
+    if(this->m_workers.empty() or N == 1)
+    {
+        for(size_t i(0); i<N; i++)
+        {
+            task(i);
+        }
+        return;
+    }
+    
+    {
+        lock_guard<mutex> lock(this->m_mutex);
+        this->m_task = &task;
+        this->m_taskCount = N;
+        this->m_next = 0;
+        this->m_running = this->m_workers.size();
+        this->m_generation++;
+    }
+    this->m_start.notify_all();
+    
+    this->_consume();
+    
+    // Workers may still be inside task, which lives in the caller's frame : wait for them
+    // even when one of the tasks failed
+    exception_ptr error;
+    {
+        unique_lock<mutex> lock(this->m_mutex);
+        this->m_done.wait(lock, [this]{return this->m_running == 0;});
+        this->m_task = nullptr;
+        swap(error, this->m_error);
+    }
+    if(error)
+    {
+        rethrow_exception(error);
+    }
+}
+
+void ThreadPool::_consume()
+{
+    for(size_t i(this->m_next++); i<this->m_taskCount; i = this->m_next++)
+    {
+        try
+        {
+            (*this->m_task)(i);
+        }
+        catch(...)
+        {
+            // The first error is rethrown by run, the indices not started yet are dropped
+            lock_guard<mutex> lock(this->m_mutex);
+            if(!this->m_error)
+            {
+                this->m_error = current_exception();
+            }
+            this->m_next = this->m_taskCount;
+        }
+    }
+}
+
+void ThreadPool::_work()
+{
+    size_t generation(0);
+    while(true)
+    {
+        {
+            unique_lock<mutex> lock(this->m_mutex);
+            this->m_start.wait(lock, [&]{return this->m_stop or this->m_generation != generation;});
+            if(this->m_stop)
+            {
+                return;
+            }
+            generation = this->m_generation;
+        }
+        
+        this->_consume();
+        
+        {
+            lock_guard<mutex> lock(this->m_mutex);
+            this->m_running--;
+        }
+        this->m_done.notify_one();
+    }
+}